@@ -24,20 +24,25 @@
 #include "conversion-buffer.h"
 #include "util.h"
 
-BufferThread::BufferThread(int buffer_ahead)
-  : buffer_ahead_size_(buffer_ahead), current_work_buffer_(NULL) {
+BufferThread::BufferThread(int buffer_ahead, double idle_timeout)
+  : buffer_ahead_size_(buffer_ahead), idle_timeout_(idle_timeout),
+    current_work_buffer_(NULL) {
   pthread_cond_init(&enqueue_event_, NULL);
   pthread_cond_init(&picked_work_, NULL);
 }
 
 void BufferThread::EnqueueWork(ConversionBuffer *buffer) {
-  const off_t goal = buffer->MaxAccessed() + buffer_ahead_size_;
+  const off_t accessed = buffer->MaxAccessed();
+  const off_t goal = accessed + buffer_ahead_size_;
+  const double now = folve::CurrentTime();
   folve::MutexLock l(&mutex_);
   bool found = false;
   // This is O(n), but n is typically in the order of max=4
   for (WorkQueue::iterator it = queue_.begin(); it != queue_.end(); ++it) {
     if (it->buffer == buffer) {
       it->goal = goal;  // Already in queue; update goal.
+      it->last_accessed = accessed;
+      it->last_progress = now;
       found = true;
       break;
     }
@@ -46,11 +51,19 @@ void BufferThread::EnqueueWork(ConversionBuffer *buffer) {
     WorkItem new_work;
     new_work.buffer = buffer;
     new_work.goal = goal;
+    new_work.last_accessed = accessed;
+    new_work.last_progress = now;
     queue_.push_back(new_work);
     pthread_cond_signal(&enqueue_event_);
   }
 }
 
+void BufferThread::EnqueueTask(Task *task) {
+  folve::MutexLock l(&mutex_);
+  tasks_.push_back(task);
+  pthread_cond_signal(&enqueue_event_);
+}
+
 void BufferThread::Forget(ConversionBuffer *buffer) {
   folve::MutexLock l(&mutex_);
   // If this was currently what we were working on, wait until that is gone
@@ -74,25 +87,55 @@ void BufferThread::Run() {
   const int kBufferChunk = (8 << 10);
   for (;;) {
     WorkItem work;
+    Task *task = NULL;
     {
       folve::MutexLock l(&mutex_);
-      while (queue_.empty()) {
+      while (queue_.empty() && tasks_.empty()) {
         mutex_.WaitOn(&enqueue_event_);
       }
-      work = queue_.front();
-      current_work_buffer_ = work.buffer;
-      pthread_cond_signal(&picked_work_);
+      if (!tasks_.empty()) {
+        task = tasks_.front();
+        tasks_.pop_front();
+      } else {
+        work = queue_.front();
+        current_work_buffer_ = work.buffer;
+        pthread_cond_signal(&picked_work_);
+      }
+    }
+    if (task != NULL) {
+      // Not holding any lock: tasks might open and close files, which can
+      // mean waiting for us to Forget() buffers.
+      task->Run();
+      delete task;
+      continue;
+    }
+
+    // If nobody read from this buffer for a while, the reader probably went
+    // away (or paused). Don't burn CPU on it; if reading continues, we'll
+    // be asked again.
+    const off_t accessed = work.buffer->MaxAccessed();
+    const double now = folve::CurrentTime();
+    const bool stale = (accessed == work.last_accessed && idle_timeout_ > 0
+                        && now - work.last_progress > idle_timeout_);
+    if (stale) {
+      folve::DLogf("Stop pre-buffering; not read for %.0f seconds.",
+                   now - work.last_progress);
     }
 
     // We only do one chunk at the time so that the main thread has a chance to
     // get into there and _we_ can round-robin through all work scheduled.
     const bool work_complete
-      = (work.buffer->FillUntil(work.buffer->FileSize() + kBufferChunk)
+      = (stale
+         || work.buffer->FillUntil(work.buffer->FileSize() + kBufferChunk)
          || work.buffer->FileSize() >= work.goal);
 
     {
       folve::MutexLock l(&mutex_);
       assert(queue_.front().buffer == current_work_buffer_);
+      if (accessed != queue_.front().last_accessed) {
+        queue_.front().last_accessed = accessed;
+        queue_.front().last_progress = now;
+      }
       if (!work_complete) { // More work to do ? Re-schedule.
         queue_.push_back(queue_.front());
       }
@@ -28,7 +28,10 @@ class ConversionBuffer;
 // NOTE: runs forever the whole program lifetime; does not provide a way to quit.
 class BufferThread : public folve::Thread {
 public:
-  BufferThread(int buffer_ahead);
+  // Buffer "buffer_ahead" bytes beyond what was read. Buffers that have not
+  // been read from for "idle_timeout" seconds are dropped from the work queue
+  // (if positive).
+  BufferThread(int buffer_ahead, double idle_timeout);
 
   // Enqueue a conversion buffer to work on.
   void EnqueueWork(ConversionBuffer *buffer);
@@ -36,6 +39,17 @@ public:
   // If the given buffer is enqueued, forget about it. We don't need it anymore.
   void Forget(ConversionBuffer *buffer);
 
+  // Something to be done in this thread, while not working on any buffer.
+  class Task {
+  public:
+    virtual ~Task() {}
+    virtual void Run() = 0;
+  };
+
+  // Enqueue a task; it is run before we continue with buffers. Takes
+  // ownership.
+  void EnqueueTask(Task *task);
+
  protected:
   virtual void Run();
 
@@ -43,13 +57,17 @@ private:
   struct WorkItem {
     ConversionBuffer *buffer;
     off_t goal;
+    off_t last_accessed;   // MaxAccessed() when we last saw progress.
+    double last_progress;  // .. and the time that was.
   };
   typedef std::list<WorkItem> WorkQueue;
 
   const int buffer_ahead_size_;
+  const double idle_timeout_;
 
   folve::Mutex mutex_;
   WorkQueue queue_;   // crude initial impl. of work-queue
+  std::list<Task*> tasks_;
   pthread_cond_t enqueue_event_;
 
   pthread_cond_t picked_work_;
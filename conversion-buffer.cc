@@ -108,7 +108,9 @@ ssize_t ConversionBuffer::Append(const void *data, size_t count) {
     remaining -= w;
     buf += w;
   }
-  total_written_ += count;
+  // Publish only after the data is in the file, so that readers that see
+  // the new size without taking the lock find the bytes there.
+  __atomic_store_n(&total_written_, total_written_ + count, __ATOMIC_RELEASE);
   return count;
 }
 
@@ -122,47 +124,60 @@ ssize_t ConversionBuffer::SndAppend(const void *data, size_t count) {
   return Append(data, count);
 }
 
-void ConversionBuffer::HeaderFinished() { header_end_ = FileSize(); }
+void ConversionBuffer::HeaderFinished() {
+  __atomic_store_n(&header_end_, FileSize(), __ATOMIC_RELEASE);
+}
 
-// The following are rather informal; because we access them in
-// StatusServer:
-//  FileCacheHandler::GetHandlerStatus() -> ConversionBuffer::FileSize()
-// PreBufferThread:
-//  ConversionBuffer::FillUntil() -> FileHandlerCache::FindAndPin
-// We don't lock these values here.
+// The mutex is held by FillUntil() for as long as it convolves. Everything
+// readers of already converted data need is accessed atomically instead, so
+// that they never have to wait for that.
 off_t ConversionBuffer::FileSize() const {
-  return total_written_;
+  return __atomic_load_n(&total_written_, __ATOMIC_ACQUIRE);
 }
 
 off_t ConversionBuffer::MaxAccessed() const {
-  return max_accessed_;
+  return __atomic_load_n(&max_accessed_, __ATOMIC_RELAXED);
+}
+
+bool ConversionBuffer::IsReadAvailable(size_t size, off_t offset) const {
+  return IsFileComplete() || FileSize() >= RequiredForRead(size, offset);
 }
 
 void ConversionBuffer::NotifyFileComplete() {
-  folve::MutexLock l(&mutex_);
-  file_complete_ = true;
+  __atomic_store_n(&file_complete_, true, __ATOMIC_RELEASE);
 }
 
 bool ConversionBuffer::IsFileComplete() const {
-  folve::MutexLock l(&mutex_);
-  return file_complete_;
+  return __atomic_load_n(&file_complete_, __ATOMIC_ACQUIRE);
 }
 
-bool ConversionBuffer::FillUntil(off_t requested_min_written) {
+bool ConversionBuffer::FillUntil(off_t requested_min_written,
+                                 const bool *cancelled) {
   // As soon as someone tries to read beyond of what we already have, we call
   // the callback that fills more of it.
+  // Data we already have doesn't need the lock.
+  if (IsFileComplete() || FileSize() >= requested_min_written)
+    return IsFileComplete();
   // We are shared between potentially several open files. Serialize threads.
   folve::MutexLock l(&mutex_);
-  while (!file_complete_ && total_written_ < requested_min_written) {
+  while (!IsFileComplete() && FileSize() < requested_min_written) {
+    if (cancelled && __atomic_load_n(cancelled, __ATOMIC_RELAXED))
+      break;
     if (!source_->AddMoreSoundData()) {
-      file_complete_ = true;
+      NotifyFileComplete();
       break;
     }
   }
-  return file_complete_;
+  return IsFileComplete();
+}
+
+off_t ConversionBuffer::RequiredForRead(size_t size, off_t offset) const {
+  const off_t header_end = __atomic_load_n(&header_end_, __ATOMIC_ACQUIRE);
+  return offset + (offset >= header_end ? size : 1);
 }
 
-ssize_t ConversionBuffer::Read(char *buf, size_t size, off_t offset) {
+ssize_t ConversionBuffer::Read(char *buf, size_t size, off_t offset,
+                               const bool *cancelled) {
   // As long as we're reading only within the header area, allow 'short' reads,
   // i.e. reads that return less bytes than requested (but up to the headers'
   // size). That means:
@@ -176,16 +191,22 @@ ssize_t ConversionBuffer::Read(char *buf, size_t size, off_t offset) {
   // to work around it). So that means in that case we make sure that we have
   // at least the number of bytes available that are requested:
   //     required_min_written = offset + size;  // all requested bytes.
-  const off_t required_min_written = offset + (offset >= header_end_ ? size : 1);
-
-  FillUntil(required_min_written);
+  const off_t required_min_written = RequiredForRead(size, offset);
+  if (!FillUntil(required_min_written, cancelled)
+      && FileSize() < required_min_written) {
+    return -EINTR;  // Only reason to return early.
+  }
 
   const ssize_t read_result = pread(out_filedes_, buf, size, offset);
   if (read_result > 0) {
     const off_t new_max_accessed = offset + read_result;
-    if (new_max_accessed > max_accessed_) {
-      folve::MutexLock l(&mutex_);
-      max_accessed_ = new_max_accessed;
+    off_t max_accessed = MaxAccessed();
+    while (new_max_accessed > max_accessed
+           && !__atomic_compare_exchange_n(&max_accessed_, &max_accessed,
+                                           new_max_accessed, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+      // Someone else moved it; retry with the value they left.
     }
   }
   return read_result;
@@ -60,8 +60,14 @@ public:
   ~ConversionBuffer();
 
   // Read data from buffer. Can block and call the SoundSource first to get
-  // more data if needed.
-  ssize_t Read(char *buf, size_t size, off_t offset);
+  // more data if needed. If "cancelled" is not NULL, gives up waiting
+  // for more data and returns -EINTR as soon as another thread sets it
+  // to true.
+  ssize_t Read(char *buf, size_t size, off_t offset, const bool *cancelled);
+
+  // Returns true if Read() with these parameters can be answered from
+  // the data available right now, without having to convolve more.
+  bool IsReadAvailable(size_t size, off_t offset) const;
 
   // Append data. Usually called via the SndWrite() virtual-SNFFILE callback,
   // but can be used to write raw data as well (e.g. to write headers in
@@ -73,8 +79,9 @@ public:
   void WriteCharAt(unsigned char c, off_t offset);
 
   // Fill read file until we have the required bytes available.
-  // Return 'true' if file is complete
-  bool FillUntil(off_t requested_min_written);
+  // Return 'true' if file is complete. Stops early if "cancelled" is not
+  // NULL and becomes true.
+  bool FillUntil(off_t requested_min_written, const bool *cancelled = NULL);
 
   // Enable writing through the SNDFILE.
   // If set to 'false', writes via the SNDFILE are ignored.
@@ -107,6 +114,9 @@ private:
   static sf_count_t SndTell(void *userdata);
   static sf_count_t SndWrite(const void *ptr, sf_count_t count, void *userdata);
 
+  // Minimum file size we need to answer a Read().
+  off_t RequiredForRead(size_t size, off_t offset) const;
+
   // Append for the SndWrite callback.
   ssize_t SndAppend(const void *data, size_t count);
 
@@ -117,11 +127,13 @@ private:
   SoundSource *const source_;
   int out_filedes_;
   bool snd_writing_enabled_;
+  // The following are accessed atomically, so that readers don't need
+  // mutex_. Apart from max_accessed_, they are only written while filling.
   off_t total_written_;
   off_t max_accessed_;
   off_t header_end_;
   bool file_complete_;
-  mutable folve::Mutex mutex_;
+  mutable folve::Mutex mutex_;  // Serializes filling the buffer.
 };
 
 #endif  // FOLVE_CONVERSION_BUFFER_H
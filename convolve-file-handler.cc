@@ -22,10 +22,17 @@
 #include <sndfile.h>
 #include <string.h>
 #include <syslog.h>
-#include <assert.h>
+
+#include <algorithm>
 
 #include "conversion-buffer.h"
+#include "flac-decoder.h"
 #include "folve-filesystem.h"
+#include "gapless-lead-in.h"
+#include "input-decoder.h"
+#include "mapped-pcm-decoder.h"
+#include "pcm-quantizer.h"
+#include "segment-converter.h"
 #include "sound-processor.h"
 #include "util.h"
 #include "zita-config.h"
@@ -44,7 +51,10 @@
 
 using folve::DLogf;
 using folve::Appendf;
-using folve::StringPrintf;
+
+// Filters with infinite impulse response remember the past forever; but
+// after this time, what is left of it is far below what we can hear.
+static const int kIirLeadInSeconds = 1;
 
 // Attempt to create a ConvolveFileHandler from the given file descriptor. This
 // returns NULL if this is not a sound-file or if there is no available
@@ -58,8 +68,9 @@ FileHandler *ConvolveFileHandler::Create(FolveFilesystem *fs,
                                          const std::string &zita_config_dir,
                                          HandlerStats *partial_file_info) {
   SF_INFO in_info;
-  memset(&in_info, 0, sizeof(in_info));
-  SNDFILE *snd = sf_open_fd(filedes, SFM_READ, &in_info, 0);
+  PrefetchReader *input_reader = NULL;
+  InputDecoder *decoder = NULL;
+  SNDFILE *snd = OpenInput(filedes, &in_info, &input_reader, &decoder);
   if (snd == NULL) {
     DLogf("File %s: %s", underlying_file.c_str(), sf_strerror(NULL));
     partial_file_info->message = sf_strerror(NULL);
@@ -80,6 +91,19 @@ FileHandler *ConvolveFileHandler::Create(FolveFilesystem *fs,
                   &partial_file_info->message);
   if (processor == NULL) {
     sf_close(snd);
+    delete decoder;
+    delete input_reader;
+    return NULL;
+  }
+  if (processor->is_identity()) {
+    // Nothing to convolve; better serve the original file.
+    DLogf("File %s: filter %s is identity; passing through.",
+          underlying_file.c_str(), processor->config_file().c_str());
+    partial_file_info->filter_info = "identity; original file";
+    fs->processor_pool()->Return(processor);
+    sf_close(snd);
+    delete decoder;
+    delete input_reader;
     return NULL;
   }
   const int seconds = in_info.frames / in_info.samplerate;
@@ -88,21 +112,55 @@ FileHandler *ConvolveFileHandler::Create(FolveFilesystem *fs,
         seconds / 60, seconds % 60,
         processor->config_file().c_str());
   return new ConvolveFileHandler(fs, fs_path, filter_subdir,
-                                 underlying_file, filedes, snd, in_info,
+                                 underlying_file, filedes, input_reader,
+                                 decoder, snd, in_info,
                                  *partial_file_info, processor);
 }
 
+// Local uncompressed files are decoded directly from a memory mapping.
+// Everything else is read through a PrefetchReader; FLAC is decoded with
+// libFLAC, other formats with libsndfile.
+SNDFILE *ConvolveFileHandler::OpenInput(int filedes, SF_INFO *in_info,
+                                        PrefetchReader **input_reader,
+                                        InputDecoder **decoder) {
+  *input_reader = NULL;
+  *decoder = NULL;
+  memset(in_info, 0, sizeof(*in_info));
+  MappedPcmDecoder *mapped = MappedPcmDecoder::Create(filedes);
+  if (mapped != NULL) {
+    SNDFILE *snd = mapped->OpenSoundfile(in_info);
+    if (snd != NULL) {
+      *decoder = mapped;
+      return snd;
+    }
+    delete mapped;
+    memset(in_info, 0, sizeof(*in_info));
+  }
+  PrefetchReader *reader = new PrefetchReader(filedes);
+  SNDFILE *snd = reader->OpenSoundfile(in_info);
+  if (snd == NULL) {
+    delete reader;
+    return NULL;
+  }
+  *input_reader = reader;
+  if ((in_info->format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC) {
+    *decoder = FlacDecoder::Create(reader, in_info->channels);
+  }
+  if (*decoder == NULL) {
+    *decoder = new SndfileDecoder(snd, in_info->channels);
+  }
+  return snd;
+}
+
 ConvolveFileHandler::~ConvolveFileHandler() {
   output_buffer_->NotifyFileComplete();
   fs_->QuitBuffering(output_buffer_);  // stop working on our files.
   Close();                             // ... so that we can close them :)
   delete output_buffer_;
+  delete output_quantizer_;
 }
 
-int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
-  if (error_) return -1;
-  const off_t current_filesize = output_buffer_->FileSize();
-  const off_t read_horizon = offset + size;
+bool ConvolveFileHandler::IsSkipToEnd(size_t size, off_t offset) {
   // If this is a skip suspiciously at the very end of the file as
   // reported by stat, we don't do any encoding, just return garbage.
   // (otherwise we'd to convolve up to that point).
@@ -113,8 +171,25 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
   static const int kFudgeOverhang = 512;
   // But of course only if this is really a skip, not a regular approaching
   // end-of-file.
-  if (current_filesize < offset
-      && (int) (read_horizon + kFudgeOverhang) >= file_stat_.st_size) {
+  return (output_buffer_->FileSize() < offset
+          && (int) (offset + size + kFudgeOverhang) >= file_stat_.st_size);
+}
+
+bool ConvolveFileHandler::IsReadAvailable(size_t size, off_t offset) {
+  return (error_ || IsSkipToEnd(size, offset)
+          || output_buffer_->IsReadAvailable(size, offset));
+}
+
+int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
+  return ReadCancellable(buf, size, offset, NULL);
+}
+
+int ConvolveFileHandler::ReadCancellable(char *buf, size_t size, off_t offset,
+                                         const bool *cancelled) {
+  if (error_) return -1;
+  const off_t current_filesize = output_buffer_->FileSize();
+  const off_t read_horizon = offset + size;
+  if (IsSkipToEnd(size, offset)) {
     const int pretended_bytes = std::min((off_t)size,
                                          file_stat_.st_size - offset);
     if (pretended_bytes > 0) {
@@ -127,7 +202,8 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
 
   // The following read might block and call WriteToSoundfile() until the
   // buffer is filled.
-  int result = output_buffer_->Read(buf, size, offset);
+  int result = output_buffer_->Read(buf, size, offset, cancelled);
+  PublishStats();
 
   // Only if the user obviously read beyond our header, we start the
   // pre-buffering; otherwise things will get sluggish because any header
@@ -136,9 +212,9 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
   //
   // In general, this is a fine heuristic: this happens the first time we
   // access the file, the first or second stream-read should trigger the
-  // pre-buffering (64k is less than a second music). If we're in gapless
-  // mode, we already start pre-buffering anyway early (see
-  // NotifyPassedProcessorUnreferenced()) - so that important use-case is
+  // pre-buffering (64k is less than a second music). Files that are likely
+  // played next, e.g. in gapless mode, we already start pre-buffering
+  // early (see PrebufferNextFiles()) - so that important use-case is
   // covered.
   const off_t well_beyond_header = output_buffer_->HeaderSize() + (64 << 10);
   const bool should_request_prebuffer = read_horizon > well_beyond_header
@@ -153,36 +229,37 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
 void ConvolveFileHandler::GetHandlerStatus(HandlerStats *stats) {
   const off_t file_size = output_buffer_->FileSize();
   const off_t max_access = output_buffer_->MaxAccessed();
-  if (processor_ != NULL) {
-    base_stats_.max_output_value = processor_->max_output_value();
+  int frames_left;
+  {
+    folve::MutexLock l(&stats_mutex_);
+    *stats = base_stats_;
+    if (processor_ != NULL) {
+      stats->max_output_value = std::max(stats->max_output_value,
+                                         processor_->max_output_value());
+    }
+    frames_left = input_frames_left_;
   }
-  *stats = base_stats_;
-  const int frames_done = in_info_.frames - frames_left();
-  if (frames_done == 0 || in_info_.frames == 0) {
+  const int frames_done = in_info_.frames - frames_left;
+  if (frames_done == 0 || in_info_.frames == 0 || file_size == 0) {
     stats->buffer_progress = 0.0;
     stats->access_progress = 0.0;
   } else {
     stats->buffer_progress = 1.0 * frames_done / in_info_.frames;
     stats->access_progress = stats->buffer_progress * max_access / file_size;
   }
-
-  if (base_stats_.max_output_value > 1.0) {
-    // TODO: the status server could inspect this value and make better
-    // rendering.
-    base_stats_.message =
-      StringPrintf("Output clipping! "
-                   "(max=%.3f; Multiply gain with <= %.5f<br/>in %s)",
-                   base_stats_.max_output_value,
-                   1.0 / base_stats_.max_output_value,
-                   processor_ != NULL
-                   ? processor_->config_file().c_str()
-                   : "filter");
-  }
 }
 
 int ConvolveFileHandler::Stat(struct stat *st) {
   const off_t current_file_size = output_buffer_->FileSize();
-  if (current_file_size > start_estimating_size_) {
+  if (IsContentStable()) {
+    // No need to guess anymore. Clients that keep the file in the page
+    // cache need the exact size.
+    file_stat_.st_size = current_file_size;
+  } else if (size_known_) {
+    if (current_file_size > file_stat_.st_size) {  // Should not happen.
+      file_stat_.st_size = current_file_size;
+    }
+  } else if (current_file_size > start_estimating_size_) {
     const int frames_done = in_info_.frames - frames_left();
     if (frames_done > 0) {
       const float estimated_end = 1.0 * in_info_.frames / frames_done;
@@ -199,21 +276,43 @@ int ConvolveFileHandler::Stat(struct stat *st) {
   return 0;
 }
 
+bool ConvolveFileHandler::IsContentStable() {
+  folve::MutexLock l(&stats_mutex_);
+  return output_complete_;
+}
+
+int64_t ConvolveFileHandler::InvestedWork() {
+  const int64_t frames_done = in_info_.frames - frames_left();
+  return frames_done * in_info_.channels;
+}
+
+off_t ConvolveFileHandler::BytesHeld() {
+  return output_buffer_->FileSize();
+}
+
 // TODO(hzeller): trim parameter list.
 ConvolveFileHandler::ConvolveFileHandler(FolveFilesystem *fs,
                                          const char *fs_path,
                                          const std::string &filter_dir,
                                          const std::string &underlying_file,
-                                         int filedes, SNDFILE *snd_in,
+                                         int filedes,
+                                         PrefetchReader *input_reader,
+                                         InputDecoder *decoder,
+                                         SNDFILE *snd_in,
                                          const SF_INFO &in_info,
                                          const HandlerStats &file_info,
                                          SoundProcessor *processor)
-  : FileHandler(filter_dir), fs_(fs),
-    filedes_(filedes), snd_in_(snd_in), in_info_(in_info),
+  : FileHandler(filter_dir), fs_(fs), underlying_file_(underlying_file),
+    filedes_(filedes), input_reader_(input_reader), decoder_(decoder),
+    snd_in_(snd_in),
+    in_info_(in_info),
   base_stats_(file_info),
-  error_(false), output_buffer_(NULL),
-  snd_out_(NULL), processor_(processor),
-  input_frames_left_(in_info.frames) {
+  error_(false), output_complete_(false), output_buffer_(NULL),
+  snd_out_(NULL), output_quantizer_(NULL), processor_(processor),
+  input_frames_left_(in_info.frames), lead_in_(NULL),
+  segment_converter_(NULL), segment_end_(0) {
+  base_stats_.config_file = processor->config_file();
+  base_stats_.filter_info = processor->filter_info();
 
   // Initial stat that we're going to report to clients. We'll adapt
   // the filesize as we see it grow. Some clients continuously monitor
@@ -221,7 +320,15 @@ ConvolveFileHandler::ConvolveFileHandler(FolveFilesystem *fs,
   fstat(filedes_, &file_stat_);
   start_estimating_size_ = 0.4 * file_stat_.st_size;
   original_file_size_ = file_stat_.st_size;
-  file_stat_.st_size *= fs->file_oversize_factor();
+  filter_stamp_ = fs->FilterStamp(filter_dir);
+  off_t known_size;
+  size_known_ = fs->GetKnownOutputSize(underlying_file, filter_dir,
+                                       file_stat_, &known_size);
+  if (size_known_) {
+    file_stat_.st_size = known_size;  // No guessing needed.
+  } else {
+    file_stat_.st_size *= fs->file_oversize_factor();
+  }
 
   // The flac header we get is more rich than what we can create via
   // sndfile. So if we have one, just copy it.
@@ -263,9 +370,11 @@ void ConvolveFileHandler::SetOutputSoundfile(ConversionBuffer *out_buffer,
   if (snd_out_ == NULL) {
     error_ = true;
     syslog(LOG_ERR, "Opening output: %s", sf_strerror(NULL));
+    folve::MutexLock l(&stats_mutex_);
     base_stats_.message = sf_strerror(NULL);
     return;
   }
+  output_quantizer_ = PcmQuantizer::Create(info.format, fs_->dither_output());
   if (copy_flac_header_verbatim_) {
     out_buffer->set_sndfile_writes_enabled(false);
     CopyFlacHeader(out_buffer);
@@ -325,101 +434,164 @@ bool ConvolveFileHandler::HasStarted() {
   return in_info_.frames != input_frames_left_;
 }
 
-bool ConvolveFileHandler::PassoverProcessor(SoundProcessor *passover_processor) {
-  if (HasStarted()) {
-    DLogf("Gapless attempt: Cannot bridge gap to already open file %s",
-          base_stats_.filename.c_str());
-    return false;
+void ConvolveFileHandler::RequestPrebuffer() {
+  fs_->RequestPrebuffer(output_buffer_);
+}
+
+void ConvolveFileHandler::JoinPreviousFile() {
+  std::string previous_path;
+  if (!fs_->FindPreviousFile(base_stats_.filename, &previous_path))
+    return;
+  const int history = processor_->history_frames();
+  const int frames = (history >= 0
+                      ? history : kIirLeadInSeconds * in_info_.samplerate);
+  lead_in_ = GaplessLeadIn::Create(
+                 fs_->GetUnderlyingFile(previous_path.c_str()),
+                 in_info_, frames);
+  if (lead_in_ == NULL)
+    return;
+  DLogf("Gapless: '%s' continues where alphabetically previous '%s' ends "
+        "(%d frames lead-in)", base_stats_.filename.c_str(),
+        previous_path.c_str(), lead_in_->frames());
+  folve::MutexLock l(&stats_mutex_);
+  base_stats_.in_gapless = true;
+}
+
+void ConvolveFileHandler::PrebufferNextFiles() {
+  std::string next_path;
+  if (fs_->gapless_processing()
+      && fs_->FindNextFile(base_stats_.filename, &next_path)) {
+    folve::MutexLock l(&stats_mutex_);
+    base_stats_.out_gapless = true;
   }
-  assert(processor_);
-  if (passover_processor->config_file() != processor_->config_file()
-      || (passover_processor->config_file_timestamp()
-          != processor_->config_file_timestamp())) {
-    DLogf("Gapless: Configuration changed; can't use %p to join gapless.",
-          passover_processor);
-    return false;
+  fs_->PrebufferNextFiles(base_stats_.filename);
+}
+
+void ConvolveFileHandler::StartSegmentConversion() {
+  // Only local uncompressed files can be decoded from anywhere in parallel.
+  MappedPcmDecoder *mapped = dynamic_cast<MappedPcmDecoder*>(decoder_);
+  const int fragment = processor_->fragment_size();
+  // The last, partial fragment is converted as usual.
+  const int64_t end = in_info_.frames - in_info_.frames % fragment;
+  if (fs_->segment_workers() < 2 || mapped == NULL
+      || processor_->history_frames() < 0 || end == 0) {
+    return;
   }
-  // Ok, so don't use the processor we already have, but use the other one.
-  fs_->processor_pool()->Return(processor_);
-  processor_ = passover_processor;
-  if (!processor_->is_input_buffer_complete()) {
-    // Fill with our beginning so that the donor can finish its processing.
-    input_frames_left_ -= processor_->FillBuffer(snd_in_);
+  std::vector<SoundProcessor*> processors;
+  processors.push_back(processor_);
+  while ((int) processors.size() < fs_->segment_workers()) {
+    SoundProcessor *processor = fs_->processor_pool()
+      ->GetOrCreateFromConfig(processor_->config_file(),
+                              in_info_.samplerate, in_info_.channels);
+    if (processor == NULL) break;
+    if (processor->config_file_timestamp()
+        != processor_->config_file_timestamp()) {
+      fs_->processor_pool()->Return(processor);  // Config changed meanwhile.
+      break;
+    }
+    processors.push_back(processor);
   }
-  base_stats_.in_gapless = true;
-  return true;
+  segment_processors_.assign(processors.begin() + 1, processors.end());
+  if (segment_processors_.empty()) return;
+  segment_converter_ = new SegmentConverter(mapped, processors, lead_in_);
+  segment_end_ = end;
+  DLogf("File %s: converting in %d parallel segments of %lld frames.",
+        base_stats_.filename.c_str(), segment_converter_->segments(),
+        (long long) (segment_converter_->round_frames()
+                     / segment_converter_->segments()));
 }
 
-void ConvolveFileHandler::NotifyPassedProcessorUnreferenced() {
-  // This is gapless. Good idea to pre-buffer the beginning.
-  fs_->RequestPrebuffer(output_buffer_);
+bool ConvolveFileHandler::AddSegmentSoundData() {
+  // One segment per call, so that readers get each as soon as it is done
+  // and can give up in between; the rest of the round is converted in the
+  // background meanwhile.
+  if (!segment_converter_->round_pending()) {
+    const int64_t start = in_info_.frames - input_frames_left_;
+    segment_converter_->StartRound(
+      start, std::min(start + segment_converter_->round_frames(),
+                      segment_end_));
+  }
+  const int segment = segment_converter_->FinishSegment();
+  const int frames = segment_converter_->output_frames(segment);
+  if (frames > 0) {
+    const int channels = processor_->output_channels();
+    if (output_quantizer_) {
+      output_quantizer_->WriteFrames(snd_out_,
+                                     segment_converter_->output(segment),
+                                     frames, channels);
+    } else {
+      sf_writef_float(snd_out_, segment_converter_->output(segment), frames);
+    }
+  }
+  stats_mutex_.Lock();
+  base_stats_.max_output_value
+    = std::max(base_stats_.max_output_value,
+               segment_converter_->max_output_value(segment));
+  input_frames_left_ -= segment_converter_->input_frames(segment);
+  stats_mutex_.Unlock();
+  if (!segment_converter_->round_pending()
+      && in_info_.frames - input_frames_left_ == segment_end_) {
+    if (input_frames_left_ > 0) {
+      // Continue as usual with the rest.
+      segment_converter_->Prime(processor_, segment_end_);
+      dynamic_cast<MappedPcmDecoder*>(decoder_)->Seek(segment_end_);
+    }
+    EndSegmentConversion();
+  }
+  if (input_frames_left_ == 0) {
+    Close();
+  }
+  PublishStats();
+  return input_frames_left_;
 }
 
-static bool ExtractDirAndSuffix(const std::string &filename,
-                                std::string *dir, std::string *suffix) {
-  const std::string::size_type slash_pos = filename.find_last_of('/');
-  if (slash_pos == std::string::npos) return false;
-  *dir = filename.substr(0, slash_pos + 1);
-  const std::string::size_type dot_pos = filename.find_last_of('.');
-  if (dot_pos != std::string::npos && dot_pos > slash_pos) {
-    *suffix = filename.substr(dot_pos);
+void ConvolveFileHandler::EndSegmentConversion() {
+  delete segment_converter_;
+  segment_converter_ = NULL;
+  for (size_t i = 0; i < segment_processors_.size(); ++i) {
+    fs_->processor_pool()->Return(segment_processors_[i]);
   }
-  return true;
+  segment_processors_.clear();
 }
 
 bool ConvolveFileHandler::AddMoreSoundData() {
   if (!input_frames_left_)
     return false;
-  if (processor_->pending_writes() > 0) {
-    processor_->WriteProcessed(snd_out_, processor_->pending_writes());
-    return input_frames_left_;
+  if (input_reader_ != NULL) {
+    input_reader_->StartPrefetch();  // Now we read the whole file.
   }
-  const int r = processor_->FillBuffer(snd_in_);
+  if (!HasStarted() && segment_converter_ == NULL) {
+    if (fs_->gapless_processing() && lead_in_ == NULL) {
+      JoinPreviousFile();
+    }
+    StartSegmentConversion();
+    if (segment_converter_ == NULL && lead_in_ != NULL) {
+      lead_in_->Prime(processor_);
+    }
+  }
+  if (segment_converter_ != NULL) {
+    return AddSegmentSoundData();
+  }
+  const int r = processor_->FillBuffer(decoder_);
   if (r == 0) {
     syslog(LOG_ERR, "Expected %d frames left, "
            "but got EOF; corrupt file '%s' ?",
            input_frames_left_, base_stats_.filename.c_str());
+    stats_mutex_.Lock();
     base_stats_.message = "Premature EOF in input file.";
     input_frames_left_ = 0;
+    stats_mutex_.Unlock();
     Close();
     return false;
   }
   stats_mutex_.Lock();
   input_frames_left_ -= r;
   stats_mutex_.Unlock();
-  if (!input_frames_left_ && !processor_->is_input_buffer_complete()
-      && fs_->gapless_processing()) {
-    typedef std::set<std::string> DirSet;
-    DirSet dirset;
-    std::string fs_dir, file_suffix;
-    FileHandler *next_file = NULL;
-    DirSet::const_iterator found;
-    const bool passed_processor
-      = (ExtractDirAndSuffix(base_stats_.filename, &fs_dir, &file_suffix)
-         && fs_->ListDirectory(fs_dir, file_suffix, &dirset)
-         && (found = dirset.upper_bound(base_stats_.filename)) != dirset.end()
-         && (next_file = fs_->GetOrCreateHandler(found->c_str(), true))
-         && next_file->PassoverProcessor(processor_));
-    if (passed_processor) {
-      DLogf("Processor %p: Gapless pass-on from "
-            "'%s' to alphabetically next '%s'", processor_,
-            base_stats_.filename.c_str(), found->c_str());
-    }
-    processor_->WriteProcessed(snd_out_, r);
-    if (passed_processor) {
-      base_stats_.out_gapless = true;
-      SaveOutputValues();
-      processor_ = NULL;   // we handed over ownership.
-      Close();  // make sure that our thread is done.
-      next_file->NotifyPassedProcessorUnreferenced();
-    }
-    if (next_file) fs_->Close(found->c_str(), next_file);
-  } else {
-    processor_->WriteProcessed(snd_out_, r);
-  }
+  processor_->WriteProcessed(snd_out_, r, output_quantizer_);
   if (input_frames_left_ == 0) {
     Close();
   }
+  PublishStats();
   return input_frames_left_;
 }
 
@@ -495,15 +667,23 @@ void ConvolveFileHandler::GenerateHeaderFromInputFile(
 }
 
 void ConvolveFileHandler::SaveOutputValues() {
+  folve::MutexLock l(&stats_mutex_);
   if (processor_) {
-    base_stats_.max_output_value = processor_->max_output_value();
+    base_stats_.max_output_value = std::max(base_stats_.max_output_value,
+                                            processor_->max_output_value());
     processor_->ResetMaxValues();
   }
 }
 
 void ConvolveFileHandler::Close() {
   if (snd_out_ == NULL) return;  // done.
+  EndSegmentConversion();
+  stats_mutex_.Lock();
+  // If not, we're closed before the end, e.g. the handler is deleted.
+  const bool reached_end = (input_frames_left_ == 0);
   input_frames_left_ = 0;
+  const bool in_gapless = base_stats_.in_gapless;
+  stats_mutex_.Unlock();
   SaveOutputValues();
   if (base_stats_.max_output_value > 1.0) {
     syslog(LOG_ERR, "Observed output clipping in '%s': "
@@ -513,13 +693,31 @@ void ConvolveFileHandler::Close() {
            processor_ != NULL ? processor_->config_file().c_str() : "filter");
   }
   fs_->processor_pool()->Return(processor_);
+  stats_mutex_.Lock();
   processor_ = NULL;
+  stats_mutex_.Unlock();
+  delete lead_in_;
+  lead_in_ = NULL;
   // We can't disable buffer writes here, because outfile closing will flush
   // the last couple of sound samples.
   if (snd_in_) sf_close(snd_in_);
   if (snd_out_) sf_close(snd_out_);
   snd_out_ = NULL;
+  delete decoder_;
+  delete input_reader_;
   close(filedes_);
+  stats_mutex_.Lock();
+  output_complete_ = reached_end && !error_;
+  stats_mutex_.Unlock();
+
+  if (reached_end && !error_) {
+    PrebufferNextFiles();
+    struct stat source_stat = file_stat_;
+    source_stat.st_size = original_file_size_;
+    fs_->size_index()->Record(underlying_file_, filter_dir(), filter_stamp_,
+                              source_stat, output_buffer_->FileSize(),
+                              in_gapless ? SizeIndex::GAPLESS : 0);
+  }
 
   const double factor = 1.0 * output_buffer_->FileSize() / original_file_size_;
   if (factor > fs_->file_oversize_factor()) {
@@ -532,6 +730,7 @@ void ConvolveFileHandler::Close() {
            (long long)output_buffer_->FileSize(), factor,
            base_stats_.filename.c_str(), factor);
   }
+  PublishStats(true);
 }
 
 bool ConvolveFileHandler::LooksLikeInputIsFlac(const SF_INFO &sndinfo,
@@ -22,17 +22,26 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <vector>
+
 #include "file-handler.h"
 #include "conversion-buffer.h"
+#include "prefetch-reader.h"
 
 class FolveFilesystem;
+class GaplessLeadIn;
+class InputDecoder;
+class PcmQuantizer;
+class SegmentConverter;
+class SoundProcessor;
 
 class ConvolveFileHandler : public FileHandler,
                             public ConversionBuffer::SoundSource {
 public:
   // Attempt to create a ConvolveFileHandler from the given file descriptor.
   // This returns NULL if this is not a sound-file or if there is no available
-  // convolution filter configuration available.
+  // convolution filter configuration available, or if the filter would not
+  // change the file at all.
   // "partial_file_info" will be set to information known so far, including
   // error message.
   static FileHandler *Create(FolveFilesystem *fs,
@@ -46,11 +55,16 @@ public:
 
   // -- FileHandler interface
   virtual int Read(char *buf, size_t size, off_t offset);
+  virtual int ReadCancellable(char *buf, size_t size, off_t offset,
+                              const bool *cancelled);
+  virtual bool IsReadAvailable(size_t size, off_t offset);
   virtual void GetHandlerStatus(HandlerStats *stats);
-  virtual bool is_gapless() const { return base_stats_.in_gapless; }
   virtual int Stat(struct stat *st);
-  virtual bool PassoverProcessor(SoundProcessor *passover_processor);
-  virtual void NotifyPassedProcessorUnreferenced();
+  virtual bool IsContentStable();
+  virtual int64_t InvestedWork();
+  virtual bool IsConvolvedAudio() { return true; }
+  virtual off_t BytesHeld();
+  virtual void RequestPrebuffer();
 
   // -- ConversionBuffer::SoundSource interface.
   virtual void SetOutputSoundfile(ConversionBuffer *out_buffer,
@@ -62,12 +76,34 @@ private:
   ConvolveFileHandler(FolveFilesystem *fs, const char *fs_path,
                       const std::string &filter_dir,
                       const std::string &underlying_file,
-                      int filedes, SNDFILE *snd_in,
+                      int filedes, PrefetchReader *input_reader,
+                      InputDecoder *decoder, SNDFILE *snd_in,
                       const SF_INFO &in_info, const HandlerStats &file_info,
                       SoundProcessor *processor);
 
+  // Open the input sound file and set up a decoder for it. Sets
+  // "input_reader" if the sound file reads through one.
+  static SNDFILE *OpenInput(int filedes, SF_INFO *in_info,
+                            PrefetchReader **input_reader,
+                            InputDecoder **decoder);
+
   bool HasStarted();
 
+  // In gapless mode: continue converting where the previous file ends.
+  void JoinPreviousFile();
+
+  // Get the files likely to be played next ready while this one is played.
+  void PrebufferNextFiles();
+
+  // If possible, set up converting the file in segments in parallel.
+  void StartSegmentConversion();
+  bool AddSegmentSoundData();
+  void EndSegmentConversion();
+
+  // Returns true if this read is a skip to (almost) the end of the file,
+  // which we answer without convolving up to there.
+  bool IsSkipToEnd(size_t size, off_t offset);
+
   // Generate Header in case this is a FLAC file.
   void CopyFlacHeader(ConversionBuffer *out_buffer);
 
@@ -83,7 +119,10 @@ private:
   int frames_left();
 
   FolveFilesystem *const fs_;
+  const std::string underlying_file_;
   const int filedes_;
+  PrefetchReader *const input_reader_;  // Feeds snd_in_; NULL if mapped.
+  InputDecoder *const decoder_;         // Sound data from the input file.
   SNDFILE *const snd_in_;
   const SF_INFO in_info_;
 
@@ -93,15 +132,26 @@ private:
   struct stat file_stat_;        // we dynamically report a changing size.
   off_t original_file_size_;
   off_t start_estimating_size_;  // essentially const.
+  bool size_known_;              // Known from a previous conversion.
+  uint64_t filter_stamp_;        // FilterStamp() when we started.
 
   bool error_;
+  bool output_complete_;         // All output written. Under stats_mutex_.
   bool copy_flac_header_verbatim_;
   ConversionBuffer *output_buffer_;
   SNDFILE *snd_out_;
+  PcmQuantizer *output_quantizer_;  // NULL if we write float.
 
   // Used in conversion.
   SoundProcessor *processor_;
   int input_frames_left_;
+  GaplessLeadIn *lead_in_;       // End of the previous file if gapless.
+
+  // While converting in segments: the converter, the processors it uses
+  // besides processor_ and where we continue as usual.
+  SegmentConverter *segment_converter_;
+  std::vector<SoundProcessor*> segment_processors_;
+  int64_t segment_end_;
 };
 
 #endif  // FOLVE_CONVOLVE_FILE_HANDLER_H_
@@ -0,0 +1,137 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "convolver-shards.h"
+
+#include <string.h>
+
+#include <zita-convolver.h>
+
+class ConvolverShards::Worker : public folve::Thread {
+public:
+  Worker(ConvolverShards *shards, Convproc *convproc)
+    : folve::Thread(false), shards_(shards), convproc_(convproc) {}
+
+  virtual void Run() {
+    int generation = 0;
+    while ((generation = shards_->WaitForWork(generation)) >= 0) {
+      convproc_->process();
+      shards_->WorkDone();
+    }
+  }
+
+private:
+  ConvolverShards *const shards_;
+  Convproc *const convproc_;
+};
+
+ConvolverShards::ConvolverShards()
+  : generation_(0), pending_(0), quit_(false) {
+  pthread_cond_init(&work_event_, NULL);
+  pthread_cond_init(&done_event_, NULL);
+}
+
+ConvolverShards::~ConvolverShards() {
+  {
+    folve::MutexLock l(&mutex_);
+    quit_ = true;
+    pthread_cond_broadcast(&work_event_);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    delete workers_[i];  // Joins the thread.
+  }
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    shards_[i].convproc->stop_process();
+    shards_[i].convproc->cleanup();
+    delete shards_[i].convproc;
+  }
+  pthread_cond_destroy(&work_event_);
+  pthread_cond_destroy(&done_event_);
+}
+
+void ConvolverShards::Add(Convproc *convproc, const std::vector<int> &inputs,
+                          const std::vector<int> &outputs) {
+  Shard shard;
+  shard.convproc = convproc;
+  shard.inputs = inputs;
+  shard.outputs = outputs;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    if ((int) output_shard_.size() <= outputs[i]) {
+      output_shard_.resize(outputs[i] + 1, -1);
+    }
+    output_shard_[outputs[i]] = shards_.size();
+  }
+  shards_.push_back(shard);
+}
+
+void ConvolverShards::Start() {
+  for (size_t i = 1; i < shards_.size(); ++i) {
+    Worker *worker = new Worker(this, shards_[i].convproc);
+    worker->Start();
+    workers_.push_back(worker);
+  }
+}
+
+int ConvolverShards::WaitForWork(int generation) {
+  folve::MutexLock l(&mutex_);
+  while (generation_ == generation && !quit_) {
+    mutex_.WaitOn(&work_event_);
+  }
+  return quit_ ? -1 : generation_;
+}
+
+void ConvolverShards::WorkDone() {
+  folve::MutexLock l(&mutex_);
+  if (--pending_ == 0) {
+    pthread_cond_signal(&done_event_);
+  }
+}
+
+void ConvolverShards::Process(float *const *inputs, int frames) {
+  for (size_t s = 0; s < shards_.size(); ++s) {
+    const Shard &shard = shards_[s];
+    for (size_t i = 0; i < shard.inputs.size(); ++i) {
+      memcpy(shard.convproc->inpdata(shard.inputs[i]),
+             inputs[shard.inputs[i]], frames * sizeof(float));
+    }
+  }
+  {
+    folve::MutexLock l(&mutex_);
+    ++generation_;
+    pending_ = workers_.size();
+    pthread_cond_broadcast(&work_event_);
+  }
+  shards_[0].convproc->process();
+  folve::MutexLock l(&mutex_);
+  while (pending_ > 0) {
+    mutex_.WaitOn(&done_event_);
+  }
+}
+
+float *ConvolverShards::outdata(int output) const {
+  if (output >= (int) output_shard_.size() || output_shard_[output] < 0)
+    return NULL;
+  return shards_[output_shard_[output]].convproc->outdata(output);
+}
+
+void ConvolverShards::Reset() {
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    shards_[i].convproc->reset();
+    shards_[i].convproc->start_process(0, 0);
+  }
+}
@@ -0,0 +1,82 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_CONVOLVER_SHARDS_H
+#define FOLVE_CONVOLVER_SHARDS_H
+
+#include <pthread.h>
+
+#include <vector>
+
+#include "util.h"
+
+class Convproc;
+
+// Convolvers for independent groups of channels, e.g. the per-speaker
+// filters of a 5.1 file, processed in parallel for every fragment: the
+// first one in the calling thread, each other one in a worker thread.
+class ConvolverShards {
+public:
+  ConvolverShards();
+  ~ConvolverShards();
+
+  // Add a configured convolver with impulses from "inputs" to "outputs".
+  // No other shard may write to these outputs. Takes ownership.
+  void Add(Convproc *convproc,
+           const std::vector<int> &inputs, const std::vector<int> &outputs);
+
+  // Start worker threads; call after all shards are added.
+  void Start();
+
+  int size() const { return shards_.size(); }
+
+  // Convolve the next fragment of "inputs".
+  void Process(float *const *inputs, int frames);
+
+  // Result of the last Process() for "output", NULL if no shard has it.
+  float *outdata(int output) const;
+
+  // Reset all convolvers for re-use.
+  void Reset();
+
+private:
+  class Worker;
+  struct Shard {
+    Convproc *convproc;
+    std::vector<int> inputs;
+    std::vector<int> outputs;
+  };
+
+  // Called by workers: wait for next fragment after "generation", return
+  // new generation or -1 if we should quit.
+  int WaitForWork(int generation);
+  void WorkDone();
+
+  std::vector<Shard> shards_;
+  std::vector<int> output_shard_;   // Per output: shard or -1.
+  std::vector<Worker*> workers_;
+
+  folve::Mutex mutex_;
+  pthread_cond_t work_event_;
+  pthread_cond_t done_event_;
+  int generation_;   // Increments with every fragment to process.
+  int pending_;      // Workers still processing the current fragment.
+  bool quit_;
+};
+
+#endif  // FOLVE_CONVOLVER_SHARDS_H
@@ -0,0 +1,97 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "direct-fir.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+DirectFir::Pair *DirectFir::FindOrCreate(int input, int output) {
+  for (size_t i = 0; i < pairs_.size(); ++i) {
+    if (pairs_[i].input == input && pairs_[i].output == output)
+      return &pairs_[i];
+  }
+  Pair pair;
+  pair.input = input;
+  pair.output = output;
+  pair.source = pairs_.size();
+  pairs_.push_back(pair);
+  if ((int) history_.size() <= input) history_.resize(input + 1);
+  return &pairs_.back();
+}
+
+void DirectFir::AddImpulse(int input, int output, int step, const float *data,
+                           int start, int end) {
+  Pair *pair = FindOrCreate(input, output);
+  std::vector<float> &taps = pairs_[pair->source].taps;
+  if ((int) taps.size() < end) taps.resize(end, 0.0f);
+  for (int i = start; i < end; ++i, data += step) {
+    taps[i] += *data;
+  }
+  if (end > length_) length_ = end;
+}
+
+void DirectFir::CopyImpulse(int input, int output,
+                            int from_input, int from_output) {
+  // A copy of a copy points to the pair that actually holds the taps.
+  const int source = FindOrCreate(from_input, from_output)->source;
+  FindOrCreate(input, output)->source = source;
+}
+
+void DirectFir::Process(const float *const *inputs, float *const *outputs,
+                        int frames) {
+  const int history = length_ > 0 ? length_ - 1 : 0;
+  for (size_t p = 0; p < pairs_.size(); ++p) {
+    std::vector<float> &samples = history_[pairs_[p].input];
+    if ((int) samples.size() != history + frames) {
+      samples.resize(history + frames, 0.0f);
+    }
+  }
+  for (size_t i = 0; i < history_.size(); ++i) {
+    if (history_[i].empty()) continue;   // Not used by any pair.
+    memcpy(&history_[i][history], inputs[i], frames * sizeof(float));
+  }
+
+  // Tap by tap over the whole block: the inner loop vectorizes.
+  for (size_t p = 0; p < pairs_.size(); ++p) {
+    const std::vector<float> &taps = pairs_[pairs_[p].source].taps;
+    const float *const current = &history_[pairs_[p].input][history];
+    float *const out = outputs[pairs_[p].output];
+    for (size_t k = 0; k < taps.size(); ++k) {
+      const float tap = taps[k];
+      if (tap == 0.0f) continue;
+      const float *in = current - k;
+      for (int n = 0; n < frames; ++n) {
+        out[n] += tap * in[n];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < history_.size(); ++i) {
+    std::vector<float> &samples = history_[i];
+    if (samples.empty() || history == 0) continue;
+    memmove(&samples[0], &samples[frames], history * sizeof(float));
+  }
+}
+
+void DirectFir::Reset() {
+  for (size_t i = 0; i < history_.size(); ++i) {
+    std::fill(history_[i].begin(), history_[i].end(), 0.0f);
+  }
+}
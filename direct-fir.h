@@ -0,0 +1,69 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_DIRECT_FIR_H
+#define FOLVE_DIRECT_FIR_H
+
+#include <vector>
+
+// Convolution in the time domain. For impulses of up to a few hundred taps,
+// this is cheaper than the FFT based partitioned convolution, which has a
+// considerable fixed cost per block.
+class DirectFir {
+public:
+  DirectFir() : length_(0) {}
+
+  // Add impulse data between 0-based "input" and "output": every "step"th
+  // value of "data" goes to taps "start" to "end". Same semantics as
+  // Convproc::impdata_create(); data given several times is added.
+  void AddImpulse(int input, int output, int step, const float *data,
+                  int start, int end);
+
+  // Use the impulse of "from_input" -> "from_output" for "input" ->
+  // "output" as well, including everything added to it later. Like
+  // Convproc::impdata_copy().
+  void CopyImpulse(int input, int output, int from_input, int from_output);
+
+  // Length of the longest impulse.
+  int length() const { return length_; }
+
+  // Convolve "frames" samples of the inputs and add the result to the
+  // outputs.
+  void Process(const float *const *inputs, float *const *outputs,
+               int frames);
+
+  // Forget previous input.
+  void Reset();
+
+private:
+  struct Pair {
+    int input;
+    int output;
+    int source;                // Index of pair with taps; differs if copy.
+    std::vector<float> taps;
+  };
+
+  Pair *FindOrCreate(int input, int output);
+
+  std::vector<Pair> pairs_;
+  int length_;
+  // Per input: the last length() - 1 samples, followed by the current block.
+  std::vector<std::vector<float> > history_;
+};
+
+#endif  // FOLVE_DIRECT_FIR_H
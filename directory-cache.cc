@@ -0,0 +1,415 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "directory-cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+using folve::DLogf;
+
+// Directories are re-validated with a stat() after this time. This is
+// also the time cached file attributes are kept.
+static const double kRevalidateSeconds = 5.0;
+
+// Directories with more entries than this are not kept in memory.
+static const size_t kMaxCachedEntries = 10000;
+
+static const uint32_t kWatchEvents = (IN_CREATE | IN_DELETE | IN_MODIFY
+                                      | IN_ATTRIB | IN_CLOSE_WRITE
+                                      | IN_MOVED_FROM | IN_MOVED_TO
+                                      | IN_DELETE_SELF | IN_MOVE_SELF
+                                      | IN_ONLYDIR);
+
+struct DirectoryCache::Directory {
+  Directory() : listing(NULL), watch(-1), last_validated(0), last_access(0) {}
+  Listing *listing;       // NULL if invalidated.
+  int watch;              // inotify watch descriptor or -1
+  struct timespec mtime;  // modification time at time of reading.
+  double last_validated;
+  double last_access;
+  std::map<std::string, struct stat> attributes;  // lstat() of entries.
+};
+
+// NOTE: runs forever the whole program lifetime; does not provide a way to quit.
+class DirectoryCache::InotifyWatcher : public folve::Thread {
+public:
+  InotifyWatcher(DirectoryCache *cache, int fd) : cache_(cache), fd_(fd) {}
+
+  virtual void Run() {
+    char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+      const ssize_t len = read(fd_, buffer, sizeof(buffer));
+      if (len < 0) {
+        if (errno == EINTR) continue;
+        syslog(LOG_ERR, "Reading inotify events: %s; stop watching "
+               "directories.", strerror(errno));
+        return;
+      }
+      const char *pos = buffer;
+      while (pos < buffer + len) {
+        const struct inotify_event *event = (const struct inotify_event*) pos;
+        cache_->HandleEvent(event->wd, event->mask);
+        pos += sizeof(struct inotify_event) + event->len;
+      }
+    }
+  }
+
+private:
+  DirectoryCache *const cache_;
+  const int fd_;
+};
+
+static bool CompareEntryName(const DirectoryCache::Entry &a,
+                             const DirectoryCache::Entry &b) {
+  return a.name < b.name;
+}
+
+static bool CompareNameToEntry(const std::string &name,
+                               const DirectoryCache::Entry &e) {
+  return name < e.name;
+}
+
+std::vector<DirectoryCache::Entry>::const_iterator
+DirectoryCache::Listing::UpperBound(const std::string &name) const {
+  return std::upper_bound(entries_.begin(), entries_.end(), name,
+                          CompareNameToEntry);
+}
+
+bool DirectoryCache::Listing::Contains(const std::string &name) const {
+  std::vector<Entry>::const_iterator found = UpperBound(name);
+  return found != entries_.begin() && (found - 1)->name == name;
+}
+
+// Directories are keyed without trailing slash.
+static std::string NormalizeDir(const std::string &dir) {
+  std::string::size_type end = dir.find_last_not_of('/');
+  if (end == std::string::npos) return "/";
+  return dir.substr(0, end + 1);
+}
+
+static bool SameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+DirectoryCache::DirectoryCache(int max_directories)
+  : max_directories_(max_directories), generation_(0),
+    inotify_fd_(-1), watcher_(NULL) {
+}
+
+void DirectoryCache::StartWatching() {
+  folve::MutexLock l(&mutex_);
+  if (watcher_ != NULL) return;
+  inotify_fd_ = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd_ < 0) {
+    syslog(LOG_INFO, "No inotify available (%s); re-validating cached "
+           "directories every %.0f seconds.", strerror(errno),
+           kRevalidateSeconds);
+    return;
+  }
+  watcher_ = new InotifyWatcher(this, inotify_fd_);
+  watcher_->Start();
+}
+
+void DirectoryCache::Ref(const Listing *listing) {
+  __atomic_add_fetch(&listing->references_, 1, __ATOMIC_RELAXED);
+}
+
+void DirectoryCache::Unref(const Listing *listing) {
+  if (listing == NULL) return;
+  if (__atomic_sub_fetch(&listing->references_, 1, __ATOMIC_ACQ_REL) == 0) {
+    delete listing;
+  }
+}
+
+void DirectoryCache::ReleaseListing(const Listing *listing) {
+  Unref(listing);
+}
+
+DirectoryCache::Listing *DirectoryCache::ReadListing(const std::string &dir,
+                                                     size_t max_entries) {
+  DIR *dp = opendir(dir.c_str());
+  if (dp == NULL) return NULL;
+  Listing *listing = new Listing();
+  struct dirent *dent;
+  while ((dent = readdir(dp)) != NULL) {
+    if (max_entries > 0 && listing->entries_.size() >= max_entries) {
+      closedir(dp);
+      delete listing;
+      errno = EFBIG;
+      return NULL;
+    }
+    Entry entry;
+    entry.name = dent->d_name;
+    entry.inode = dent->d_ino;
+    entry.type = dent->d_type;
+    listing->entries_.push_back(entry);
+  }
+  closedir(dp);
+  std::sort(listing->entries_.begin(), listing->entries_.end(),
+            CompareEntryName);
+  return listing;
+}
+
+DirectoryCache::Directory *DirectoryCache::FindFresh_Locked(
+     const std::string &dir, double now) {
+  DirectoryMap::iterator found = directories_.find(dir);
+  if (found == directories_.end()) return NULL;
+  Directory *directory = found->second;
+  if (directory->listing == NULL) return NULL;
+  if (now - directory->last_validated > kRevalidateSeconds) return NULL;
+  directory->last_access = now;
+  return directory;
+}
+
+void DirectoryCache::Invalidate_Locked(Directory *directory) {
+  Unref(directory->listing);
+  directory->listing = NULL;
+  directory->attributes.clear();
+}
+
+void DirectoryCache::Insert_Locked(const std::string &dir,
+                                   const struct stat &dir_stat,
+                                   Listing *listing, double now) {
+  DirectoryMap::iterator ins
+    = directories_.insert(std::make_pair(dir, (Directory*)NULL)).first;
+  if (ins->second == NULL) {
+    ins->second = new Directory();
+    if (inotify_fd_ >= 0) {
+      const int wd = inotify_add_watch(inotify_fd_, dir.c_str(), kWatchEvents);
+      if (wd >= 0) {
+        ins->second->watch = wd;
+        watches_.insert(std::make_pair(wd, dir));
+      }
+    }
+  }
+  Directory *directory = ins->second;
+  Invalidate_Locked(directory);
+  Ref(listing);
+  directory->listing = listing;
+  directory->mtime = dir_stat.st_mtim;
+  directory->last_validated = now;
+  directory->last_access = now;
+
+  if (directories_.size() > max_directories_) {
+    EvictLeastRecentlyUsed_Locked();
+  }
+}
+
+void DirectoryCache::EvictLeastRecentlyUsed_Locked() {
+  // O(n), but we only do this once the cache is full and then only once
+  // per newly read directory.
+  DirectoryMap::iterator oldest = directories_.begin();
+  for (DirectoryMap::iterator it = directories_.begin();
+       it != directories_.end(); ++it) {
+    if (it->second->last_access < oldest->second->last_access)
+      oldest = it;
+  }
+  if (oldest == directories_.end()) return;
+  Directory *directory = oldest->second;
+  if (directory->watch >= 0) {
+    bool watch_shared = false;
+    std::pair<WatchMap::iterator, WatchMap::iterator> range
+      = watches_.equal_range(directory->watch);
+    for (WatchMap::iterator it = range.first; it != range.second; /**/) {
+      if (it->second == oldest->first) {
+        watches_.erase(it++);
+      } else {
+        watch_shared = true;  // Same directory under another name.
+        ++it;
+      }
+    }
+    if (!watch_shared) inotify_rm_watch(inotify_fd_, directory->watch);
+  }
+  Invalidate_Locked(directory);
+  delete directory;
+  directories_.erase(oldest);
+}
+
+void DirectoryCache::HandleEvent(int watch_descriptor, uint32_t mask) {
+  folve::MutexLock l(&mutex_);
+  ++generation_;
+  if (mask & IN_Q_OVERFLOW) {
+    // We lost events; start from scratch.
+    for (DirectoryMap::iterator it = directories_.begin();
+         it != directories_.end(); ++it) {
+      Invalidate_Locked(it->second);
+    }
+    return;
+  }
+  std::pair<WatchMap::iterator, WatchMap::iterator> range
+    = watches_.equal_range(watch_descriptor);
+  for (WatchMap::iterator it = range.first; it != range.second; ++it) {
+    DirectoryMap::iterator found = directories_.find(it->second);
+    if (found == directories_.end()) continue;
+    Invalidate_Locked(found->second);
+    if (mask & IN_IGNORED) found->second->watch = -1;  // Kernel removed it.
+  }
+  if (mask & IN_IGNORED) watches_.erase(range.first, range.second);
+}
+
+const DirectoryCache::Listing *DirectoryCache::AcquireListing(
+     const std::string &dir) {
+  return Acquire(dir, 0);
+}
+
+const DirectoryCache::Listing *DirectoryCache::AcquireSmallListing(
+     const std::string &dir) {
+  return Acquire(dir, kMaxCachedEntries);
+}
+
+const DirectoryCache::Listing *DirectoryCache::Acquire(
+     const std::string &dir_in, size_t max_entries) {
+  const std::string dir = NormalizeDir(dir_in);
+  const double now = folve::CurrentTime();
+  int64_t generation;
+  {
+    folve::MutexLock l(&mutex_);
+    Directory *directory = FindFresh_Locked(dir, now);
+    if (directory != NULL) {
+      Ref(directory->listing);
+      return directory->listing;
+    }
+    generation = generation_;
+  }
+
+  // All the I/O happens outside the lock: on a network filesystem this
+  // can take a while and we don't want to block lookups of other directories.
+  struct stat dir_stat;
+  if (stat(dir.c_str(), &dir_stat) != 0)
+    return NULL;
+
+  {
+    // Maybe we only needed to re-validate and nothing changed.
+    folve::MutexLock l(&mutex_);
+    DirectoryMap::iterator found = directories_.find(dir);
+    if (found != directories_.end() && found->second->listing != NULL
+        && SameTime(found->second->mtime, dir_stat.st_mtim)) {
+      Directory *directory = found->second;
+      directory->last_validated = now;
+      directory->last_access = now;
+      directory->attributes.clear();  // These might've changed nevertheless.
+      Ref(directory->listing);
+      return directory->listing;
+    }
+  }
+
+  Listing *listing = ReadListing(dir, max_entries);
+  if (listing == NULL)
+    return NULL;
+
+  if (listing->entries_.size() > kMaxCachedEntries) {
+    DLogf("Directory %s with %d entries too large to cache.",
+          dir.c_str(), (int) listing->entries_.size());
+    return listing;
+  }
+
+  folve::MutexLock l(&mutex_);
+  // If something changed while we were reading, the listing might already
+  // be outdated. Hand it out, but don't keep it.
+  if (generation == generation_) {
+    Insert_Locked(dir, dir_stat, listing, now);
+  }
+  return listing;
+}
+
+int DirectoryCache::Stat(const std::string &path, struct stat *st) {
+  const std::string::size_type slash = path.find_last_of('/');
+  if (slash == std::string::npos || slash == path.length() - 1)
+    return lstat(path.c_str(), st);
+  const std::string dir = NormalizeDir(path.substr(0, slash + 1));
+  const std::string name = path.substr(slash + 1);
+  const double now = folve::CurrentTime();
+  int64_t generation;
+  {
+    folve::MutexLock l(&mutex_);
+    Directory *directory = FindFresh_Locked(dir, now);
+    if (directory != NULL) {
+      std::map<std::string, struct stat>::const_iterator found
+        = directory->attributes.find(name);
+      if (found != directory->attributes.end()) {
+        *st = found->second;
+        return 0;
+      }
+      if (!directory->listing->Contains(name)) {
+        errno = ENOENT;
+        return -1;
+      }
+    }
+    generation = generation_;
+  }
+
+  const int result = lstat(path.c_str(), st);
+  if (result == 0) {
+    folve::MutexLock l(&mutex_);
+    Directory *directory = FindFresh_Locked(dir, now);
+    if (directory != NULL && generation == generation_) {
+      directory->attributes[name] = *st;
+    }
+  }
+  return result;
+}
+
+bool DirectoryCache::FindNextFile(const std::string &dir,
+                                  const std::string &name,
+                                  const std::string &suffix,
+                                  std::string *next_name) {
+  const Listing *listing = AcquireListing(dir);
+  if (listing == NULL) return false;
+  bool found = false;
+  for (std::vector<Entry>::const_iterator it = listing->UpperBound(name);
+       it != listing->entries().end(); ++it) {
+    if (it->type == DT_DIR) continue;
+    if (folve::HasSuffix(it->name, suffix)) {
+      *next_name = it->name;
+      found = true;
+      break;
+    }
+  }
+  ReleaseListing(listing);
+  return found;
+}
+
+bool DirectoryCache::FindPreviousFile(const std::string &dir,
+                                      const std::string &name,
+                                      const std::string &suffix,
+                                      std::string *previous_name) {
+  const Listing *listing = AcquireListing(dir);
+  if (listing == NULL) return false;
+  bool found = false;
+  std::vector<Entry>::const_iterator it = listing->UpperBound(name);
+  while (it != listing->entries().begin()) {
+    --it;
+    if (it->type == DT_DIR || it->name == name) continue;
+    if (folve::HasSuffix(it->name, suffix)) {
+      *previous_name = it->name;
+      found = true;
+      break;
+    }
+  }
+  ReleaseListing(listing);
+  return found;
+}
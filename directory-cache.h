@@ -0,0 +1,140 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_DIRECTORY_CACHE_H
+#define FOLVE_DIRECTORY_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+// Cache of directory listings and file attributes of the underlying
+// filesystem. Listing a directory on a network filesystem is a slow
+// round-trip; media players and indexers list the same directories and stat
+// the same files over and over again.
+//
+// Cached directories are watched with inotify, so local changes are seen
+// right away. Since inotify does not see changes done by other hosts on a
+// network filesystem, cached directories are re-validated with a stat() of
+// the directory every couple of seconds as well.
+//
+// All paths are paths in the underlying filesystem.
+// This class is thread-safe.
+class DirectoryCache {
+public:
+  struct Entry {
+    std::string name;
+    ino_t inode;
+    unsigned char type;  // DT_* value from readdir().
+  };
+
+  // An immutable snapshot of a directory; entries are sorted by name.
+  // Obtained by AcquireListing(), needs to be returned with ReleaseListing().
+  class Listing {
+  public:
+    const std::vector<Entry> &entries() const { return entries_; }
+
+    // Returns position of first entry with a name greater than "name".
+    std::vector<Entry>::const_iterator UpperBound(const std::string &name) const;
+
+    // Returns if there is an entry with exactly this name.
+    bool Contains(const std::string &name) const;
+
+  private:
+    friend class DirectoryCache;
+    Listing() : references_(1) {}
+    std::vector<Entry> entries_;
+    mutable int references_;  // atomically modified.
+  };
+
+  // "max_directories" is the number of directories to keep.
+  explicit DirectoryCache(int max_directories);
+
+  // Start watching for changes with inotify. Needs to be called after
+  // daemonizing, as it starts a thread.
+  void StartWatching();
+
+  // Get a listing of the given directory. Returns NULL if the directory
+  // can't be read; errno is set in that case.
+  const Listing *AcquireListing(const std::string &dir);
+  void ReleaseListing(const Listing *listing);
+
+  // Like AcquireListing(), but gives up on directories too large to be
+  // cached; returns NULL with errno set to EFBIG in that case. These are
+  // better read incrementally.
+  const Listing *AcquireSmallListing(const std::string &dir);
+
+  // Like lstat(), but cached. Returns 0 on success or -1 and sets errno.
+  int Stat(const std::string &path, struct stat *st);
+
+  // Find the file in directory "dir" that is alphabetically next after
+  // "name" and has the given suffix. Returns false if there is none.
+  bool FindNextFile(const std::string &dir, const std::string &name,
+                    const std::string &suffix, std::string *next_name);
+
+  // Like FindNextFile(), but the file alphabetically before "name".
+  bool FindPreviousFile(const std::string &dir, const std::string &name,
+                        const std::string &suffix, std::string *previous_name);
+
+private:
+  class InotifyWatcher;
+  struct Directory;
+  typedef std::map<std::string, Directory*> DirectoryMap;
+  typedef std::multimap<int, std::string> WatchMap;
+
+  // Get listing, reading at most "max_entries" entries (0: unlimited).
+  const Listing *Acquire(const std::string &dir, size_t max_entries);
+
+  // Called by the InotifyWatcher for every event.
+  void HandleEvent(int watch_descriptor, uint32_t mask);
+
+  // -- methods called while holding the mutex.
+
+  // Return directory if we have a listing for it that does not need
+  // re-validation. NULL otherwise.
+  Directory *FindFresh_Locked(const std::string &dir, double now);
+
+  // Store a freshly read listing.
+  void Insert_Locked(const std::string &dir, const struct stat &dir_stat,
+                     Listing *listing, double now);
+
+  // Drop the listing and cached attributes, but keep watching.
+  void Invalidate_Locked(Directory *directory);
+
+  void EvictLeastRecentlyUsed_Locked();
+
+  static Listing *ReadListing(const std::string &dir, size_t max_entries);
+  static void Ref(const Listing *listing);
+  static void Unref(const Listing *listing);
+
+  const size_t max_directories_;
+  folve::Mutex mutex_;
+  DirectoryMap directories_;
+  WatchMap watches_;
+  int64_t generation_;   // Incremented with every change notification.
+  int inotify_fd_;
+  InotifyWatcher *watcher_;
+};
+
+#endif  // FOLVE_DIRECTORY_CACHE_H
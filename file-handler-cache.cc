@@ -27,31 +27,57 @@
 #include "file-handler-cache.h"
 #include "util.h"
 
+// Work needed to set up a handler, even if nothing has been convolved yet
+// (opening the file, creating the header). In samples; roughly equivalent to
+// convolving one second of stereo audio.
+static const double kHandlerSetupCost = 88200;
+
+// The cache is limited in number of entries, not bytes. So each entry
+// occupies a slot that is worth at least this many bytes; otherwise
+// handlers that hold very little data would look more valuable than
+// handlers that have a whole convolved file ready.
+static const double kSlotBytes = 16 << 20;
+
 struct FileHandlerCache::Entry {
-  Entry(FileHandler *h) : handler(h), references(0), last_access(0) {}
+  Entry(FileHandler *h, HandlerStatsSlot *s)
+    : handler(h), stats_slot(s),
+      references(0), last_access(0), hits(0), inflation(0) {}
   FileHandler *const handler;
+  HandlerStatsSlot *const stats_slot;
   int references;
   double last_access;  // seconds since epoch, sub-second resolution.
+  int hits;            // number of times this handler was requested.
+  double inflation;    // cache inflation value at the time of last access.
 };
 
+void FileHandlerCache::Touch_Locked(Entry *entry) {
+  entry->last_access = folve::CurrentTime();
+  entry->inflation = inflation_;
+  ++entry->hits;
+  entry->stats_slot->SetCacheStatus(HandlerStats::OPEN, entry->last_access);
+}
+
 FileHandler *FileHandlerCache::InsertPinned(const std::string &key,
                                             FileHandler *handler) {
   std::vector<FileHandler *> to_delete;
   FileHandler *result = NULL;
+  bool newly_inserted = false;
   {
     folve::MutexLock l(&mutex_);
     CacheMap::iterator ins
       = cache_.insert(std::make_pair(key, (Entry*)NULL)).first;
     if (ins->second == NULL) {
-      ins->second = new Entry(handler);
+      ins->second = new Entry(handler, stats_board_.Acquire());
+      handler->set_stats_slot(ins->second->stats_slot);
+      newly_inserted = true;
     } else {
       delete handler;
     }
     ++ins->second->references;
     if (cache_.size() > max_size_) {
-      CleanupOldestUnreferenced_Locked(&to_delete);
+      CleanupCheapestUnreferenced_Locked(&to_delete);
     }
-    ins->second->last_access = folve::CurrentTime();
+    Touch_Locked(ins->second);
     if (observer_) observer_->InsertHandlerEvent(ins->second->handler);
     result = ins->second->handler;
   }
@@ -68,49 +94,40 @@ FileHandler *FileHandlerCache::InsertPinned(const std::string &key,
   for (size_t i = 0; i < to_delete.size(); ++i) {
     delete to_delete[i];
   }
+  // We hold a reference, so it is safe to access outside the lock.
+  if (newly_inserted) result->PublishStats(true);
   return result;
 }
 
-FileHandler *FileHandlerCache::FindAndPin(const std::string &key,
-                                          bool prefer_gapless) {
-  FileHandler *to_delete = NULL;
-  {
-    folve::MutexLock l(&mutex_);
-    CacheMap::iterator found = cache_.find(key);
-    if (found == cache_.end())
-      return NULL;
-
-    // If a gapless one is requested, but we only have one that is not
-    // gapless but idle, we can pretend we don't have it at all.
-    // TODO: also make this work if the handler is non-idle and have a
-    // second one that is.
-    if (prefer_gapless && found->second->references == 0
-        && !found->second->handler->is_gapless()) {
-      to_delete = Erase_Locked(found);
-    }
-    else {
-      ++found->second->references;
-      found->second->last_access = folve::CurrentTime();
-      return found->second->handler;
-    }
-  }
-  delete to_delete;
-  return NULL;
+FileHandler *FileHandlerCache::FindAndPin(const std::string &key) {
+  folve::MutexLock l(&mutex_);
+  CacheMap::iterator found = cache_.find(key);
+  if (found == cache_.end())
+    return NULL;
+  ++found->second->references;
+  Touch_Locked(found->second);
+  return found->second->handler;
 }
 
 void FileHandlerCache::Unpin(const std::string &key) {
-  FileHandler *to_delete = NULL;
+  std::vector<FileHandler *> to_delete;
   {
     folve::MutexLock l(&mutex_);
     CacheMap::iterator found = cache_.find(key);
     assert(found != cache_.end());
     --found->second->references;
+    if (found->second->references == 0) {
+      found->second->stats_slot->SetCacheStatus(HandlerStats::IDLE,
+                                                found->second->last_access);
+    }
     // If we are already beyond cache size, clean up as soon as we get idle.
     if (found->second->references == 0 && cache_.size() > max_size_) {
-      to_delete = Erase_Locked(found);
+      CleanupCheapestUnreferenced_Locked(&to_delete);
     }
   }
-  delete to_delete;
+  for (size_t i = 0; i < to_delete.size(); ++i) {
+    delete to_delete[i];
+  }
 }
 
 void FileHandlerCache::SetObserver(Observer *observer) {
@@ -119,48 +136,61 @@ void FileHandlerCache::SetObserver(Observer *observer) {
 }
 
 void FileHandlerCache::GetStats(std::vector<HandlerStats> *stats) {
-  HandlerStats s;
-  folve::MutexLock l(&mutex_);
-  for (CacheMap::iterator it = cache_.begin(); it != cache_.end(); ++it) {
-    it->second->handler->GetHandlerStatus(&s);
-    s.status = ((it->second->references == 0)
-                ? HandlerStats::IDLE
-                : HandlerStats::OPEN);
-    s.last_access = it->second->last_access;
-    stats->push_back(s);
-  }
+  stats_board_.GetStats(stats);
 }
 
 FileHandler *FileHandlerCache::Erase_Locked(CacheMap::iterator &cache_it) {
   if (observer_) observer_->RetireHandlerEvent(cache_it->second->handler);
   FileHandler *result = cache_it->second->handler;  // don't delete in mutex.
+  // Detach first, so that the handler can't publish into a slot that is
+  // already handed out to someone else.
+  result->set_stats_slot(NULL);
+  stats_board_.Release(cache_it->second->stats_slot);
   delete cache_it->second;           // Entry
   cache_.erase(cache_it);
   return result;
 }
 
-struct FileHandlerCache::CompareAge {
-  bool operator() (const CacheMap::iterator &a, const CacheMap::iterator &b) {
-    return a->second->last_access < b->second->last_access;
+// The retention value is in the spirit of GreedyDual-Size-Frequency:
+//   value = inflation-at-last-access + hits * cost / size
+// "cost" is the work invested in the handler, that we'd have to re-do if we
+// evicted it, "size" the bytes it holds. Whenever we evict an entry, the
+// cache inflation is raised to its value; entries that are not accessed
+// anymore thus eventually age out, no matter how expensive they were.
+double FileHandlerCache::RetentionValue_Locked(const Entry *entry) {
+  const double cost = kHandlerSetupCost + entry->handler->InvestedWork();
+  const double size = kSlotBytes + entry->handler->BytesHeld();
+  return entry->inflation + entry->hits * cost / size;
+}
+
+struct FileHandlerCache::CompareRetention {
+  typedef std::pair<double, CacheMap::iterator> ValuedEntry;
+  bool operator() (const ValuedEntry &a, const ValuedEntry &b) {
+    if (a.first != b.first) return a.first < b.first;
+    return a.second->second->last_access < b.second->second->last_access;
   }
 };
-void FileHandlerCache::CleanupOldestUnreferenced_Locked(
+void FileHandlerCache::CleanupCheapestUnreferenced_Locked(
          std::vector<FileHandler*> *to_delete) {
   assert(cache_.size() > max_size_);  // otherwise we shouldn't have been called
   // While this iterating through the whole cache might look expensive,
   // in practice we're talking about 3 elements here.
   // If we had significantly more, e.g. broken clients that don't close files,
   // we need to keep better track of age.
-  std::vector<CacheMap::iterator> for_removal;
+  std::vector<CompareRetention::ValuedEntry> for_removal;
   for (CacheMap::iterator it = cache_.begin(); it != cache_.end(); ++it) {
-    if (it->second->references == 0) for_removal.push_back(it);
+    if (it->second->references == 0) {
+      for_removal.push_back(std::make_pair(RetentionValue_Locked(it->second),
+                                           it));
+    }
   }
 
   const size_t to_erase_count = std::min(cache_.size() - max_size_,
                                          for_removal.size());
-  CompareAge comparator;
+  CompareRetention comparator;
   std::sort(for_removal.begin(), for_removal.end(), comparator);
   for (size_t i = 0; i < to_erase_count; ++i) {
-    to_delete->push_back(Erase_Locked(for_removal[i]));
+    inflation_ = std::max(inflation_, for_removal[i].first);
+    to_delete->push_back(Erase_Locked(for_removal[i].second));
   }
 }
@@ -26,6 +26,7 @@
 #include <vector>
 
 #include "file-handler.h"
+#include "stats-board.h"
 #include "util.h"
 
 class FileHandler;
@@ -36,6 +37,11 @@ class FileHandler;
 //
 // This Cache manages the lifecycle of a FileHandler object; the user creates
 // it, but this Cache handles deletion.
+//
+// If the cache is full, unreferenced handlers are evicted in a cost-aware
+// manner (in the spirit of GreedyDual-Size): handlers that have a lot of
+// convolution work invested per byte they hold and that are requested often
+// are kept longer than handlers that only ever served a header.
 // This container is thread-safe.
 class FileHandlerCache {
 public:
@@ -46,7 +52,8 @@ public:
     virtual void RetireHandlerEvent(FileHandler *handler) = 0;
   };
 
-  FileHandlerCache(int size) : max_size_(size), observer_(NULL) {}
+  FileHandlerCache(int size)
+    : max_size_(size), observer_(NULL), inflation_(0) {}
 
   // Set an observer.
   void SetObserver(Observer *observer);
@@ -60,34 +67,44 @@ public:
   // Find an object in this map and pin it down so that it is not evicted.
   // If an existing file-handler is returned (not NULL), you have to Unpin()
   // after use.
-  // If "prefer_gapless" is set, prefer to only return a FileHandler that
-  // actually is gapless or NULL if we don't have one (best effort).
-  FileHandler *FindAndPin(const std::string &key, bool prefer_gapless = false);
+  FileHandler *FindAndPin(const std::string &key);
 
   // Unpin object. If the last object is unpinned, the PinnedMap may decide
   // to delete it later (though typically will keep it around for a while).
   void Unpin(const std::string &key);
 
   // Get a vector of the current status of handlers kept in this cache.
+  // This does not take any lock on the cache or the handlers, so it never
+  // blocks file operations.
   void GetStats(std::vector<HandlerStats> *stats);
 
  private:
   struct Entry;
-  struct CompareAge;
+  struct CompareRetention;
   typedef std::map<std::string, Entry*> CacheMap;
 
   // -- methods called while holding the mutex.
 
+  // Record an access to the given entry.
+  void Touch_Locked(Entry *entry);
+
+  // The value of keeping this entry around. Entries with the lowest
+  // value are evicted first.
+  double RetentionValue_Locked(const Entry *entry);
+
   // Inform observer, delete FileFilter and erase element from cache.
   FileHandler *Erase_Locked(CacheMap::iterator &cache_it);
 
-  // Find oldes element and get rid of it.
-  void CleanupOldestUnreferenced_Locked(std::vector<FileHandler *> *to_delete);
+  // Find the least valuable unreferenced elements and get rid of them until
+  // we're within our size limits again.
+  void CleanupCheapestUnreferenced_Locked(std::vector<FileHandler *> *to_delete);
 
   const size_t max_size_;
   Observer *observer_;
   folve::Mutex mutex_;
   CacheMap cache_;
+  HandlerStatsBoard stats_board_;
+  double inflation_;  // Retention value of the last evicted entry.
 };
 
 #endif  // FOLVE_FILE_HANDLER_CACHE_H
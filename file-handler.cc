@@ -0,0 +1,50 @@
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "file-handler.h"
+
+#include "stats-board.h"
+#include "util.h"
+
+// Status pages are refreshed in the order of seconds. No need to publish
+// more often than this.
+static const double kMinPublishInterval = 0.25;
+
+void FileHandler::PublishStats(bool force) {
+  const double now = folve::CurrentTime();
+  {
+    folve::MutexLock l(&publish_mutex_);
+    if (stats_slot_ == NULL) return;
+    if (!force && now - last_publish_time_ < kMinPublishInterval) return;
+    last_publish_time_ = now;
+  }
+  // Collecting the status might take a while, so don't hold the lock.
+  HandlerStats stats;
+  GetHandlerStatus(&stats);
+  folve::MutexLock l(&publish_mutex_);
+  if (stats_slot_ != NULL) stats_slot_->Publish(stats);
+}
+
+void FileHandler::set_stats_slot(HandlerStatsSlot *slot) {
+  folve::MutexLock l(&publish_mutex_);
+  stats_slot_ = slot;
+  last_publish_time_ = 0;
+}
+
+bool FileHandler::NoteStableOpen() {
+  return __atomic_exchange_n(&stable_open_seen_, true, __ATOMIC_ACQ_REL);
+}
@@ -19,11 +19,14 @@
 #ifndef FOLVE_FILE_HANDLER_H
 #define FOLVE_FILE_HANDLER_H
 
+#include <stdint.h>
 #include <string>
 
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "util.h"
+
 // Status about some handler, filled in by various subsystem.
 // This is mostly used to be displayed in the UI.
 // Data collected in this struct will survive after the FileHandler is long
@@ -45,12 +48,14 @@ struct HandlerStats {
   Status status;                // Status of this file handler.
   double last_access;           // Last access in hi-res seconds since epoch.
   float max_output_value;       // Clipping ? Absolute value, should be [0 .. 1].
-  bool in_gapless;              // We were handed a processor to continue.
-  bool out_gapless;             // We passed on our processor to the next.
+  bool in_gapless;              // Continues where the previous file ends.
+  bool out_gapless;             // Next file continues where this one ends.
   std::string filter_dir;       // The filter-id is in use. "" for pass-through.
+  std::string config_file;      // Filter configuration file if any.
+  std::string filter_info;      // Filter as loaded; see SoundProcessor.
 };
 
-class SoundProcessor;
+class HandlerStatsSlot;
 // A handler that deals with operations on files. Since we only provide read
 // access, this is limited to very few operations.
 // Closing in particular is not done by this file handler as it might
@@ -58,7 +63,9 @@ class SoundProcessor;
 // fuse filesystem (see file-handler-cache.h for rationale)
 class FileHandler {
 public:
-  explicit FileHandler(const std::string &filter) : filter_dir_(filter) {}
+  explicit FileHandler(const std::string &filter)
+    : filter_dir_(filter), stats_slot_(NULL), last_publish_time_(0),
+      stable_open_seen_(false) {}
   virtual ~FileHandler() {}
 
   const std::string &filter_dir() const { return filter_dir_; }
@@ -67,22 +74,65 @@ public:
   virtual int Read(char *buf, size_t size, off_t offset) = 0;
   virtual int Stat(struct stat *st) = 0;
 
-  // Get handler status.
+  // Returns true if Read() with these parameters can be answered right
+  // away; false if it would have to wait for data to be converted first.
+  virtual bool IsReadAvailable(size_t size, off_t offset) { return true; }
+
+  // Like Read(), but gives up with -EINTR once another thread sets
+  // "*cancelled" while we're still waiting for data to be converted.
+  virtual int ReadCancellable(char *buf, size_t size, off_t offset,
+                              const bool *cancelled) {
+    return Read(buf, size, offset);
+  }
+
+  // Get handler status. Might be called from multiple threads.
   virtual void GetHandlerStatus(HandlerStats *s) = 0;
-  virtual bool is_gapless() const { return false; }
 
-  // Accept processor passed on from the previous file. Can return false
-  // if this FileHandler cannot use it (e.g. it alrady started convolving).
-  // The Receiver must not use this processor until
-  // NotifyPassedProcessorUnreferenced() is called.
-  virtual bool PassoverProcessor(SoundProcessor *s) { return false; }
+  // Publish current handler status to the stats slot (if we have one), from
+  // where it can be read without locking. Rate limited unless "force" is set,
+  // so this can be called liberally whenever there is progress.
+  void PublishStats(bool force = false);
+
+  // Set slot to publish stats to; called by FileHandlerCache. Can be NULL.
+  void set_stats_slot(HandlerStatsSlot *slot);
+
+  // Returns true if the content (and size) of this file won't change
+  // anymore, so the kernel can serve it from its page cache.
+  virtual bool IsContentStable() { return false; }
+
+  // To be called on open() of a file with stable content. Returns true if
+  // this handler already handed out the same stable content before, so
+  // that pages the kernel has cached from that are still valid.
+  bool NoteStableOpen();
 
-  // If we got a processor passed over, the caller will notify us once it
-  // is fully done with it.
-  virtual void NotifyPassedProcessorUnreferenced() { }
+  // If reading from this handler is the same as reading from an underlying
+  // file, returns its file descriptor, so that the kernel can read it
+  // directly (FUSE passthrough). -1 otherwise.
+  virtual int BackingFileDescriptor() { return -1; }
+
+  // Work invested in this handler that would have to be re-done if it was
+  // thrown away, in number of samples convolved. Used by the
+  // FileHandlerCache to decide which handlers are worth keeping.
+  virtual int64_t InvestedWork() { return 0; }
+
+  // Number of bytes of converted data this handler keeps around.
+  virtual off_t BytesHeld() { return 0; }
+
+  // Start converting ahead of reads, e.g. because this file is likely to be
+  // read next.
+  virtual void RequestPrebuffer() { }
+
+  // Returns true if this is audio we convolve. Only opens of these count
+  // when learning the play order.
+  virtual bool IsConvolvedAudio() { return false; }
 
 private:
   const std::string filter_dir_;
+
+  folve::Mutex publish_mutex_;
+  HandlerStatsSlot *stats_slot_;
+  double last_publish_time_;
+  bool stable_open_seen_;
 };
 
 #endif // FOLVE_FILE_HANDLER_H
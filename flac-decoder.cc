@@ -0,0 +1,160 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "flac-decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "prefetch-reader.h"
+#include "util.h"
+
+using folve::DLogf;
+
+FlacDecoder *FlacDecoder::Create(PrefetchReader *reader, int channels) {
+  FlacDecoder *result = new FlacDecoder(reader, channels);
+  if (result->decoder_ == NULL
+      || (FLAC__stream_decoder_init_stream(result->decoder_, &ReadCallback,
+                                           NULL, NULL, NULL, NULL,
+                                           &WriteCallback, &MetadataCallback,
+                                           &ErrorCallback, result)
+          != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+      || !FLAC__stream_decoder_process_until_end_of_metadata(result->decoder_)
+      || result->stream_channels_ != channels) {
+    DLogf("FLAC decoder: can't use libFLAC on this stream.");
+    delete result;
+    return NULL;
+  }
+  return result;
+}
+
+FlacDecoder::FlacDecoder(PrefetchReader *reader, int channels)
+  : reader_(reader), channels_(channels),
+    decoder_(FLAC__stream_decoder_new()), position_(0), stream_channels_(0),
+    target_(NULL), target_offset_(0), target_space_(0),
+    leftover_(new float*[channels]), leftover_capacity_(0),
+    leftover_pos_(0), leftover_frames_(0) {
+  for (int ch = 0; ch < channels_; ++ch) leftover_[ch] = NULL;
+}
+
+FlacDecoder::~FlacDecoder() {
+  if (decoder_) FLAC__stream_decoder_delete(decoder_);
+  for (int ch = 0; ch < channels_; ++ch) delete [] leftover_[ch];
+  delete [] leftover_;
+}
+
+int FlacDecoder::Decode(float *const *channels, int offset, int frames) {
+  int done = 0;
+  if (leftover_pos_ < leftover_frames_) {
+    done = std::min(frames, leftover_frames_ - leftover_pos_);
+    for (int ch = 0; ch < channels_; ++ch) {
+      memcpy(channels[ch] + offset, leftover_[ch] + leftover_pos_,
+             done * sizeof(float));
+    }
+    leftover_pos_ += done;
+  }
+  // Let libFLAC decode block by block straight into the target until it
+  // is full; the remainder of the last block goes to the leftover.
+  target_ = channels;
+  while (done < frames) {
+    target_offset_ = offset + done;
+    target_space_ = frames - done;
+    if (!FLAC__stream_decoder_process_single(decoder_))
+      break;
+    const int written = frames - done - target_space_;
+    done += written;
+    if (written == 0 && (FLAC__stream_decoder_get_state(decoder_)
+                         == FLAC__STREAM_DECODER_END_OF_STREAM))
+      break;
+  }
+  target_ = NULL;
+  return done;
+}
+
+// Same scaling libsndfile uses when reading FLAC as float. Written as a
+// simple loop for the compiler to vectorize.
+void FlacDecoder::Convert(const FLAC__int32 *in, float *out, int frames,
+                          int bits_per_sample) {
+  const float scale = 1.0f / (1U << (bits_per_sample - 1));
+  for (int i = 0; i < frames; ++i) {
+    out[i] = in[i] * scale;
+  }
+}
+
+FLAC__StreamDecoderReadStatus FlacDecoder::ReadCallback(
+  const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes,
+  void *userdata) {
+  FlacDecoder *flac = reinterpret_cast<FlacDecoder*>(userdata);
+  const ssize_t r = flac->reader_->Read((char*) buffer, *bytes,
+                                        flac->position_);
+  if (r < 0) {
+    *bytes = 0;
+    return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+  }
+  *bytes = r;
+  if (r == 0) return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+  flac->position_ += r;
+  return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+FLAC__StreamDecoderWriteStatus FlacDecoder::WriteCallback(
+  const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+  const FLAC__int32 *const buffer[], void *userdata) {
+  FlacDecoder *flac = reinterpret_cast<FlacDecoder*>(userdata);
+  const int bits = frame->header.bits_per_sample;
+  if ((int) frame->header.channels != flac->channels_
+      || flac->target_ == NULL || bits < 4 || bits > 32) {
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  }
+  const int frames = frame->header.blocksize;
+  const int direct = std::min(frames, flac->target_space_);
+  const int rest = frames - direct;
+  if (rest > flac->leftover_capacity_) {
+    for (int ch = 0; ch < flac->channels_; ++ch) {
+      delete [] flac->leftover_[ch];
+      flac->leftover_[ch] = new float[rest];
+    }
+    flac->leftover_capacity_ = rest;
+  }
+  for (int ch = 0; ch < flac->channels_; ++ch) {
+    Convert(buffer[ch], flac->target_[ch] + flac->target_offset_,
+            direct, bits);
+    Convert(buffer[ch] + direct, flac->leftover_[ch], rest, bits);
+  }
+  flac->target_offset_ += direct;
+  flac->target_space_ -= direct;
+  flac->leftover_pos_ = 0;
+  flac->leftover_frames_ = rest;
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+void FlacDecoder::MetadataCallback(const FLAC__StreamDecoder *decoder,
+                                   const FLAC__StreamMetadata *metadata,
+                                   void *userdata) {
+  if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+    FlacDecoder *flac = reinterpret_cast<FlacDecoder*>(userdata);
+    flac->stream_channels_ = metadata->data.stream_info.channels;
+  }
+}
+
+void FlacDecoder::ErrorCallback(const FLAC__StreamDecoder *decoder,
+                                FLAC__StreamDecoderErrorStatus status,
+                                void *userdata) {
+  DLogf("FLAC decoder: %s", FLAC__StreamDecoderErrorStatusString[status]);
+}
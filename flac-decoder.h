@@ -0,0 +1,82 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_FLAC_DECODER_H
+#define FOLVE_FLAC_DECODER_H
+
+#include <FLAC/stream_decoder.h>
+#include <sys/types.h>
+
+#include "input-decoder.h"
+
+class PrefetchReader;
+
+// Decoder for FLAC files using libFLAC directly. libFLAC decodes into
+// separate buffers per channel anyway, so we convert these straight into
+// the convolver input instead of interleaving and de-interleaving again
+// as going through libsndfile would do.
+class FlacDecoder : public InputDecoder {
+public:
+  // Returns a decoder reading from "reader" if it contains a FLAC stream
+  // with the given number of channels; NULL otherwise. Does not take
+  // ownership of the reader.
+  static FlacDecoder *Create(PrefetchReader *reader, int channels);
+  virtual ~FlacDecoder();
+
+  virtual int Decode(float *const *channels, int offset, int frames);
+
+private:
+  FlacDecoder(PrefetchReader *reader, int channels);
+
+  // Convert frames of a decoded block to float.
+  static void Convert(const FLAC__int32 *in, float *out, int frames,
+                      int bits_per_sample);
+
+  // -- libFLAC callbacks.
+  static FLAC__StreamDecoderReadStatus ReadCallback(
+    const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes,
+    void *userdata);
+  static FLAC__StreamDecoderWriteStatus WriteCallback(
+    const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+    const FLAC__int32 *const buffer[], void *userdata);
+  static void MetadataCallback(const FLAC__StreamDecoder *decoder,
+                               const FLAC__StreamMetadata *metadata,
+                               void *userdata);
+  static void ErrorCallback(const FLAC__StreamDecoder *decoder,
+                            FLAC__StreamDecoderErrorStatus status,
+                            void *userdata);
+
+  PrefetchReader *const reader_;
+  const int channels_;
+  FLAC__StreamDecoder *decoder_;
+  off_t position_;             // Read position in the file.
+  int stream_channels_;        // As announced in the stream info.
+
+  // Where the WriteCallback() should put decoded frames.
+  float *const *target_;
+  int target_offset_;
+  int target_space_;   // Frames still to fill.
+
+  // Decoded frames that did not fit into the target.
+  float **leftover_;
+  int leftover_capacity_;
+  int leftover_pos_;
+  int leftover_frames_;
+};
+
+#endif  // FOLVE_FLAC_DECODER_H
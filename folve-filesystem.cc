@@ -32,6 +32,7 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <zita-convolver.h>
@@ -43,10 +44,21 @@
 #include "pass-through-handler.h"
 #include "util.h"
 
+// Converting a file joined gapless with its predecessor might result in
+// a slightly different compressed size. Rather report a bit too much.
+static const off_t kGaplessSizeSlack = 65535;
+
+// Pre-buffering files predicted to be played next is a gamble with CPU time.
+// Only do that for a few files that followed often enough.
+static const size_t kMaxPredictedFiles = 2;
+static const float kMinPredictedLikelihood = 0.25;
+
 FolveFilesystem::FolveFilesystem()
-  : gapless_processing_(false), toplevel_dir_is_filter_(false),
-    pre_buffer_size_(128 << 10),
-    open_file_cache_(4),
+  : gapless_processing_(false), dither_output_(false),
+    toplevel_dir_is_filter_(false),
+    pre_buffer_size_(128 << 10), segment_workers_(1),
+    pre_buffer_idle_timeout_(60),
+    open_file_cache_(4), directory_cache_(256), play_order_(1024),
     processor_pool_(3), buffer_thread_(NULL),
     total_file_openings_(0), total_file_reopen_(0),
     // oversize factor of 1.25 seems to be a good initial size.
@@ -54,13 +66,53 @@ FolveFilesystem::FolveFilesystem()
     workaround_flac_header_issue_(false) {
 }
 
-void FolveFilesystem::RequestPrebuffer(ConversionBuffer *buffer) {
-  if (pre_buffer_size_ <= 0) return;
+void FolveFilesystem::set_segment_workers(int n) {
+  segment_workers_ = n;
+  // Keep enough processors around to not create them for every file.
+  processor_pool_.set_max_per_config(std::max(n, 3));
+}
+
+BufferThread *FolveFilesystem::GetBufferThread() {
   if (buffer_thread_ == NULL) {
-    buffer_thread_ = new BufferThread(pre_buffer_size_);
+    buffer_thread_ = new BufferThread(pre_buffer_size_,
+                                      pre_buffer_idle_timeout_);
     buffer_thread_->Start();
   }
-  buffer_thread_->EnqueueWork(buffer);
+  return buffer_thread_;
+}
+
+void FolveFilesystem::RequestPrebuffer(ConversionBuffer *buffer) {
+  if (pre_buffer_size_ <= 0) return;
+  GetBufferThread()->EnqueueWork(buffer);
+}
+
+class FolveFilesystem::PrebufferNextFilesTask : public BufferThread::Task {
+public:
+  PrebufferNextFilesTask(FolveFilesystem *fs, const std::string &fs_path)
+    : fs_(fs), fs_path_(fs_path) {}
+
+  virtual void Run() {
+    std::vector<std::string> next_paths;
+    fs_->PredictNextFiles(fs_path_, &next_paths);
+    for (size_t i = 0; i < next_paths.size(); ++i) {
+      FileHandler *next_file = fs_->GetOrCreateHandler(next_paths[i].c_str());
+      if (next_file == NULL)
+        continue;
+      folve::DLogf("Pre-buffer '%s', likely played after '%s'",
+                   next_paths[i].c_str(), fs_path_.c_str());
+      next_file->RequestPrebuffer();
+      fs_->Close(next_paths[i].c_str(), next_file);
+    }
+  }
+
+private:
+  FolveFilesystem *const fs_;
+  const std::string fs_path_;
+};
+
+void FolveFilesystem::PrebufferNextFiles(const std::string &fs_path) {
+  if (pre_buffer_size_ <= 0) return;
+  GetBufferThread()->EnqueueTask(new PrebufferNextFilesTask(this, fs_path));
 }
 
 void FolveFilesystem::QuitBuffering(ConversionBuffer *buffer) {
@@ -85,6 +137,15 @@ FileHandler *FolveFilesystem::CreateFromDescriptor(
     if (handler != NULL) return handler;
   }
   // Every other file-type is just passed through as is.
+  if (!config_dir.empty()) {
+    // Remember, so that next time we don't have to guess its size.
+    struct stat st;
+    if (fstat(filedes, &st) == 0) {
+      size_index_.Record(underlying_file, config_dir,
+                         FilterStamp(config_dir), st, st.st_size,
+                         SizeIndex::VERBATIM);
+    }
+  }
   return new PassThroughHandler(filedes, config_dir, file_info);
 }
 
@@ -107,8 +168,7 @@ bool FolveFilesystem::ExtractFilterName(const char *path,
   }
 }
 
-FileHandler *FolveFilesystem::GetOrCreateHandler(const char *fs_path,
-                                                 bool want_gapless) {
+FileHandler *FolveFilesystem::GetOrCreateHandler(const char *fs_path) {
   std::string config_path;
   if (!ExtractFilterName(fs_path, &config_path)) {
     errno = ENOENT;   // Invalid toplevel directory.
@@ -116,7 +176,7 @@ FileHandler *FolveFilesystem::GetOrCreateHandler(const char *fs_path,
   }
   const std::string cache_key = CacheKey(config_path, fs_path);
   const std::string underlying_file = GetUnderlyingFile(fs_path);
-  FileHandler *handler = open_file_cache_.FindAndPin(cache_key, want_gapless);
+  FileHandler *handler = open_file_cache_.FindAndPin(cache_key);
   if (handler == NULL) {
     int filedes = open(underlying_file.c_str(), O_RDONLY);
     if (filedes < 0)
@@ -143,15 +203,92 @@ std::string FolveFilesystem::GetUnderlyingFile(const char *path) const {
 }
 
 
-int FolveFilesystem::StatByFilename(const char *fs_path, struct stat *st) {
+int FolveFilesystem::StatByFilename(const char *fs_path, struct stat *st,
+                                    bool *content_stable) {
   const std::string cache_key = CacheKey(current_config_subdir_, fs_path);
   FileHandler *handler = open_file_cache_.FindAndPin(cache_key);
   if (!handler) return -1;
   ssize_t result = handler->Stat(st);
+  *content_stable = handler->IsContentStable();
   open_file_cache_.Unpin(cache_key);
   return result;
 }
 
+// FNV-1a, continued from "hash".
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+uint64_t FolveFilesystem::FilterStamp(const std::string &filter) {
+  uint64_t stamp = 0xcbf29ce484222325ULL;
+  const char options[] = { dither_output_, workaround_flac_header_issue_ };
+  stamp = HashBytes(stamp, options, sizeof(options));
+  const std::string dir = base_config_dir_ + "/" + filter;
+  const DirectoryCache::Listing *listing = directory_cache_.AcquireListing(dir);
+  if (listing == NULL) return stamp;
+  const std::vector<DirectoryCache::Entry> &entries = listing->entries();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].type == DT_DIR) continue;
+    const std::string path = dir + "/" + entries[i].name;
+    struct stat st;
+    if (directory_cache_.Stat(path, &st) != 0) continue;
+    if (S_ISLNK(st.st_mode) && stat(path.c_str(), &st) != 0) continue;
+    const int64_t values[] = { st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                               st.st_size };
+    stamp = HashBytes(stamp, entries[i].name.c_str(),
+                      entries[i].name.length() + 1);
+    stamp = HashBytes(stamp, values, sizeof(values));
+  }
+  directory_cache_.ReleaseListing(listing);
+  return stamp;
+}
+
+bool FolveFilesystem::GetKnownOutputSize(const std::string &underlying_file,
+                                         const std::string &filter,
+                                         const struct stat &source_stat,
+                                         off_t *size) {
+  int flags;
+  uint64_t filter_stamp;
+  if (!size_index_.Lookup(underlying_file, filter, source_stat, size, &flags,
+                          &filter_stamp)
+      || filter_stamp != FilterStamp(filter)) {
+    return false;
+  }
+  if (!(flags & SizeIndex::VERBATIM)
+      && ((flags & SizeIndex::GAPLESS) || gapless_processing_)) {
+    *size += kGaplessSizeSlack;
+  }
+  return true;
+}
+
+bool FolveFilesystem::PredictOutputSize(const char *fs_path, struct stat *st) {
+  if (!S_ISREG(st->st_mode)) return true;
+  std::string filter;
+  if (toplevel_directory_is_filter()) {
+    // Not verifying the filter name here; if invalid, we don't find it.
+    const char *found = strchr(fs_path + 1, '/');
+    if (found == NULL) return true;
+    filter.assign(fs_path + 1, found - fs_path - 1);
+    if (filter == "_") filter.clear();
+  } else {
+    filter = current_config_subdir_;
+  }
+  if (filter.empty()) return true;  // Pass-through: original size.
+  off_t known_size;
+  if (GetKnownOutputSize(GetUnderlyingFile(fs_path), filter, *st,
+                         &known_size)) {
+    st->st_size = known_size;
+    return true;
+  }
+  st->st_size *= file_oversize_factor_;
+  return false;
+}
+
 void FolveFilesystem::Close(const char *fs_path, const FileHandler *handler) {
   assert(handler != NULL);
   const std::string cache_key = CacheKey(handler->filter_dir(), fs_path);
@@ -165,22 +302,51 @@ static bool IsDirectory(const std::string &path) {
   return (st.st_mode & S_IFMT) == S_IFDIR;
 }
 
-bool FolveFilesystem::ListDirectory(const std::string &fs_dir,
-                                    const std::string &suffix,
-                                    std::set<std::string> *files) {
-  const std::string real_dir = GetUnderlyingFile(fs_dir.c_str());
-  DIR *dp = opendir(real_dir.c_str());
-  if (dp == NULL) return false;
-  struct dirent *dent;
-  while ((dent = readdir(dp)) != NULL) {
-    if (!folve::HasSuffix(dent->d_name, suffix))
-      continue;
-    files->insert(fs_dir + dent->d_name);
+bool FolveFilesystem::FindAdjacentFile(const std::string &fs_path, bool next,
+                                       std::string *adjacent_fs_path) {
+  const std::string::size_type slash_pos = fs_path.find_last_of('/');
+  if (slash_pos == std::string::npos) return false;
+  const std::string fs_dir = fs_path.substr(0, slash_pos + 1);
+  const std::string name = fs_path.substr(slash_pos + 1);
+  std::string suffix;
+  const std::string::size_type dot_pos = name.find_last_of('.');
+  if (dot_pos != std::string::npos) {
+    suffix = name.substr(dot_pos);
   }
-  closedir(dp);
+  const std::string dir = GetUnderlyingFile(fs_dir.c_str());
+  std::string adjacent_name;
+  const bool found = (next
+                      ? directory_cache_.FindNextFile(dir, name, suffix,
+                                                      &adjacent_name)
+                      : directory_cache_.FindPreviousFile(dir, name, suffix,
+                                                          &adjacent_name));
+  if (!found) return false;
+  *adjacent_fs_path = fs_dir + adjacent_name;
   return true;
 }
 
+bool FolveFilesystem::FindNextFile(const std::string &fs_path,
+                                   std::string *next_fs_path) {
+  return FindAdjacentFile(fs_path, true, next_fs_path);
+}
+
+bool FolveFilesystem::FindPreviousFile(const std::string &fs_path,
+                                       std::string *previous_fs_path) {
+  return FindAdjacentFile(fs_path, false, previous_fs_path);
+}
+
+void FolveFilesystem::PredictNextFiles(const std::string &fs_path,
+                                       std::vector<std::string> *next_fs_paths) {
+  play_order_.PredictNext(fs_path, kMaxPredictedFiles,
+                          kMinPredictedLikelihood, next_fs_paths);
+  std::string next_fs_path;
+  if (next_fs_paths->empty() && gapless_processing_
+      && FindNextFile(fs_path, &next_fs_path)) {
+    // Nothing learned yet; gapless albums are typically played in order.
+    next_fs_paths->push_back(next_fs_path);
+  }
+}
+
 bool FolveFilesystem::SanitizeConfigSubdir(std::string *subdir_path) const {
   if (base_config_dir_.length() + 1 + subdir_path->length() > PATH_MAX)
     return false;  // uh, someone wants to buffer overflow us ?
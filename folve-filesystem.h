@@ -25,9 +25,12 @@
 #include <vector>
 #include <set>
 
+#include "directory-cache.h"
 #include "file-handler-cache.h"
 #include "file-handler.h"
+#include "play-order.h"
 #include "processor-pool.h"
+#include "size-index.h"
 
 #ifndef FOLVE_VERSION
 #  define FOLVE_VERSION "[unknown version - compile from git]"
@@ -81,30 +84,68 @@ public:
   void SetupInitialConfig();
 
   // Create a new filter given the filesystem path and the underlying
-  // path. If "want_gapless", then attempt to only return one that starts
-  // gapless or can me made into one.
+  // path.
   // Returns NULL, if it cannot be created.
-  FileHandler *GetOrCreateHandler(const char *fs_path, bool want_gapless);
+  FileHandler *GetOrCreateHandler(const char *fs_path);
 
   // Inform filesystem that this file handler is not needed anymore
   // (FS still might consider keeping it around for a while).
   void Close(const char *fs_path, const FileHandler *handler);
 
-  // Return dynamic size of file.
-  int StatByFilename(const char *fs_path, struct stat *st);
-
-  // List files in given filesystem directory that match the suffix.
-  // Returns a set of filesystem paths of existing files.
-  // (We don't want globbing as filenames might contain weird characters).
-  bool ListDirectory(const std::string &fs_dir, const std::string &suffix,
-                     std::set<std::string> *files);
+  // Return dynamic size of file. Sets "content_stable" if it won't change
+  // anymore.
+  int StatByFilename(const char *fs_path, struct stat *st,
+                     bool *content_stable);
+
+  // For a file that is not open: given the stat() of the underlying file,
+  // adjust the size to what we expect to deliver. That is the exact size if
+  // we converted the file before, otherwise an estimate. Returns false if
+  // it is an estimate.
+  bool PredictOutputSize(const char *fs_path, struct stat *st);
+
+  // A value that changes whenever the output of "filter" might change:
+  // the files in its configuration directory (e.g. config files and
+  // impulses) or output options.
+  uint64_t FilterStamp(const std::string &filter);
+
+  // Lookup size of a previous conversion of "underlying_file" with "filter".
+  // Returns false if unknown or the filter changed since.
+  bool GetKnownOutputSize(const std::string &underlying_file,
+                          const std::string &filter,
+                          const struct stat &source_stat, off_t *size);
+
+  // Find the file that alphabetically follows "fs_path" in the same
+  // directory and has the same suffix. Returns its filesystem path in
+  // "next_fs_path" or false if there is none.
+  bool FindNextFile(const std::string &fs_path, std::string *next_fs_path);
+
+  // Like FindNextFile(), but the file alphabetically before "fs_path".
+  bool FindPreviousFile(const std::string &fs_path,
+                        std::string *previous_fs_path);
+
+  // Files that are likely to be played after "fs_path" as learned from
+  // the play order, most likely first. Worth pre-buffering.
+  void PredictNextFiles(const std::string &fs_path,
+                        std::vector<std::string> *next_fs_paths);
+
+  // Start converting the files likely to be played after "fs_path". Opening
+  // them takes a while, so this is done in the pre-buffer thread; returns
+  // right away.
+  void PrebufferNextFiles(const std::string &fs_path);
 
   FileHandlerCache *handler_cache() { return &open_file_cache_; }
+  DirectoryCache *directory_cache() { return &directory_cache_; }
   ProcessorPool *processor_pool() { return &processor_pool_; }
+  SizeIndex *size_index() { return &size_index_; }
+  PlayOrderModel *play_order() { return &play_order_; }
 
   void set_gapless_processing(bool b) { gapless_processing_ = b; }
   bool gapless_processing() const { return gapless_processing_; }
 
+  // Add TPDF dither when quantizing output to integer samples.
+  void set_dither_output(bool b) { dither_output_ = b; }
+  bool dither_output() const { return dither_output_; }
+
   void set_toplevel_directory_is_filter(bool b) { toplevel_dir_is_filter_ = b; }
   bool toplevel_directory_is_filter() const { return toplevel_dir_is_filter_; }
 
@@ -116,10 +157,19 @@ public:
     return initial_filter_config_;
   }
 
+  // Convert local uncompressed files in this many segments in parallel.
+  void set_segment_workers(int n);
+  int segment_workers() const { return segment_workers_; }
+
   // Should we attempt to pre-buffer files ?
   void set_pre_buffer_size(int b) { pre_buffer_size_ = b; }
   int pre_buffer_size() const { return pre_buffer_size_; }
 
+  // Stop pre-buffering files that were not read from for this many seconds.
+  // Switched off if not positive.
+  void set_pre_buffer_idle_timeout(double t) { pre_buffer_idle_timeout_ = t; }
+  double pre_buffer_idle_timeout() const { return pre_buffer_idle_timeout_; }
+
   // Some media servers look at the file size initially to decide which is
   // the file-size they need to serve. However, the final file-size after
   // convolving might be different (compression not really predictable) and
@@ -158,6 +208,14 @@ private:
   // reported.
   const std::set<std::string> ListConfigDirs(bool warn_invalid) const;
 
+  bool FindAdjacentFile(const std::string &fs_path, bool next,
+                        std::string *adjacent_fs_path);
+
+  class PrebufferNextFilesTask;
+
+  // Get the pre-buffer thread, starting it if needed.
+  BufferThread *GetBufferThread();
+
   // Extract filter name from path if needed.
   bool ExtractFilterName(const char *path, std::string *filter) const;
 
@@ -167,9 +225,15 @@ private:
 
   std::string current_config_subdir_;
   bool gapless_processing_;
+  bool dither_output_;
   bool toplevel_dir_is_filter_;
   int pre_buffer_size_;
+  int segment_workers_;
+  double pre_buffer_idle_timeout_;
   FileHandlerCache open_file_cache_;
+  DirectoryCache directory_cache_;
+  SizeIndex size_index_;
+  PlayOrderModel play_order_;
   ProcessorPool processor_pool_;
   BufferThread *buffer_thread_;
   int total_file_openings_;
@@ -16,8 +16,8 @@
 //  You should have received a copy of the GNU General Public License
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-#define FUSE_USE_VERSION 30
-#include <fuse.h>
+#define FUSE_USE_VERSION 32
+#include <fuse_lowlevel.h>
 
 #include <dirent.h>
 #include <errno.h>
@@ -36,7 +36,17 @@
 #include <unistd.h>
 #include <zita-convolver.h>  // for major/minor version number.
 
+#include <list>
+#include <map>
+
+// FUSE passthrough (Linux >= 6.9): the kernel reads directly from a
+// backing file we register.
+#ifdef FUSE_CAP_PASSTHROUGH
+#  define FOLVE_FUSE_PASSTHROUGH 1
+#endif
+
 #include "folve-filesystem.h"
+#include "inode-table.h"
 #include "status-server.h"
 #include "util.h"
 
@@ -44,11 +54,38 @@ static const char kStatusFileName[] = "/folve-status.html";
 static const int kUsefulMinBuf = 64;
 static const int kUsefulMaxBuf = 16384;
 
+// We mostly see large sequential reads of audio streams, so let the kernel
+// read ahead generously and keep enough requests in flight.
+static const int kDefaultReadaheadKiB = 1024;
+static const int kMaxBackgroundRequests = 64;
+
+// How long the kernel may cache names, and attributes of files whose size
+// is final. Our own directory cache re-validates after a similar time
+// anyway.
+static const double kEntryTimeoutSeconds = 5.0;
+static const double kStableAttrTimeoutSeconds = 5.0;
+// Sizes we only estimate might change any time; cache them as long as the
+// high-level FUSE API does by default. Files still being converted grow
+// with every read, so their attributes are not cached at all.
+static const double kAttrTimeoutSeconds = 1.0;
+
+// Reads that have to wait for conversion are handed to worker threads, so
+// that the FUSE threads are free to answer other requests meanwhile. Unless
+// the number of FUSE threads is limited with -T, we use this many.
+static const int kDefaultReadWorkerThreads = 8;
+
+// Inode number for our own directory entries the kernel doesn't know yet.
+static const uint64_t kUnknownInode = 0xffffffff;
+
+class ReadWorkerPool;
+
 // Compilation unit variables to communicate with the fuse callbacks.
 static struct FolveRuntime {
   FolveRuntime() : fs(NULL), mount_point(NULL), pid_file(NULL),
                    status_port(-1), refresh_time(10), parameter_error(false),
-                   readdir_dump_file(NULL), status_server(NULL) {}
+                   readdir_dump_file(NULL), status_server(NULL),
+                   max_idle_threads(-1), readahead_kib(kDefaultReadaheadKiB),
+                   session(NULL), read_pool(NULL) {}
   FolveFilesystem *fs;
   const char *mount_point;
   const char *pid_file;
@@ -57,8 +94,93 @@ static struct FolveRuntime {
   bool parameter_error;
   FILE *readdir_dump_file;
   StatusServer *status_server;
+  int max_idle_threads;   // -1 for fuse default.
+  int readahead_kib;
+  InodeTable inodes;
+  struct fuse_session *session;
+  ReadWorkerPool *read_pool;
 } folve_rt;
 
+// Backing files registered with the kernel for FUSE passthrough. All open
+// files of an inode need to share the same backing file, so we register it
+// once per handler and keep it as long as the handler is open at all.
+// release() doesn't tell us whether an open used passthrough, so we count
+// all opens.
+class PassthroughRegistry {
+public:
+  PassthroughRegistry() : enabled_(false) {}
+
+  void set_enabled(bool enabled) {
+    folve::MutexLock l(&mutex_);
+    enabled_ = enabled;
+  }
+
+  // Note an open of the handler. If "want_passthrough", registers the
+  // backing file of the handler if it has one. Returns backing-id to pass to
+  // the kernel or 0 if passthrough is not possible.
+  int Acquire(fuse_req_t req, FileHandler *handler, bool want_passthrough);
+
+  // Note a close of the handler; to be called for every Acquire(). With the
+  // last one, the backing file is unregistered.
+  void Release(fuse_req_t req, FileHandler *handler);
+
+private:
+  struct Backing {
+    Backing() : id(0), opens(0) {}
+    int id;
+    int opens;
+  };
+  typedef std::map<FileHandler*, Backing> BackingMap;
+
+  folve::Mutex mutex_;
+  bool enabled_;
+  BackingMap backings_;
+} passthrough_registry;
+
+#ifdef FOLVE_FUSE_PASSTHROUGH
+int PassthroughRegistry::Acquire(fuse_req_t req, FileHandler *handler,
+                                 bool want_passthrough) {
+  folve::MutexLock l(&mutex_);
+  Backing &backing = backings_[handler];
+  ++backing.opens;
+  if (!want_passthrough) return 0;
+  if (backing.id > 0 || !enabled_) return backing.id;
+  const int backing_fd = handler->BackingFileDescriptor();
+  if (backing_fd < 0) return 0;
+  const int id = fuse_passthrough_open(req, backing_fd);
+  if (id <= 0) {
+    // Typically we're not allowed to (needs CAP_SYS_ADMIN). That won't
+    // change, so don't bother trying again.
+    syslog(LOG_INFO, "FUSE passthrough not available (%s); "
+           "serving pass-through files via regular reads.", strerror(errno));
+    enabled_ = false;
+    return 0;
+  }
+  backing.id = id;
+  return id;
+}
+
+void PassthroughRegistry::Release(fuse_req_t req, FileHandler *handler) {
+  folve::MutexLock l(&mutex_);
+  BackingMap::iterator found = backings_.find(handler);
+  if (found == backings_.end()) return;
+  if (--found->second.opens > 0) return;
+  // Gone before the handler can be deleted, so a new handler at the same
+  // address never finds a stale backing-id.
+  const int id = found->second.id;
+  backings_.erase(found);
+  if (id > 0 && fuse_passthrough_close(req, id) != 0) {
+    folve::DLogf("Closing passthrough backing-id %d: %s", id, strerror(errno));
+  }
+}
+#else
+int PassthroughRegistry::Acquire(fuse_req_t req, FileHandler *handler,
+                                 bool want_passthrough) {
+  return 0;
+}
+void PassthroughRegistry::Release(fuse_req_t req, FileHandler *handler) {}
+#endif
+
 // Logger that only prints to stderr; used when -R given on commandline.
 class ReaddirLogger {
 public:
@@ -109,142 +231,602 @@ static bool MightBePassthroughFile(const char *name) {
           (strcasecmp(name, ".txt") == 0));
 }
 
-// Essentially lstat(). Just forward to the original filesystem (this
-// will by lying: our convolved files are of different size...)
-static int folve_getattr(const char *path, struct stat *stbuf,
-                         struct fuse_file_info *fi) {
-  if (fi != NULL) {
-    // Open file; simple.
-    return reinterpret_cast<FileHandler *>(fi->fh)->Stat(stbuf);
-  }
-
-  // Not open; find the same info by filename.
-
-  if (strcmp(path, kStatusFileName) == 0) {  // folve-status.html
-    FileHandler *status = folve_rt.status_server->CreateStatusFileHandler();
-    status->Stat(stbuf);
-    delete status;
-    return 0;
-  }
+// How long the kernel may cache attributes of a regular file. "size_final"
+// tells if its size won't change with the current filter.
+static double FileAttrTimeout(bool size_final) {
+  // Without -t, switching filters changes the size of the same file.
+  return (size_final && folve_rt.fs->toplevel_directory_is_filter())
+    ? kStableAttrTimeoutSeconds : kAttrTimeoutSeconds;
+}
 
+// Attributes of a file that is not open. Essentially lstat() on the original
+// filesystem, but with the size we expect to deliver. Returns how long the
+// kernel may cache them in "attr_timeout".
+static int GetAttributesByPath(const char *path, struct stat *stbuf,
+                               double *attr_timeout) {
   // If this is a currently open filename, we might be able to output a better
   // estimate.
-  int result = folve_rt.fs->StatByFilename(path, stbuf);
+  bool content_stable = false;
+  int result = folve_rt.fs->StatByFilename(path, stbuf, &content_stable);
   if (result != 0) {
     // Fallback; There is no file-handler open for it. Let's ask our underlying
     // filesystem directly.
-    result = lstat(folve_rt.fs->GetUnderlyingFile(path).c_str(), stbuf);
+    result = folve_rt.fs->directory_cache()
+      ->Stat(folve_rt.fs->GetUnderlyingFile(path), stbuf);
     rlog.Log("STAT %s mode=%03o %s %s %s", path,
              stbuf->st_mode & 0777, S_ISDIR(stbuf->st_mode) ? "DIR" : "",
              (result == -1) ? strerror(errno) : "",
              ctime(&stbuf->st_mtime));  // ctime ends with \n, so put that last
-    if (!MightBePassthroughFile(path)) {
-      stbuf->st_size *= folve_rt.fs->file_oversize_factor();
-    }
     if (result == -1) {
       return -errno;
     }
+    const bool size_final = (MightBePassthroughFile(path)
+                             || folve_rt.fs->PredictOutputSize(path, stbuf));
+    *attr_timeout = S_ISDIR(stbuf->st_mode)
+      ? kStableAttrTimeoutSeconds : FileAttrTimeout(size_final);
   } else {
     rlog.Log("FOLVE-Stat %s\n", path);
+    *attr_timeout = content_stable ? FileAttrTimeout(true) : 0;
   }
   // Whatever write mode was there before: now things are readonly.
   stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
   return 0;
 }
 
-// readdir(). Just forward to original filesystem.
-static int folve_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi,
-                         fuse_readdir_flags flags) {
-  if (strcmp(path, "/") == 0) {
-    struct stat st;
-    memset(&st, 0, sizeof(st));
-    filler(buf, kStatusFileName + 1, &st, 0, FUSE_FILL_DIR_PLUS);
+// Attributes by filename; this is the status file or GetAttributesByPath().
+static int GetAttributes(const std::string &path, struct stat *stbuf,
+                         double *attr_timeout) {
+  if (path == kStatusFileName) {  // folve-status.html
+    FileHandler *status = folve_rt.status_server->CreateStatusFileHandler();
+    status->Stat(stbuf);
+    delete status;
+    *attr_timeout = 0;  // Different with every open.
+    return 0;
+  }
+  return GetAttributesByPath(path.c_str(), stbuf, attr_timeout);
+}
+
+static std::string ChildPath(const std::string &dir, const char *name) {
+  return (dir == "/") ? dir + name : dir + "/" + name;
+}
+
+// Fill in entry for "path" that we hand out to the kernel. The kernel then
+// holds a reference to the inode until it forgets it.
+static void AcquireEntry(const std::string &path, double attr_timeout,
+                         struct fuse_entry_param *entry) {
+  entry->ino = folve_rt.inodes.Acquire(path);
+  entry->attr.st_ino = entry->ino;
+  entry->attr_timeout = attr_timeout;
+  entry->entry_timeout = kEntryTimeoutSeconds;
+}
+
+static void folve_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  std::string parent_path;
+  if (!folve_rt.inodes.GetPath(parent, &parent_path)) {
+    fuse_reply_err(req, ESTALE);
+    return;
+  }
+  const std::string path = ChildPath(parent_path, name);
+  struct fuse_entry_param entry;
+  memset(&entry, 0, sizeof(entry));
+  double attr_timeout;
+  const int result = GetAttributes(path, &entry.attr, &attr_timeout);
+  if (result != 0) {
+    fuse_reply_err(req, -result);
+    return;
+  }
+  AcquireEntry(path, attr_timeout, &entry);
+  if (fuse_reply_entry(req, &entry) != 0) {
+    folve_rt.inodes.Forget(entry.ino, 1);  // Kernel never got it.
+  }
+}
+
+static void folve_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  folve_rt.inodes.Forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void folve_forget_multi(fuse_req_t req, size_t count,
+                               struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; ++i) {
+    folve_rt.inodes.Forget(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+// Essentially lstat(). Just forward to the original filesystem (this
+// will by lying: our convolved files are of different size...)
+static void folve_getattr(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  int result;
+  double attr_timeout;
+  if (fi != NULL) {
+    // Open file; simple.
+    FileHandler *handler = reinterpret_cast<FileHandler *>(fi->fh);
+    result = handler->Stat(&st);
+    attr_timeout = handler->IsContentStable() ? FileAttrTimeout(true) : 0;
+  } else {
+    // Not open; find the same info by filename.
+    std::string path;
+    if (!folve_rt.inodes.GetPath(ino, &path)) {
+      fuse_reply_err(req, ESTALE);
+      return;
+    }
+    result = GetAttributes(path, &st, &attr_timeout);
+  }
+  if (result != 0) {
+    fuse_reply_err(req, -result);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, attr_timeout);
+}
+
+// A directory opened with opendir(). Keeps the listing that was current
+// at that time, so that subsequent readdir() calls can resume at the offset
+// the kernel asks for. Directories too large to keep in memory are read
+// incrementally from the underlying filesystem instead.
+struct OpenDirectory {
+  OpenDirectory() : listing(NULL), stream(NULL) {}
+  std::string path;
+  const DirectoryCache::Listing *listing;
+  DIR *stream;
+};
+
+static void folve_opendir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  OpenDirectory *dir = new OpenDirectory();
+  if (!folve_rt.inodes.GetPath(ino, &dir->path)) {
+    delete dir;
+    fuse_reply_err(req, ESTALE);
+    return;
+  }
+  const bool is_root = (dir->path == "/");
+  // With toplevel filter directories, the root only has our own entries.
+  if (!is_root || !folve_rt.fs->toplevel_directory_is_filter()) {
+    DirectoryCache *const dir_cache = folve_rt.fs->directory_cache();
+    const std::string underlying
+      = folve_rt.fs->GetUnderlyingFile(dir->path.c_str());
+    // The root shares the offsets with our status file, so we can't use
+    // the offsets of the underlying filesystem there.
+    dir->listing = is_root
+      ? dir_cache->AcquireListing(underlying)
+      : dir_cache->AcquireSmallListing(underlying);
+    if (dir->listing == NULL && errno == EFBIG) {
+      dir->stream = opendir(underlying.c_str());
+    }
+    if (dir->listing == NULL && dir->stream == NULL) {
+      const int err = errno;
+      delete dir;
+      fuse_reply_err(req, err);
+      return;
+    }
+  }
+  fi->fh = (uint64_t) dir;
+  if (fuse_reply_open(req, fi) != 0) {
+    if (dir->listing != NULL)
+      folve_rt.fs->directory_cache()->ReleaseListing(dir->listing);
+    if (dir->stream != NULL)
+      closedir(dir->stream);
+    delete dir;
+  }
+}
+
+static void folve_releasedir(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+  OpenDirectory *dir = reinterpret_cast<OpenDirectory *>(fi->fh);
+  if (dir->listing != NULL)
+    folve_rt.fs->directory_cache()->ReleaseListing(dir->listing);
+  if (dir->stream != NULL)
+    closedir(dir->stream);
+  delete dir;
+  fuse_reply_err(req, 0);
+}
+
+// Collects directory entries for a readdir() reply.
+class DirectoryReply {
+public:
+  DirectoryReply(fuse_req_t req, const std::string &dir, size_t size,
+                 bool with_attributes)
+    : req_(req), dir_prefix_(dir == "/" ? dir : dir + "/"),
+      with_attributes_(with_attributes), buffer_(new char[size]),
+      size_(size), used_(0) {}
+  ~DirectoryReply() { delete [] buffer_; }
+
+  // Add an entry; "st" has at least type filled in and, if known, the
+  // inode in the underlying filesystem. "next_offset" is
+  // where to resume after this entry. If "attributes_allowed" and the
+  // kernel asked for it, this entry is handed out with full attributes.
+  // Returns false if the reply is full.
+  bool Add(const char *name, struct stat *st, off_t next_offset,
+           bool attributes_allowed);
+
+  void Send() { fuse_reply_buf(req_, buffer_, used_); }
+
+private:
+  fuse_req_t const req_;
+  const std::string dir_prefix_;
+  const bool with_attributes_;
+  char *const buffer_;
+  const size_t size_;
+  size_t used_;
+};
+
+bool DirectoryReply::Add(const char *name, struct stat *st, off_t next_offset,
+                         bool attributes_allowed) {
+  rlog.Log("ITEM %s%s\n", dir_prefix_.c_str(), name);
+  const size_t remaining = size_ - used_;
+  // Inodes the kernel already knows from us take precedence, so that
+  // readdir() and stat() agree.
+  const uint64_t known_inode = folve_rt.inodes.Find(dir_prefix_ + name);
+  if (known_inode != 0) {
+    st->st_ino = known_inode;
+  } else if (st->st_ino == 0) {
+    st->st_ino = kUnknownInode;
+  }
+  size_t entry_size;
+  if (with_attributes_) {
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.attr = *st;
+    // "." and ".." are looked up by the kernel itself.
+    const std::string path = dir_prefix_ + name;
+    double attr_timeout;
+    const bool have_attr = (attributes_allowed
+                            && strcmp(name, ".") != 0
+                            && strcmp(name, "..") != 0
+                            && GetAttributesByPath(path.c_str(), &entry.attr,
+                                                   &attr_timeout) == 0);
+    if (have_attr) {
+      AcquireEntry(path, attr_timeout, &entry);
+    } else {
+      entry.attr = *st;
+    }
+    entry_size = fuse_add_direntry_plus(req_, buffer_ + used_, remaining,
+                                        name, &entry, next_offset);
+    if (have_attr && entry_size > remaining) {
+      folve_rt.inodes.Forget(entry.ino, 1);  // Didn't make it in.
+    }
+  } else {
+    entry_size = fuse_add_direntry(req_, buffer_ + used_, remaining,
+                                   name, st, next_offset);
+  }
+  if (entry_size > remaining) {
+    rlog.Log("DONE (%s)\n", name);
+    return false;
+  }
+  used_ += entry_size;
+  return true;
+}
+
+// readdir(). Just forward to original filesystem. For readdirplus, we hand
+// out full attributes right away, so that the kernel doesn't have to ask
+// for each entry separately.
+//
+// Offsets are positions in the listing, starting after our own entries in
+// the root directory. If we read incrementally, they are the positions
+// in the underlying directory stream.
+static void ReadDirectory(fuse_req_t req, size_t size, off_t offset,
+                          struct fuse_file_info *fi, bool readdir_plus) {
+  OpenDirectory *dir = reinterpret_cast<OpenDirectory *>(fi->fh);
+  DirectoryReply reply(req, dir->path, size, readdir_plus);
+  rlog.Log("LIST %s @%lld%s\n", dir->path.c_str(), (long long) offset,
+           readdir_plus ? " (plus)" : "");
+  struct stat st;
+  off_t position = 0;
+  if (dir->path == "/") {
+    // The status file changes all the time; let the kernel ask for it.
+    if (position >= offset) {
+      memset(&st, 0, sizeof(st));
+      st.st_mode = S_IFREG;
+      if (!reply.Add(kStatusFileName + 1, &st, position + 1, false)) {
+        reply.Send();
+        return;
+      }
+    }
+    ++position;
 
     // If configured, toplevel directories represent the filter names
     if (folve_rt.fs->toplevel_directory_is_filter()) {
       typedef std::set<std::string> dirset_t;
       const dirset_t &dirs = folve_rt.fs->GetAvailableConfigDirs();
-      for (dirset_t::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+      for (dirset_t::const_iterator it = dirs.begin(); it != dirs.end();
+           ++it, ++position) {
+        if (position < offset) continue;
         // Use underscore for the passthrough-path
         const char *pathname = it->empty() ? "_" : it->c_str();
         memset(&st, 0, sizeof(st));
-        filler(buf, pathname, &st, 0, FUSE_FILL_DIR_PLUS);
+        st.st_mode = S_IFDIR;
+        if (!reply.Add(pathname, &st, position + 1, true))
+          break;
       }
-      return 0;
+      reply.Send();
+      return;
     }
   }
 
-  DIR *dp;
-  dp = opendir(folve_rt.fs->GetUnderlyingFile(path).c_str());
-  if (dp == NULL)
-    return -errno;
-
-  rlog.Log("LIST %s\n", path);
-  struct dirent *de;
-  while ((de = readdir(dp)) != NULL) {
-    struct stat st;
-    memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
-    const char *entry_name = de->d_name;
-    rlog.Log("ITEM %s%s%s\n", path, strlen(path) > 1 ? "/" : "", de->d_name);
-    if (filler(buf, entry_name, &st, 0, FUSE_FILL_DIR_PLUS)) {
-      rlog.Log("DONE (%s)\n", de->d_name);
-      break;
+  if (dir->listing != NULL) {
+    typedef std::vector<DirectoryCache::Entry> EntryList;
+    const EntryList &entries = dir->listing->entries();
+    for (size_t i = (offset > position) ? offset - position : 0;
+         i < entries.size(); ++i) {
+      memset(&st, 0, sizeof(st));
+      st.st_ino = entries[i].inode;
+      st.st_mode = entries[i].type << 12;
+      if (!reply.Add(entries[i].name.c_str(), &st, position + i + 1, true))
+        break;
+    }
+  } else if (dir->stream != NULL) {
+    if (offset == 0) {
+      rewinddir(dir->stream);
+    } else {
+      seekdir(dir->stream, offset);
+    }
+    struct dirent *dent;
+    while ((dent = readdir(dir->stream)) != NULL) {
+      memset(&st, 0, sizeof(st));
+      st.st_ino = dent->d_ino;
+      st.st_mode = dent->d_type << 12;
+      if (!reply.Add(dent->d_name, &st, telldir(dir->stream), true))
+        break;
     }
   }
 
-  rlog.Log("DONE %s\n", path).Flush();
-  closedir(dp);
-  return 0;
+  rlog.Log("DONE %s\n", dir->path.c_str()).Flush();
+  reply.Send();
 }
 
-// readlink(): forward to original filesystem.
-static int folve_readlink(const char *path, char *buf, size_t size) {
-  const int result = readlink(folve_rt.fs->GetUnderlyingFile(path).c_str(),
-                              buf, size - 1);
-  if (result == -1)
-    return -errno;
+static void folve_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t offset, struct fuse_file_info *fi) {
+  ReadDirectory(req, size, offset, fi, false);
+}
+
+static void folve_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t offset, struct fuse_file_info *fi) {
+  ReadDirectory(req, size, offset, fi, true);
+}
 
+// readlink(): forward to original filesystem.
+static void folve_readlink(fuse_req_t req, fuse_ino_t ino) {
+  std::string path;
+  if (!folve_rt.inodes.GetPath(ino, &path)) {
+    fuse_reply_err(req, ESTALE);
+    return;
+  }
+  char buf[PATH_MAX + 1];
+  const std::string underlying = folve_rt.fs->GetUnderlyingFile(path.c_str());
+  const int result = readlink(underlying.c_str(), buf, sizeof(buf) - 1);
+  if (result == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
   buf[result] = '\0';
-  return 0;
+  fuse_reply_readlink(req, buf);
 }
 
-static int folve_open(const char *path, struct fuse_file_info *fi) {
-  if (strcmp(path, kStatusFileName) == 0) {
+static void CloseFile(fuse_req_t req, const std::string &path,
+                      struct fuse_file_info *fi) {
+  if (path == kStatusFileName) {
+    delete reinterpret_cast<FileHandler *>(fi->fh);
+  } else {
+    FileHandler *handler = reinterpret_cast<FileHandler *>(fi->fh);
+    passthrough_registry.Release(req, handler);
+    folve_rt.fs->Close(path.c_str(), handler);
+  }
+}
+
+// Threads we already know the process of; see RequestingProcess().
+static folve::Mutex thread_process_mutex;
+static std::map<pid_t, int> thread_process;
+static const size_t kMaxKnownThreads = 1024;
+
+// FUSE tells us the thread a request comes from; we'd like to know the
+// process, as players might open files from different threads. Finding
+// that out means parsing a file in /proc, so we remember it.
+static int RequestingProcess(fuse_req_t req) {
+  const pid_t thread_id = fuse_req_ctx(req)->pid;
+  {
+    folve::MutexLock l(&thread_process_mutex);
+    std::map<pid_t, int>::const_iterator found
+      = thread_process.find(thread_id);
+    if (found != thread_process.end()) return found->second;
+  }
+  char status_file[64];
+  snprintf(status_file, sizeof(status_file), "/proc/%d/status", thread_id);
+  FILE *status = fopen(status_file, "r");
+  if (status == NULL) return thread_id;
+  int process_id = thread_id;
+  char line[256];
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "Tgid: %d", &process_id) == 1)
+      break;
+  }
+  fclose(status);
+  folve::MutexLock l(&thread_process_mutex);
+  if (thread_process.size() >= kMaxKnownThreads) {
+    thread_process.clear();  // Also forgets thread ids reused meanwhile.
+  }
+  thread_process[thread_id] = process_id;
+  return process_id;
+}
+
+static void folve_open(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  std::string path;
+  if (!folve_rt.inodes.GetPath(ino, &path)) {
+    fuse_reply_err(req, ESTALE);
+    return;
+  }
+  if (path == kStatusFileName) {
     fi->fh = (uint64_t) folve_rt.status_server->CreateStatusFileHandler();
-    return 0;
+    fi->direct_io = 1;  // Size changes with every open; don't trust attrs.
+  } else {
+    // The file-handle has the neat property to be 64 bit - so we can
+    // actually stuff a pointer to our file handler object in there :)
+    // (Yay, someone was thinking while developing that API).
+    FileHandler *handler = folve_rt.fs->GetOrCreateHandler(path.c_str());
+    if (handler == NULL) {
+      fuse_reply_err(req, errno);
+      return;
+    }
+    fi->fh = (uint64_t) handler;
+    // Learn what is played after what, to pre-buffer the next file. Other
+    // files a player opens meanwhile (e.g. cover art) don't count.
+    if (handler->IsConvolvedAudio()) {
+      folve_rt.fs->play_order()->NoteOpen(RequestingProcess(req), path,
+                                          folve::CurrentTime());
+    }
+
+    if (handler->IsContentStable()) {
+      // Pass-through or fully converted: regular page-cached reads. The
+      // first time we hand out this content, the kernel has to drop what it
+      // might have cached before (e.g. with a different filter); after that
+      // it can keep it.
+      fi->direct_io = 0;
+      fi->keep_cache = handler->NoteStableOpen() ? 1 : 0;
+    } else {
+      // We want to be allowed to only return part of the requested data in
+      // read(). That way, we can separate reading the ID3-tags from
+      // decoding of the music stream - that way indexing should be fast.
+      // Setting the flag 'direct_io' allows us to return partial results.
+      fi->direct_io = 1;
+    }
+    // If possible, let the kernel read stable content directly from the
+    // original file.
+#ifdef FOLVE_FUSE_PASSTHROUGH
+    fi->backing_id = passthrough_registry.Acquire(req, handler,
+                                                  !fi->direct_io);
+#else
+    passthrough_registry.Acquire(req, handler, false);
+#endif
+  }
+  if (fuse_reply_open(req, fi) != 0) {
+    CloseFile(req, path, fi);  // Interrupted; there won't be a release().
   }
+}
 
-  // We want to be allowed to only return part of the requested data in read().
-  // That way, we can separate reading the ID3-tags from
-  // decoding of the music stream - that way indexing should be fast.
-  // Setting the flag 'direct_io' allows us to return partial results.
-  fi->direct_io = 1;
+// Send result of FileHandler::Read() as reply.
+static void ReplyRead(fuse_req_t req, const char *buf, int result) {
+  if (result < 0) {
+    fuse_reply_err(req, -result);
+  } else {
+    fuse_reply_buf(req, buf, result);
+  }
+}
 
-  // The file-handle has the neat property to be 64 bit - so we can actually
-  // stuff a pointer to our file handler object in there :)
-  // (Yay, someone was thinking while developing that API).
-  FileHandler *handler = folve_rt.fs->GetOrCreateHandler(path, false);
-  fi->fh = (uint64_t) handler;
-  if (handler == NULL)
-    return -errno;
-  return 0;
+// Threads answering reads that have to wait for conversion. The FUSE
+// threads only park these requests here, so a few of them can serve many
+// slow streams and indexers at once. If the reader gives up (the kernel
+// sends an interrupt), we stop converting for it.
+// NOTE: runs forever the whole program lifetime; no way to quit.
+class ReadWorkerPool {
+public:
+  explicit ReadWorkerPool(int threads);
+
+  void Submit(fuse_req_t req, FileHandler *handler, size_t size, off_t offset);
+
+private:
+  class Worker : public folve::Thread {
+  public:
+    // Someone is waiting for these reads; not a background thread.
+    explicit Worker(ReadWorkerPool *pool) : Thread(false), pool_(pool) {}
+    virtual void Run() { pool_->Work(); }
+  private:
+    ReadWorkerPool *const pool_;
+  };
+
+  struct PendingRead {
+    fuse_req_t req;
+    FileHandler *handler;
+    size_t size;
+    off_t offset;
+    bool interrupted;  // Set by the FUSE interrupt callback.
+  };
+  typedef std::list<PendingRead*> ReadQueue;
+
+  static void Interrupt(fuse_req_t req, void *pending_read);
+  void Work();
+
+  folve::Mutex mutex_;
+  ReadQueue queue_;
+  pthread_cond_t enqueue_event_;
+};
+
+ReadWorkerPool::ReadWorkerPool(int threads) {
+  pthread_cond_init(&enqueue_event_, NULL);
+  for (int i = 0; i < threads; ++i) {
+    (new Worker(this))->Start();
+  }
 }
 
-static int folve_read(const char *path, char *buf, size_t size, off_t offset,
-                      struct fuse_file_info *fi) {
-  return reinterpret_cast<FileHandler *>(fi->fh)->Read(buf, size, offset);
+void ReadWorkerPool::Submit(fuse_req_t req, FileHandler *handler,
+                            size_t size, off_t offset) {
+  PendingRead *read = new PendingRead();
+  read->req = req;
+  read->handler = handler;
+  read->size = size;
+  read->offset = offset;
+  read->interrupted = false;
+  // Called right away if the request already has been interrupted.
+  fuse_req_interrupt_func(req, &ReadWorkerPool::Interrupt, read);
+  folve::MutexLock l(&mutex_);
+  queue_.push_back(read);
+  pthread_cond_signal(&enqueue_event_);
 }
 
-static int folve_release(const char *path, struct fuse_file_info *fi) {
-  if (strcmp(path, kStatusFileName) == 0) {
-    delete reinterpret_cast<FileHandler *>(fi->fh);
+void ReadWorkerPool::Interrupt(fuse_req_t req, void *pending_read) {
+  PendingRead *read = reinterpret_cast<PendingRead *>(pending_read);
+  __atomic_store_n(&read->interrupted, true, __ATOMIC_RELAXED);
+}
+
+void ReadWorkerPool::Work() {
+  for (;;) {
+    PendingRead *read;
+    {
+      folve::MutexLock l(&mutex_);
+      while (queue_.empty()) {
+        mutex_.WaitOn(&enqueue_event_);
+      }
+      read = queue_.front();
+      queue_.pop_front();
+    }
+    char *buf = new char[read->size];
+    int result = -EINTR;
+    if (!__atomic_load_n(&read->interrupted, __ATOMIC_RELAXED)) {
+      result = read->handler->ReadCancellable(buf, read->size, read->offset,
+                                              &read->interrupted);
+    }
+    // Once this returns, the interrupt callback won't touch "read" anymore.
+    fuse_req_interrupt_func(read->req, NULL, NULL);
+    ReplyRead(read->req, buf, result);
+    delete [] buf;
+    delete read;
+  }
+}
+
+static void folve_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+  FileHandler *handler = reinterpret_cast<FileHandler *>(fi->fh);
+  // Data we have is served right away; everything else might take a while.
+  // The kernel keeps the file open (and with that our handler alive) until
+  // all its reads are answered.
+  if (handler->IsReadAvailable(size, offset)) {
+    char *buf = new char[size];
+    ReplyRead(req, buf, handler->Read(buf, size, offset));
+    delete [] buf;
   } else {
-    folve_rt.fs->Close(path, reinterpret_cast<FileHandler *>(fi->fh));
+    folve_rt.read_pool->Submit(req, handler, size, offset);
   }
-  return 0;
+}
+
+static void folve_release(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  std::string path;
+  folve_rt.inodes.GetPath(ino, &path);  // Still referenced while open.
+  CloseFile(req, path, fi);
+  fuse_reply_err(req, 0);
 }
 
 static std::string GetLibraryDependencyVersions() {
@@ -259,7 +841,7 @@ static std::string GetLibraryDependencyVersions() {
   return buffer;
 }
 
-static void *folve_init(struct fuse_conn_info *conn, struct fuse_config *) {
+static void folve_init(void *userdata, struct fuse_conn_info *conn) {
   if (folve_rt.pid_file) {
     FILE *p = fopen(folve_rt.pid_file, "w+");
     if (p) {
@@ -302,6 +884,13 @@ static void *folve_init(struct fuse_conn_info *conn, struct fuse_config *) {
     syslog(LOG_INFO, "Debug logging enabled (-D)");
   }
 
+  // Starts a thread, so needs to happen after we're daemonized.
+  folve_rt.fs->directory_cache()->StartWatching();
+  folve_rt.read_pool
+    = new ReadWorkerPool(folve_rt.max_idle_threads > 0
+                         ? folve_rt.max_idle_threads
+                         : kDefaultReadWorkerThreads);
+
   // Status server is always used - it serves the status as an HTML file.
   folve_rt.status_server = new StatusServer(folve_rt.fs);
   if (folve_rt.status_port > 0) {
@@ -316,8 +905,32 @@ static void *folve_init(struct fuse_conn_info *conn, struct fuse_config *) {
     }
   }
 
+  // Directory listings come with full attributes (readdirplus), so a
+  // player listing an album doesn't need a getattr() round-trip per file.
+  // Always use it, not only if the kernel thinks it is worthwhile.
+  if (conn->capable & FUSE_CAP_READDIRPLUS) {
+    conn->want |= FUSE_CAP_READDIRPLUS;
+    conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+  }
+
+#ifdef FOLVE_FUSE_PASSTHROUGH
+  if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    conn->max_backing_stack_depth = 1;
+    passthrough_registry.set_enabled(true);
+  }
+#endif
+
+  // Each request into our filesystem is a round-trip through the kernel;
+  // make them count.
+  conn->max_readahead = folve_rt.readahead_kib * (1 << 10);
+  conn->max_background = kMaxBackgroundRequests;
+  conn->congestion_threshold = kMaxBackgroundRequests * 3 / 4;
+  folve::DLogf("FUSE connection: max_readahead=%u, max_read=%u, "
+               "max_background=%u",
+               conn->max_readahead, conn->max_read, conn->max_background);
+
   folve_rt.fs->SetupInitialConfig();
-  return NULL;
 }
 
 static void folve_destroy(void *) {
@@ -346,17 +959,33 @@ static int usage(const char *prg) {
          "\t-r <refresh> : Seconds between refresh of status page;\n"
          "\t               Default is %d seconds; switch off with -1.\n"
          "\t-g           : Gapless convolving alphabetically adjacent files.\n"
+         "\t-Q           : Add TPDF dither when writing 16 or 24 bit output.\n"
+         "\t-M <threads> : Convolve independent channels of multichannel\n"
+         "\t               filters on up to this many threads. "
+         "Default: #CPUs.\n"
+         "\t-W <workers> : Convert local WAV/AIFF files in this many segments\n"
+         "\t               in parallel. Default: 1.\n"
          "\t-b <KibiByte>: Predictive pre-buffer by given KiB (%d...%d). "
          "Disable with -1. Default 128.\n"
+         "\t-I <seconds> : Stop pre-buffering files not read for this long.\n"
+         "\t               Disable with -1. Default 60.\n"
          "\t-O <factor>  : Oversize: Multiply orig. file sizes with this. "
          "Default 1.25.\n"
          "\t-P <pid-file>: Write PID to this file.\n"
+         "\t-S <file>    : Remember sizes of converted files in this file,\n"
+         "\t               so that exact sizes can be reported next time.\n"
+         "\t-T <threads> : Max. idle FUSE worker threads; also number of\n"
+         "\t               read worker threads. Default: fuse default; 8.\n"
+         "\t               Use -o clone_fd for a separate /dev/fuse fd per\n"
+         "\t               thread, -s to run single threaded.\n"
+         "\t-A <KibiByte>: Kernel readahead for FUSE requests. Default %d.\n"
          "\t-D           : Moderate volume Folve debug messages to syslog,\n"
          "\t               and some more detailed configuration info in UI\n"
          "\t-f           : Operate in foreground; useful for debugging.\n"
          "\t-d           : High volume FUSE debug log. Implies -f.\n"
          "\t-R <file>    : Debug readdir() & stat() calls. Output to file.\n",
-         folve_rt.refresh_time, kUsefulMinBuf, kUsefulMaxBuf);
+         folve_rt.refresh_time, kUsefulMinBuf, kUsefulMaxBuf,
+         kDefaultReadaheadKiB);
   return 1;
 }
 
@@ -372,6 +1001,13 @@ enum {
   FOLVE_OPT_DEBUG_READDIR,
   FOLVE_OPT_GAPLESS,
   FOLVE_OPT_TOPLEVEL_DIR_FILTER,
+  FOLVE_OPT_MAX_IDLE_THREADS,
+  FOLVE_OPT_READAHEAD,
+  FOLVE_OPT_SIZE_INDEX,
+  FOLVE_OPT_PREBUFFER_IDLE,
+  FOLVE_OPT_DITHER,
+  FOLVE_OPT_CONVOLVER_THREADS,
+  FOLVE_OPT_SEGMENT_WORKERS,
 };
 
 int FolveOptionHandling(void *data, const char *arg, int key,
@@ -449,6 +1085,18 @@ int FolveOptionHandling(void *data, const char *arg, int key,
     return 0;
   }
 
+  case FOLVE_OPT_PREBUFFER_IDLE: {
+    char *end;
+    const double value = strtod(arg + 2, &end);
+    if (*end != '\0') {
+      fprintf(stderr, "-I: Invalid number %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->set_pre_buffer_idle_timeout(value);
+    }
+    return 0;
+  }
+
   case FOLVE_OPT_REFRESH_TIME:
     rt->refresh_time = atoi(arg + 2);  // strip "-r"
     return 0;
@@ -481,16 +1129,80 @@ int FolveOptionHandling(void *data, const char *arg, int key,
     rt->fs->set_gapless_processing(true);
     return 0;
 
+  case FOLVE_OPT_DITHER:
+    rt->fs->set_dither_output(true);
+    return 0;
+
   case FOLVE_OPT_TOPLEVEL_DIR_FILTER:
     rt->fs->set_toplevel_directory_is_filter(true);
     return 0;
+
+  case FOLVE_OPT_SIZE_INDEX: {
+    std::string error;
+    if (!rt->fs->size_index()->Open(arg + 2, &error)) {
+      fprintf(stderr, "-S: %s\n", error.c_str());
+      rt->parameter_error = true;
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_MAX_IDLE_THREADS: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 1) {
+      fprintf(stderr, "-T: Need positive number of threads, got %s\n",
+              arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->max_idle_threads = value;
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_CONVOLVER_THREADS: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 1) {
+      fprintf(stderr, "-M: Need positive number of threads, got %s\n",
+              arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->processor_pool()->set_convolver_threads(value);
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_SEGMENT_WORKERS: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 1) {
+      fprintf(stderr, "-W: Need positive number of workers, got %s\n",
+              arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->set_segment_workers(value);
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_READAHEAD: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 0) {
+      fprintf(stderr, "-A: Invalid readahead KiB %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->readahead_kib = value;
+    }
+    return 0;
+  }
   }
   return 1;
 }
 
 int main(int argc, char *argv[]) {
   const char *progname = argv[0];
-  if (argc < 4) {
+  if (argc < 2) {
     return usage(progname);
   }
 
@@ -508,16 +1220,47 @@ int main(int argc, char *argv[]) {
     FUSE_OPT_KEY("-P ",  FOLVE_OPT_PID_FILE),
     FUSE_OPT_KEY("-g",  FOLVE_OPT_GAPLESS),
     FUSE_OPT_KEY("-t",  FOLVE_OPT_TOPLEVEL_DIR_FILTER),
+    FUSE_OPT_KEY("-T ",  FOLVE_OPT_MAX_IDLE_THREADS),
+    FUSE_OPT_KEY("-A ",  FOLVE_OPT_READAHEAD),
+    FUSE_OPT_KEY("-S ",  FOLVE_OPT_SIZE_INDEX),
+    FUSE_OPT_KEY("-I ",  FOLVE_OPT_PREBUFFER_IDLE),
+    FUSE_OPT_KEY("-Q",  FOLVE_OPT_DITHER),
+    FUSE_OPT_KEY("-M ",  FOLVE_OPT_CONVOLVER_THREADS),
+    FUSE_OPT_KEY("-W ",  FOLVE_OPT_SEGMENT_WORKERS),
     FUSE_OPT_END   // This fails to compile for fuse <= 2.8.1; get >= 2.8.4
   };
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   fuse_opt_parse(&args, &folve_rt, folve_options, FolveOptionHandling);
 
+  // Essentially what fuse_main() does, but we want to be in control of
+  // the multi-threaded loop.
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    return usage(progname);
+  }
+  if (opts.show_help) {
+    usage(progname);
+    printf("\nFUSE options:\n");
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return 0;
+  }
+  if (opts.show_version) {
+    printf("Folve version " FOLVE_VERSION "\n");
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return 0;
+  }
+
   if (folve_rt.parameter_error || !folve_rt.fs->CheckInitialized()) {
     return usage(progname);
   }
 
-  struct fuse_operations folve_operations;
+  struct fuse_lowlevel_ops folve_operations;
   memset(&folve_operations, 0, sizeof(folve_operations));
 
   // Start/stop. Will write to syslog and start auxiliary http service.
@@ -525,7 +1268,13 @@ int main(int argc, char *argv[]) {
   folve_operations.destroy   = folve_destroy;
 
   // Basic operations to make navigation work.
+  folve_operations.lookup    = folve_lookup;
+  folve_operations.forget    = folve_forget;
+  folve_operations.forget_multi = folve_forget_multi;
+  folve_operations.opendir   = folve_opendir;
   folve_operations.readdir   = folve_readdir;
+  folve_operations.readdirplus = folve_readdirplus;
+  folve_operations.releasedir = folve_releasedir;
   folve_operations.readlink  = folve_readlink;
 
   // open() and close() file.
@@ -536,5 +1285,44 @@ int main(int argc, char *argv[]) {
   folve_operations.read      = folve_read;
   folve_operations.getattr   = folve_getattr;
 
-  return fuse_main(args.argc, args.argv, &folve_operations, NULL);
+  if (opts.mountpoint == NULL) {
+    fprintf(stderr, "Missing mount point.\n");
+    return usage(progname);
+  }
+
+  int result = 1;
+  struct fuse_session *se = fuse_session_new(&args, &folve_operations,
+                                             sizeof(folve_operations), NULL);
+  if (se == NULL)
+    goto out_free;
+  folve_rt.session = se;
+  if (fuse_set_signal_handlers(se) != 0)
+    goto out_destroy;
+  if (fuse_session_mount(se, opts.mountpoint) != 0)
+    goto out_remove_handlers;
+  if (fuse_daemonize(opts.foreground) != 0)
+    goto out_unmount;
+
+  if (opts.singlethread) {
+    result = fuse_session_loop(se);
+  } else {
+    struct fuse_loop_config loop_config;
+    loop_config.clone_fd = opts.clone_fd;
+    loop_config.max_idle_threads = (folve_rt.max_idle_threads > 0)
+      ? folve_rt.max_idle_threads
+      : opts.max_idle_threads;
+    result = fuse_session_loop_mt(se, &loop_config);
+  }
+  result = (result != 0) ? 1 : 0;
+
+ out_unmount:
+  fuse_session_unmount(se);
+ out_remove_handlers:
+  fuse_remove_signal_handlers(se);
+ out_destroy:
+  fuse_session_destroy(se);
+ out_free:
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return result;
 }
@@ -0,0 +1,97 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "gain-delay.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+void GainDelayRoutes::AddTap(int input, int output, float gain, int delay) {
+  Tap tap;
+  tap.input = input;
+  tap.output = output;
+  tap.gain = gain;
+  tap.delay = delay;
+  taps_.push_back(tap);
+  if (delay > max_delay_) max_delay_ = delay;
+  if ((int) history_.size() <= input) history_.resize(input + 1);
+}
+
+void GainDelayRoutes::Copy(int input, int output,
+                           int from_input, int from_output) {
+  const size_t count = taps_.size();
+  for (size_t i = 0; i < count; ++i) {
+    if (taps_[i].input == from_input && taps_[i].output == from_output) {
+      AddTap(input, output, taps_[i].gain, taps_[i].delay);
+    }
+  }
+}
+
+void GainDelayRoutes::MarkConvolved(int input, int output) {
+  convolved_.insert(std::make_pair(input, output));
+}
+
+bool GainDelayRoutes::IsConvolved(int input, int output) const {
+  return convolved_.count(std::make_pair(input, output)) > 0;
+}
+
+bool GainDelayRoutes::IsIdentity(int channels) const {
+  if ((int) taps_.size() != channels) return false;
+  std::set<int> seen;
+  for (size_t i = 0; i < taps_.size(); ++i) {
+    const Tap &tap = taps_[i];
+    if (tap.input != tap.output || tap.gain != 1.0f || tap.delay != 0)
+      return false;
+    seen.insert(tap.input);
+  }
+  return (int) seen.size() == channels;
+}
+
+void GainDelayRoutes::Process(const float *const *inputs,
+                              float *const *outputs, int frames) {
+  for (size_t t = 0; t < taps_.size(); ++t) {
+    std::vector<float> &samples = history_[taps_[t].input];
+    if ((int) samples.size() != max_delay_ + frames) {
+      samples.resize(max_delay_ + frames, 0.0f);
+    }
+  }
+  for (size_t i = 0; i < history_.size(); ++i) {
+    if (history_[i].empty()) continue;
+    memcpy(&history_[i][max_delay_], inputs[i], frames * sizeof(float));
+  }
+  for (size_t t = 0; t < taps_.size(); ++t) {
+    const Tap &tap = taps_[t];
+    const float *in = &history_[tap.input][max_delay_ - tap.delay];
+    float *out = outputs[tap.output];
+    for (int n = 0; n < frames; ++n) {
+      out[n] += tap.gain * in[n];
+    }
+  }
+  for (size_t i = 0; i < history_.size(); ++i) {
+    if (history_[i].empty() || max_delay_ == 0) continue;
+    memmove(&history_[i][0], &history_[i][frames],
+            max_delay_ * sizeof(float));
+  }
+}
+
+void GainDelayRoutes::Reset() {
+  for (size_t i = 0; i < history_.size(); ++i) {
+    std::fill(history_[i].begin(), history_[i].end(), 0.0f);
+  }
+}
@@ -0,0 +1,84 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_GAIN_DELAY_H
+#define FOLVE_GAIN_DELAY_H
+
+#include <utility>
+#include <set>
+#include <vector>
+
+// Routes from inputs to outputs that are only a gain and a delay, as
+// configured with /impulse/dirac. These don't need a convolver; if there is
+// convolution between the same input and output as well, the results are
+// simply added.
+//
+// While reading the configuration, this also keeps track of which
+// input/output pairs go through the convolver, as copies of these need to
+// be done by the convolver as well.
+class GainDelayRoutes {
+public:
+  struct Tap {
+    int input;
+    int output;
+    float gain;
+    int delay;
+  };
+
+  GainDelayRoutes() : max_delay_(0) {}
+
+  // -- Setup while reading the configuration. Inputs and outputs are 0-based.
+
+  // Add a dirac between input and output.
+  void AddTap(int input, int output, float gain, int delay);
+
+  // Use the same taps for "input" -> "output" as "from_input" ->
+  // "from_output" currently has.
+  void Copy(int input, int output, int from_input, int from_output);
+
+  // Remember that this pair goes through the convolver.
+  void MarkConvolved(int input, int output);
+  bool IsConvolved(int input, int output) const;
+
+  bool empty() const { return taps_.empty(); }
+  int size() const { return taps_.size(); }
+  int max_delay() const { return max_delay_; }
+
+  // Returns true if the routes connect each of the "channels" inputs to
+  // the same output without any change.
+  bool IsIdentity(int channels) const;
+
+  // -- Processing.
+
+  // Apply routes to "frames" samples of the inputs and add the result to
+  // the outputs.
+  void Process(const float *const *inputs, float *const *outputs,
+               int frames);
+
+  // Forget previous input.
+  void Reset();
+
+private:
+  std::vector<Tap> taps_;
+  std::set<std::pair<int, int> > convolved_;
+  int max_delay_;
+  // Per input: the last max_delay_ samples, followed by the current block.
+  std::vector<std::vector<float> > history_;
+};
+
+#endif  // FOLVE_GAIN_DELAY_H
@@ -0,0 +1,97 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "gapless-lead-in.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "input-decoder.h"
+#include "sound-processor.h"
+#include "util.h"
+
+// Hands out the lead-in, preceded by "silence" frames of zeros.
+class GaplessLeadIn::Decoder : public InputDecoder {
+public:
+  Decoder(const GaplessLeadIn *lead_in, int silence)
+    : lead_in_(lead_in), pos_(-silence) {}
+
+  virtual int Decode(float *const *channels, int offset, int frames) {
+    frames = std::min(frames, lead_in_->frames_ - pos_);
+    const int channel_count = lead_in_->channels_;
+    for (int i = 0; i < frames; ++i, ++pos_) {
+      const float *frame = (pos_ < 0)
+        ? NULL : &lead_in_->interleaved_[pos_ * channel_count];
+      for (int ch = 0; ch < channel_count; ++ch) {
+        channels[ch][offset + i] = frame ? frame[ch] : 0.0f;
+      }
+    }
+    return frames;
+  }
+
+private:
+  const GaplessLeadIn *const lead_in_;
+  int pos_;
+};
+
+GaplessLeadIn *GaplessLeadIn::Create(const std::string &previous_file,
+                                     const SF_INFO &info, int frames) {
+  SF_INFO previous_info;
+  memset(&previous_info, 0, sizeof(previous_info));
+  SNDFILE *snd = sf_open(previous_file.c_str(), SFM_READ, &previous_info);
+  if (snd == NULL) return NULL;
+  if (previous_info.samplerate != info.samplerate
+      || previous_info.channels != info.channels
+      || ((previous_info.format & SF_FORMAT_SUBMASK)
+          != (info.format & SF_FORMAT_SUBMASK))) {
+    folve::DLogf("Gapless: %s has a different sample format; not joining.",
+                 previous_file.c_str());
+    sf_close(snd);
+    return NULL;
+  }
+  frames = std::min((sf_count_t) frames, previous_info.frames);
+  if (frames < previous_info.frames
+      && sf_seek(snd, previous_info.frames - frames, SEEK_SET) < 0) {
+    sf_close(snd);
+    return NULL;
+  }
+  GaplessLeadIn *result = new GaplessLeadIn(info.channels);
+  result->interleaved_.resize(frames * info.channels);
+  if (frames > 0) {
+    result->frames_ = sf_readf_float(snd, &result->interleaved_[0], frames);
+  }
+  sf_close(snd);
+  if (result->frames_ != frames) {
+    delete result;   // Truncated file.
+    return NULL;
+  }
+  return result;
+}
+
+void GaplessLeadIn::Prime(SoundProcessor *processor) const {
+  processor->Reset();
+  // Start with a bit of silence, so that we end at a fragment boundary.
+  const int fragment = processor->fragment_size();
+  Decoder decoder(this, (fragment - frames_ % fragment) % fragment);
+  int r;
+  while ((r = processor->FillBuffer(&decoder)) > 0) {
+    processor->ReadProcessed(r);
+  }
+  processor->ResetMaxValues();  // That output belongs to the previous file.
+}
@@ -0,0 +1,56 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_GAPLESS_LEAD_IN_H
+#define FOLVE_GAPLESS_LEAD_IN_H
+
+#include <string>
+#include <vector>
+
+#include <sndfile.h>
+
+class SoundProcessor;
+
+// The end of the previous file, as far as the filter still remembers it.
+// A processor that sees this before the beginning of a file converts it
+// exactly like the continuation of the previous one; so files are joined
+// gapless no matter in which order, or in parallel, they are converted.
+class GaplessLeadIn {
+public:
+  // Read the last "frames" frames of "previous_file". Returns NULL if it
+  // can't be read or is not of the same sample format as "info".
+  static GaplessLeadIn *Create(const std::string &previous_file,
+                               const SF_INFO &info, int frames);
+
+  // Reset "processor" and let it see the lead-in; it then continues with
+  // the first frame of the file.
+  void Prime(SoundProcessor *processor) const;
+
+  int frames() const { return frames_; }
+
+private:
+  class Decoder;
+
+  explicit GaplessLeadIn(int channels) : channels_(channels), frames_(0) {}
+
+  const int channels_;
+  int frames_;
+  std::vector<float> interleaved_;
+};
+
+#endif  // FOLVE_GAPLESS_LEAD_IN_H
@@ -0,0 +1,174 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "iir-filter.h"
+
+#include <math.h>
+#include <string.h>
+
+static const struct {
+  const char *name;
+  IirFilter::Type type;
+} kTypeNames[] = {
+  { "lowpass",   IirFilter::LOWPASS },
+  { "highpass",  IirFilter::HIGHPASS },
+  { "bandpass",  IirFilter::BANDPASS },
+  { "notch",     IirFilter::NOTCH },
+  { "allpass",   IirFilter::ALLPASS },
+  { "peak",      IirFilter::PEAK },
+  { "lowshelf",  IirFilter::LOWSHELF },
+  { "highshelf", IirFilter::HIGHSHELF },
+};
+
+bool IirFilter::ParseType(const char *name, Type *type) {
+  for (size_t i = 0; i < sizeof(kTypeNames) / sizeof(kTypeNames[0]); ++i) {
+    if (strcmp(name, kTypeNames[i].name) == 0) {
+      *type = kTypeNames[i].type;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IirFilter::AddBiquad(int input, int output, Type type, double samplerate,
+                          double frequency, double q, double gain_db) {
+  if (frequency <= 0 || frequency >= samplerate / 2 || q <= 0)
+    return false;
+  const double w0 = 2 * M_PI * frequency / samplerate;
+  const double cos_w0 = cos(w0);
+  const double alpha = sin(w0) / (2 * q);
+  const double A = pow(10, gain_db / 40);   // For peak and shelf.
+  const double shelf_alpha = 2 * sqrt(A) * alpha;
+  double section_gain = A * A;              // For the other types.
+  double b0, b1, b2, a0, a1, a2;
+  switch (type) {
+  case LOWPASS:
+    b0 = (1 - cos_w0) / 2; b1 = 1 - cos_w0; b2 = (1 - cos_w0) / 2;
+    a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+    break;
+  case HIGHPASS:
+    b0 = (1 + cos_w0) / 2; b1 = -(1 + cos_w0); b2 = (1 + cos_w0) / 2;
+    a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+    break;
+  case BANDPASS:
+    b0 = alpha; b1 = 0; b2 = -alpha;
+    a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+    break;
+  case NOTCH:
+    b0 = 1; b1 = -2 * cos_w0; b2 = 1;
+    a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+    break;
+  case ALLPASS:
+    b0 = 1 - alpha; b1 = -2 * cos_w0; b2 = 1 + alpha;
+    a0 = 1 + alpha; a1 = -2 * cos_w0; a2 = 1 - alpha;
+    break;
+  case PEAK:
+    section_gain = 1;
+    b0 = 1 + alpha * A; b1 = -2 * cos_w0; b2 = 1 - alpha * A;
+    a0 = 1 + alpha / A; a1 = -2 * cos_w0; a2 = 1 - alpha / A;
+    break;
+  case LOWSHELF:
+    section_gain = 1;
+    b0 = A * ((A + 1) - (A - 1) * cos_w0 + shelf_alpha);
+    b1 = 2 * A * ((A - 1) - (A + 1) * cos_w0);
+    b2 = A * ((A + 1) - (A - 1) * cos_w0 - shelf_alpha);
+    a0 = (A + 1) + (A - 1) * cos_w0 + shelf_alpha;
+    a1 = -2 * ((A - 1) + (A + 1) * cos_w0);
+    a2 = (A + 1) + (A - 1) * cos_w0 - shelf_alpha;
+    break;
+  case HIGHSHELF:
+    section_gain = 1;
+    b0 = A * ((A + 1) + (A - 1) * cos_w0 + shelf_alpha);
+    b1 = -2 * A * ((A - 1) + (A + 1) * cos_w0);
+    b2 = A * ((A + 1) + (A - 1) * cos_w0 - shelf_alpha);
+    a0 = (A + 1) - (A - 1) * cos_w0 + shelf_alpha;
+    a1 = 2 * ((A - 1) - (A + 1) * cos_w0);
+    a2 = (A + 1) - (A - 1) * cos_w0 - shelf_alpha;
+    break;
+  default:
+    return false;
+  }
+  Biquad biquad;
+  biquad.b0 = section_gain * b0 / a0;
+  biquad.b1 = section_gain * b1 / a0;
+  biquad.b2 = section_gain * b2 / a0;
+  biquad.a1 = a1 / a0;
+  biquad.a2 = a2 / a0;
+  biquad.z1 = biquad.z2 = 0;
+
+  for (size_t i = 0; i < chains_.size(); ++i) {
+    if (chains_[i].input == input && chains_[i].output == output) {
+      chains_[i].sections.push_back(biquad);
+      return true;
+    }
+  }
+  Chain chain;
+  chain.input = input;
+  chain.output = output;
+  chain.sections.push_back(biquad);
+  chains_.push_back(chain);
+  return true;
+}
+
+// The recursion can't be vectorized over time; instead, each section runs
+// over the whole block, which keeps its coefficients and state in
+// registers.
+void IirFilter::Process(const float *const *inputs, float *const *outputs,
+                        int frames) {
+  if ((int) scratch_.size() < frames) scratch_.resize(frames);
+  float *const buffer = &scratch_[0];
+  for (size_t c = 0; c < chains_.size(); ++c) {
+    Chain &chain = chains_[c];
+    memcpy(buffer, inputs[chain.input], frames * sizeof(float));
+    for (size_t s = 0; s < chain.sections.size(); ++s) {
+      Biquad &bq = chain.sections[s];
+      const double b0 = bq.b0, b1 = bq.b1, b2 = bq.b2, a1 = bq.a1, a2 = bq.a2;
+      double z1 = bq.z1, z2 = bq.z2;
+      for (int i = 0; i < frames; ++i) {
+        const double in = buffer[i];
+        const double out = b0 * in + z1;
+        z1 = b1 * in - a1 * out + z2;
+        z2 = b2 * in - a2 * out;
+        buffer[i] = out;
+      }
+      // Let decaying state become zero instead of slow denormals.
+      bq.z1 = fabs(z1) < 1e-30 ? 0 : z1;
+      bq.z2 = fabs(z2) < 1e-30 ? 0 : z2;
+    }
+    float *out = outputs[chain.output];
+    for (int i = 0; i < frames; ++i) {
+      out[i] += buffer[i];
+    }
+  }
+}
+
+int IirFilter::sections() const {
+  int result = 0;
+  for (size_t c = 0; c < chains_.size(); ++c) {
+    result += chains_[c].sections.size();
+  }
+  return result;
+}
+
+void IirFilter::Reset() {
+  for (size_t c = 0; c < chains_.size(); ++c) {
+    for (size_t s = 0; s < chains_[c].sections.size(); ++s) {
+      chains_[c].sections[s].z1 = chains_[c].sections[s].z2 = 0;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_IIR_FILTER_H
+#define FOLVE_IIR_FILTER_H
+
+#include <vector>
+
+// Cascades of biquad filters between inputs and outputs. For simple tone
+// shaping, a handful of biquads is much cheaper than convolving with the
+// equivalent impulse response.
+//
+// All biquads configured for the same input/output pair are applied one
+// after another; the results of all pairs are added to the outputs.
+class IirFilter {
+public:
+  // Filter types and coefficients as in Robert Bristow-Johnson's
+  // "Cookbook formulae for audio EQ biquad filter coefficients".
+  enum Type {
+    LOWPASS,
+    HIGHPASS,
+    BANDPASS,
+    NOTCH,
+    ALLPASS,
+    PEAK,
+    LOWSHELF,
+    HIGHSHELF
+  };
+
+  IirFilter() {}
+
+  // Parse type name as used in the configuration ("lowpass", "peak", ...).
+  // Returns false if unknown.
+  static bool ParseType(const char *name, Type *type);
+
+  // Add a biquad between 0-based "input" and "output". "gain_db" is the
+  // gain of peak and shelf filters; for the other types it is applied
+  // to the whole section. Returns false if parameters are out of range.
+  bool AddBiquad(int input, int output, Type type, double samplerate,
+                 double frequency, double q, double gain_db);
+
+  // Filter "frames" samples of the inputs and add the result to the
+  // outputs.
+  void Process(const float *const *inputs, float *const *outputs,
+               int frames);
+
+  // Clear filter state.
+  void Reset();
+
+  // Number of biquads.
+  int sections() const;
+
+private:
+  // A section in transposed direct form II.
+  struct Biquad {
+    double b0, b1, b2, a1, a2;
+    double z1, z2;
+  };
+  struct Chain {
+    int input;
+    int output;
+    std::vector<Biquad> sections;
+  };
+
+  std::vector<Chain> chains_;
+  std::vector<float> scratch_;
+};
+
+#endif  // FOLVE_IIR_FILTER_H
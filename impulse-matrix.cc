@@ -0,0 +1,55 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "impulse-matrix.h"
+
+#include <stddef.h>
+
+ImpulseMatrix::ImpulseMatrix(int inputs, int outputs)
+  : inputs_(inputs), outputs_(outputs),
+    source_(inputs * outputs), impulse_(inputs * outputs) {
+  for (size_t i = 0; i < source_.size(); ++i) source_[i] = i;
+}
+
+void ImpulseMatrix::AddImpulse(int input, int output, int step,
+                               const float *data, int start, int end) {
+  std::vector<float> &impulse = impulse_[source_[Index(input, output)]];
+  if ((int) impulse.size() < end) impulse.resize(end, 0.0f);
+  for (int i = start; i < end; ++i, data += step) {
+    impulse[i] += *data;
+  }
+}
+
+void ImpulseMatrix::CopyImpulse(int input, int output,
+                                int from_input, int from_output) {
+  source_[Index(input, output)] = source_[Index(from_input, from_output)];
+}
+
+const std::vector<float> *ImpulseMatrix::Impulse(int input, int output) const {
+  const std::vector<float> &impulse = impulse_[source_[Index(input, output)]];
+  return impulse.empty() ? NULL : &impulse;
+}
+
+bool ImpulseMatrix::IsOriginal(int input, int output,
+                               int *from_input, int *from_output) const {
+  const int source = source_[Index(input, output)];
+  if (source == Index(input, output)) return true;
+  *from_input = source / outputs_;
+  *from_output = source % outputs_;
+  return false;
+}
@@ -0,0 +1,56 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_IMPULSE_MATRIX_H
+#define FOLVE_IMPULSE_MATRIX_H
+
+#include <vector>
+
+// Impulses between inputs and outputs, as given to the convolver. Convproc
+// doesn't let us look at them anymore, so this keeps them while reading the
+// configuration, to set up the convolution differently afterwards.
+class ImpulseMatrix {
+public:
+  ImpulseMatrix(int inputs, int outputs);
+
+  // Same semantics as DirectFir::AddImpulse() and DirectFir::CopyImpulse().
+  void AddImpulse(int input, int output, int step, const float *data,
+                  int start, int end);
+  void CopyImpulse(int input, int output, int from_input, int from_output);
+
+  int inputs() const { return inputs_; }
+  int outputs() const { return outputs_; }
+
+  // Impulse between "input" and "output". NULL if there is none.
+  const std::vector<float> *Impulse(int input, int output) const;
+
+  // Returns false and "from_input", "from_output" of the original if this
+  // pair is a copy. True if it has its own impulse or none.
+  bool IsOriginal(int input, int output,
+                  int *from_input, int *from_output) const;
+
+private:
+  int Index(int input, int output) const { return input * outputs_ + output; }
+
+  const int inputs_;
+  const int outputs_;
+  std::vector<int> source_;   // Index of pair with impulse; differs if copy.
+  std::vector<std::vector<float> > impulse_;
+};
+
+#endif  // FOLVE_IMPULSE_MATRIX_H
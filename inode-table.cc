@@ -0,0 +1,70 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "inode-table.h"
+
+InodeTable::InodeTable() : next_inode_(kRootInode + 1) {
+  Node root;
+  root.path = "/";
+  root.references = 1;  // Never forgotten.
+  inodes_[kRootInode] = root;
+  paths_[root.path] = kRootInode;
+}
+
+uint64_t InodeTable::Acquire(const std::string &path) {
+  folve::MutexLock l(&mutex_);
+  PathMap::iterator found = paths_.find(path);
+  if (found != paths_.end()) {
+    ++inodes_[found->second].references;
+    return found->second;
+  }
+  const uint64_t inode = next_inode_++;
+  Node node;
+  node.path = path;
+  node.references = 1;
+  inodes_[inode] = node;
+  paths_[path] = inode;
+  return inode;
+}
+
+uint64_t InodeTable::Find(const std::string &path) {
+  folve::MutexLock l(&mutex_);
+  PathMap::const_iterator found = paths_.find(path);
+  return (found == paths_.end()) ? 0 : found->second;
+}
+
+void InodeTable::Forget(uint64_t inode, uint64_t count) {
+  if (inode == kRootInode) return;
+  folve::MutexLock l(&mutex_);
+  InodeMap::iterator found = inodes_.find(inode);
+  if (found == inodes_.end()) return;
+  if (found->second.references > count) {
+    found->second.references -= count;
+    return;
+  }
+  paths_.erase(found->second.path);
+  inodes_.erase(found);
+}
+
+bool InodeTable::GetPath(uint64_t inode, std::string *path) {
+  folve::MutexLock l(&mutex_);
+  InodeMap::const_iterator found = inodes_.find(inode);
+  if (found == inodes_.end()) return false;
+  *path = found->second.path;
+  return true;
+}
@@ -0,0 +1,70 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_INODE_TABLE_H
+#define FOLVE_INODE_TABLE_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include "util.h"
+
+// Mapping between the inode numbers we hand out to the kernel and the
+// paths in our filesystem.
+//
+// The kernel counts how often it was handed out an inode (for each lookup)
+// and tells us when it forgets about it again; an inode is only valid as
+// long as that count is positive. The root directory is always valid.
+// This class is thread-safe.
+class InodeTable {
+public:
+  static const uint64_t kRootInode = 1;  // Same as FUSE_ROOT_ID.
+
+  InodeTable();
+
+  // Returns the inode for "path", allocating a new one if needed, and
+  // counts one reference the kernel holds.
+  uint64_t Acquire(const std::string &path);
+
+  // Returns the inode for "path" if the kernel currently holds one, 0
+  // otherwise. Doesn't count a reference.
+  uint64_t Find(const std::string &path);
+
+  // The kernel forgets "count" references to the inode.
+  void Forget(uint64_t inode, uint64_t count);
+
+  // Get path of a valid inode. Returns false if the inode is unknown.
+  bool GetPath(uint64_t inode, std::string *path);
+
+private:
+  struct Node {
+    std::string path;
+    uint64_t references;
+  };
+  typedef std::map<uint64_t, Node> InodeMap;
+  typedef std::map<std::string, uint64_t> PathMap;
+
+  folve::Mutex mutex_;
+  InodeMap inodes_;
+  PathMap paths_;
+  uint64_t next_inode_;
+};
+
+#endif  // FOLVE_INODE_TABLE_H
@@ -0,0 +1,47 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "input-decoder.h"
+
+#include <stddef.h>
+
+SndfileDecoder::SndfileDecoder(SNDFILE *snd, int channels)
+  : snd_(snd), channels_(channels), interleaved_(NULL),
+    interleaved_frames_(0) {}
+
+SndfileDecoder::~SndfileDecoder() {
+  delete [] interleaved_;
+}
+
+int SndfileDecoder::Decode(float *const *channels, int offset, int frames) {
+  if (frames > interleaved_frames_) {
+    delete [] interleaved_;
+    interleaved_ = new float[frames * channels_];
+    interleaved_frames_ = frames;
+  }
+  const int r = sf_readf_float(snd_, interleaved_, frames);
+  // Flatten channels: LRLRLRLRLR -> LLLLL and RRRRR
+  for (int ch = 0; ch < channels_; ++ch) {
+    float *dest = channels[ch] + offset;
+    const float *source = interleaved_ + ch;
+    for (int j = 0; j < r; ++j) {
+      dest[j] = source[j * channels_];
+    }
+  }
+  return r;
+}
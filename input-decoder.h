@@ -0,0 +1,52 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_INPUT_DECODER_H
+#define FOLVE_INPUT_DECODER_H
+
+#include <sndfile.h>
+
+// Decodes frames of a sound file into planar float buffers, as the
+// convolver wants them: one buffer per channel.
+class InputDecoder {
+public:
+  virtual ~InputDecoder() {}
+
+  // Decode up to "frames" frames. Channel "c" is written to
+  // channels[c][offset] and following. Returns the number of frames
+  // decoded; 0 at the end of the file.
+  virtual int Decode(float *const *channels, int offset, int frames) = 0;
+};
+
+// Decoder for everything libsndfile can read. Does not take ownership of
+// the SNDFILE.
+class SndfileDecoder : public InputDecoder {
+public:
+  SndfileDecoder(SNDFILE *snd, int channels);
+  virtual ~SndfileDecoder();
+
+  virtual int Decode(float *const *channels, int offset, int frames);
+
+private:
+  SNDFILE *const snd_;
+  const int channels_;
+  float *interleaved_;   // libsndfile gives us interleaved frames.
+  int interleaved_frames_;
+};
+
+#endif  // FOLVE_INPUT_DECODER_H
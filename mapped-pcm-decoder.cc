@@ -0,0 +1,331 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "mapped-pcm-decoder.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+using folve::DLogf;
+
+// Filesystems on which we rather don't map files: page faults would stall
+// the convolver for a network round-trip each; the PrefetchReader does
+// better there.
+static const uint32_t kRemoteFilesystems[] = {
+  0x6969,      // NFS
+  0x517B,      // SMB
+  0xFE534D42,  // SMB2
+  0xFF534D42,  // CIFS
+  0x65735546,  // FUSE
+  0x73757245,  // CODA
+  0x5346414F,  // AFS
+  0x00C36400,  // CEPH
+  0x01021997,  // 9P
+};
+
+static bool IsLocalFilesystem(int filedes) {
+  struct statfs fs_info;
+  if (fstatfs(filedes, &fs_info) != 0) return false;
+  const uint32_t type = fs_info.f_type;
+  for (size_t i = 0; i < sizeof(kRemoteFilesystems) / sizeof(uint32_t); ++i) {
+    if (type == kRemoteFilesystems[i]) return false;
+  }
+  return true;
+}
+
+static inline uint32_t LittleEndian16(const char *p) {
+  const unsigned char *b = (const unsigned char*) p;
+  return b[0] | b[1] << 8;
+}
+static inline uint32_t LittleEndian32(const char *p) {
+  const unsigned char *b = (const unsigned char*) p;
+  return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+static inline uint32_t BigEndian16(const char *p) {
+  const unsigned char *b = (const unsigned char*) p;
+  return b[0] << 8 | b[1];
+}
+static inline uint32_t BigEndian32(const char *p) {
+  const unsigned char *b = (const unsigned char*) p;
+  return (uint32_t) b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+MappedPcmDecoder *MappedPcmDecoder::Create(int filedes) {
+  if (!IsLocalFilesystem(filedes))
+    return NULL;
+  struct stat st;
+  if (fstat(filedes, &st) != 0 || st.st_size < 12)
+    return NULL;
+  const size_t map_size = st.st_size;
+  void *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, filedes, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  madvise(map, map_size, MADV_SEQUENTIAL);
+  MappedPcmDecoder *result = new MappedPcmDecoder(filedes, (const char*) map,
+                                                  map_size);
+  if (!result->ParseWav() && !result->ParseAiff()) {
+    delete result;
+    return NULL;
+  }
+  return result;
+}
+
+MappedPcmDecoder::MappedPcmDecoder(int filedes, const char *map,
+                                   size_t map_size)
+  : filedes_(filedes), map_(map), map_size_(map_size), snd_position_(0),
+    encoding_(PCM_16), big_endian_(false), channels_(0),
+    bytes_per_sample_(0), data_start_(0), frames_(0), next_frame_(0) {
+}
+
+MappedPcmDecoder::~MappedPcmDecoder() {
+  munmap((void*) map_, map_size_);
+}
+
+size_t MappedPcmDecoder::ValidSize() const {
+  struct stat st;
+  if (fstat(filedes_, &st) != 0) return 0;
+  return std::min((size_t) st.st_size, map_size_);
+}
+
+bool MappedPcmDecoder::SetEncoding(int bits, bool is_float) {
+  if (is_float) {
+    encoding_ = FLOAT_32;
+    if (bits != 32) return false;
+  } else {
+    switch (bits) {
+    case 16: encoding_ = PCM_16; break;
+    case 24: encoding_ = PCM_24; break;
+    case 32: encoding_ = PCM_32; break;
+    default: return false;   // e.g. unsigned 8 bit. Leave to libsndfile.
+    }
+  }
+  bytes_per_sample_ = bits / 8;
+  return true;
+}
+
+bool MappedPcmDecoder::ParseWav() {
+  if (memcmp(map_, "RIFF", 4) != 0 || memcmp(map_ + 8, "WAVE", 4) != 0)
+    return false;
+  bool have_format = false;
+  int block_align = 0;
+  size_t pos = 12;
+  while (pos + 8 <= map_size_) {
+    const char *chunk = map_ + pos;
+    const uint32_t len = LittleEndian32(chunk + 4);
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      if (len < 16 || pos + 8 + len > map_size_) return false;
+      uint32_t format = LittleEndian16(chunk + 8);
+      channels_ = LittleEndian16(chunk + 10);
+      block_align = LittleEndian16(chunk + 20);
+      const int bits = LittleEndian16(chunk + 22);
+      if (format == 0xFFFE && len >= 40) {  // WAVE_FORMAT_EXTENSIBLE
+        format = LittleEndian16(chunk + 32);  // Start of sub-format GUID.
+      }
+      if (format != 1 && format != 3) return false;  // Only PCM and float.
+      if (!SetEncoding(bits, format == 3)) return false;
+      have_format = true;
+    }
+    else if (memcmp(chunk, "data", 4) == 0) {
+      if (!have_format || channels_ <= 0
+          || block_align != channels_ * bytes_per_sample_)
+        return false;
+      data_start_ = pos + 8;
+      const size_t data_len = std::min((size_t) len, map_size_ - data_start_);
+      frames_ = data_len / block_align;
+      big_endian_ = false;
+      return true;
+    }
+    pos += 8 + (size_t) len + (len & 1);  // Chunks are padded to even size.
+  }
+  return false;
+}
+
+bool MappedPcmDecoder::ParseAiff() {
+  if (memcmp(map_, "FORM", 4) != 0)
+    return false;
+  const bool is_aifc = (memcmp(map_ + 8, "AIFC", 4) == 0);
+  if (!is_aifc && memcmp(map_ + 8, "AIFF", 4) != 0)
+    return false;
+  bool have_format = false;
+  int64_t comm_frames = 0;
+  size_t pos = 12;
+  while (pos + 8 <= map_size_) {
+    const char *chunk = map_ + pos;
+    const uint32_t len = BigEndian32(chunk + 4);
+    if (memcmp(chunk, "COMM", 4) == 0) {
+      if (len < 18 || pos + 8 + len > map_size_) return false;
+      channels_ = BigEndian16(chunk + 8);
+      comm_frames = BigEndian32(chunk + 10);
+      const int bits = BigEndian16(chunk + 14);
+      bool is_float = false;
+      big_endian_ = true;
+      if (is_aifc) {
+        if (len < 22) return false;
+        const char *compression = chunk + 26;
+        if (memcmp(compression, "sowt", 4) == 0) {
+          big_endian_ = false;
+        } else if (memcmp(compression, "fl32", 4) == 0
+                   || memcmp(compression, "FL32", 4) == 0) {
+          is_float = true;
+        } else if (memcmp(compression, "NONE", 4) != 0
+                   && memcmp(compression, "twos", 4) != 0) {
+          return false;   // Compressed.
+        }
+      }
+      if (!SetEncoding(bits, is_float)) return false;
+      have_format = true;
+    }
+    else if (memcmp(chunk, "SSND", 4) == 0) {
+      if (!have_format || channels_ <= 0 || len < 8) return false;
+      const uint32_t data_offset = BigEndian32(chunk + 8);
+      data_start_ = pos + 16 + data_offset;
+      if (data_offset > len - 8 || data_start_ > map_size_) return false;
+      const size_t data_len = std::min((size_t) len - 8 - data_offset,
+                                       map_size_ - data_start_);
+      const int frame_bytes = channels_ * bytes_per_sample_;
+      frames_ = std::min(comm_frames, (int64_t) (data_len / frame_bytes));
+      return true;
+    }
+    pos += 8 + (size_t) len + (len & 1);
+  }
+  return false;
+}
+
+SNDFILE *MappedPcmDecoder::OpenSoundfile(SF_INFO *info) {
+  SF_VIRTUAL_IO virtual_io;
+  memset(&virtual_io, 0, sizeof(virtual_io));
+  virtual_io.get_filelen = &MappedPcmDecoder::SndGetFileLen;
+  virtual_io.seek = &MappedPcmDecoder::SndSeek;
+  virtual_io.read = &MappedPcmDecoder::SndRead;
+  virtual_io.write = &MappedPcmDecoder::SndWrite;
+  virtual_io.tell = &MappedPcmDecoder::SndTell;
+  SNDFILE *snd = sf_open_virtual(&virtual_io, SFM_READ, info, this);
+  if (snd == NULL)
+    return NULL;
+  int expected_subformat = SF_FORMAT_PCM_16;
+  switch (encoding_) {
+  case PCM_16:   expected_subformat = SF_FORMAT_PCM_16; break;
+  case PCM_24:   expected_subformat = SF_FORMAT_PCM_24; break;
+  case PCM_32:   expected_subformat = SF_FORMAT_PCM_32; break;
+  case FLOAT_32: expected_subformat = SF_FORMAT_FLOAT; break;
+  }
+  if (info->channels != channels_ || info->frames != frames_
+      || (info->format & SF_FORMAT_SUBMASK) != expected_subformat) {
+    DLogf("Mapped decoder: libsndfile disagrees about format; not using it.");
+    sf_close(snd);
+    return NULL;
+  }
+  return snd;
+}
+
+int MappedPcmDecoder::Decode(float *const *channels, int offset, int frames) {
+  const int r = DecodeAt(next_frame_, channels, offset, frames);
+  next_frame_ += r;
+  return r;
+}
+
+int MappedPcmDecoder::DecodeAt(int64_t frame, float *const *channels,
+                               int offset, int frames) const {
+  const int frame_bytes = channels_ * bytes_per_sample_;
+  // Stop where the file ends now; it might have been truncated.
+  const size_t valid_size = ValidSize();
+  const int64_t valid_frames = (valid_size > data_start_
+                                ? (valid_size - data_start_) / frame_bytes
+                                : 0);
+  frames = std::min((int64_t) frames, std::min(frames_, valid_frames) - frame);
+  if (frames <= 0) return 0;
+  const char *const start = map_ + data_start_ + frame * frame_bytes;
+  // Same scaling as libsndfile uses when reading integer data as float.
+  const float int_scale = 1.0f / 0x80000000U;
+  for (int ch = 0; ch < channels_; ++ch) {
+    const char *in = start + ch * bytes_per_sample_;
+    float *out = channels[ch] + offset;
+    switch (encoding_) {
+    case PCM_16:
+      for (int i = 0; i < frames; ++i, in += frame_bytes) {
+        const uint32_t v = big_endian_ ? BigEndian16(in) : LittleEndian16(in);
+        out[i] = (int32_t) (v << 16) * int_scale;
+      }
+      break;
+    case PCM_24:
+      for (int i = 0; i < frames; ++i, in += frame_bytes) {
+        const unsigned char *b = (const unsigned char*) in;
+        const uint32_t v = big_endian_
+          ? ((uint32_t) b[0] << 24 | b[1] << 16 | b[2] << 8)
+          : ((uint32_t) b[2] << 24 | b[1] << 16 | b[0] << 8);
+        out[i] = (int32_t) v * int_scale;
+      }
+      break;
+    case PCM_32:
+      for (int i = 0; i < frames; ++i, in += frame_bytes) {
+        const uint32_t v = big_endian_ ? BigEndian32(in) : LittleEndian32(in);
+        out[i] = (int32_t) v * int_scale;
+      }
+      break;
+    case FLOAT_32:
+      for (int i = 0; i < frames; ++i, in += frame_bytes) {
+        const uint32_t v = big_endian_ ? BigEndian32(in) : LittleEndian32(in);
+        memcpy(&out[i], &v, sizeof(float));
+      }
+      break;
+    }
+  }
+  return frames;
+}
+
+sf_count_t MappedPcmDecoder::SndGetFileLen(void *userdata) {
+  return reinterpret_cast<MappedPcmDecoder*>(userdata)->map_size_;
+}
+
+sf_count_t MappedPcmDecoder::SndSeek(sf_count_t offset, int whence,
+                                     void *userdata) {
+  MappedPcmDecoder *decoder = reinterpret_cast<MappedPcmDecoder*>(userdata);
+  switch (whence) {
+  case SEEK_SET: decoder->snd_position_ = offset; break;
+  case SEEK_CUR: decoder->snd_position_ += offset; break;
+  case SEEK_END: decoder->snd_position_ = decoder->map_size_ + offset; break;
+  }
+  return decoder->snd_position_;
+}
+
+sf_count_t MappedPcmDecoder::SndRead(void *ptr, sf_count_t count,
+                                     void *userdata) {
+  MappedPcmDecoder *decoder = reinterpret_cast<MappedPcmDecoder*>(userdata);
+  const sf_count_t size = decoder->ValidSize();
+  if (decoder->snd_position_ < 0 || decoder->snd_position_ >= size) return 0;
+  count = std::min(count, size - decoder->snd_position_);
+  memcpy(ptr, decoder->map_ + decoder->snd_position_, count);
+  decoder->snd_position_ += count;
+  return count;
+}
+
+sf_count_t MappedPcmDecoder::SndWrite(const void *ptr, sf_count_t count,
+                                      void *userdata) {
+  return 0;  // Read only.
+}
+
+sf_count_t MappedPcmDecoder::SndTell(void *userdata) {
+  return reinterpret_cast<MappedPcmDecoder*>(userdata)->snd_position_;
+}
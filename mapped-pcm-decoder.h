@@ -0,0 +1,101 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_MAPPED_PCM_DECODER_H
+#define FOLVE_MAPPED_PCM_DECODER_H
+
+#include <sndfile.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "input-decoder.h"
+
+// Decoder for uncompressed WAV and AIFF files on local filesystems. The file
+// is memory mapped and samples are converted straight from the mapping into
+// the convolver input, without going through read() and libsndfile's
+// interleaved buffers.
+//
+// libsndfile still reads the header and tags through the mapping, see
+// OpenSoundfile().
+//
+// Accessing a mapping beyond the end of the file raises SIGBUS, so if the
+// file is truncated while we convert it (e.g. by a tag editor), we only
+// read up to its current end, as read() would.
+class MappedPcmDecoder : public InputDecoder {
+public:
+  // Returns a decoder if "filedes" is a plain PCM or float WAV or AIFF file
+  // on a local filesystem; NULL otherwise. Does not take ownership of
+  // "filedes"; it has to stay open for the lifetime of the decoder.
+  static MappedPcmDecoder *Create(int filedes);
+  virtual ~MappedPcmDecoder();
+
+  // Open the file with libsndfile reading from the mapping. NULL on error,
+  // see sf_strerror(NULL). Returns NULL as well if libsndfile sees the file
+  // differently than we do; better to leave it to libsndfile then.
+  // The SNDFILE needs to be closed before this decoder is deleted.
+  SNDFILE *OpenSoundfile(SF_INFO *info);
+
+  virtual int Decode(float *const *channels, int offset, int frames);
+
+  // Like Decode(), but starting at "frame" and independent of the position
+  // of Decode(). Can be called from several threads at once.
+  int DecodeAt(int64_t frame, float *const *channels, int offset,
+               int frames) const;
+
+  // Continue Decode() at "frame".
+  void Seek(int64_t frame) { next_frame_ = frame; }
+
+private:
+  enum Encoding {
+    PCM_16,
+    PCM_24,
+    PCM_32,
+    FLOAT_32
+  };
+
+  MappedPcmDecoder(int filedes, const char *map, size_t map_size);
+
+  // Bytes of the mapping that are backed by the file right now.
+  size_t ValidSize() const;
+
+  // Parse header and set up the fields describing the sample data.
+  bool ParseWav();
+  bool ParseAiff();
+  bool SetEncoding(int bits, bool is_float);
+
+  static sf_count_t SndGetFileLen(void *userdata);
+  static sf_count_t SndSeek(sf_count_t offset, int whence, void *userdata);
+  static sf_count_t SndRead(void *ptr, sf_count_t count, void *userdata);
+  static sf_count_t SndWrite(const void *ptr, sf_count_t count, void *userdata);
+  static sf_count_t SndTell(void *userdata);
+
+  const int filedes_;
+  const char *const map_;
+  const size_t map_size_;
+  sf_count_t snd_position_;  // libsndfile's position in the mapping.
+
+  Encoding encoding_;
+  bool big_endian_;
+  int channels_;
+  int bytes_per_sample_;
+  size_t data_start_;        // Position of first sample in the mapping.
+  int64_t frames_;
+  int64_t next_frame_;       // Next frame to decode.
+};
+
+#endif  // FOLVE_MAPPED_PCM_DECODER_H
@@ -0,0 +1,97 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "mid-side.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "impulse-matrix.h"
+
+// Relative to the peak, differences below this are rounding noise.
+static const float kSymmetryTolerance = 1e-6;
+
+static float Peak(const std::vector<float> &impulse) {
+  float peak = 0;
+  for (size_t i = 0; i < impulse.size(); ++i) {
+    if (fabsf(impulse[i]) > peak) peak = fabsf(impulse[i]);
+  }
+  return peak;
+}
+
+static bool Equal(const std::vector<float> &a, const std::vector<float> &b,
+                  float tolerance) {
+  const size_t length = std::max(a.size(), b.size());
+  for (size_t i = 0; i < length; ++i) {
+    const float x = i < a.size() ? a[i] : 0.0f;
+    const float y = i < b.size() ? b[i] : 0.0f;
+    if (fabsf(x - y) > tolerance) return false;
+  }
+  return true;
+}
+
+static const std::vector<float> &Get(const ImpulseMatrix &matrix,
+                                     int input, int output) {
+  static const std::vector<float> kNone;
+  const std::vector<float> *impulse = matrix.Impulse(input, output);
+  return impulse ? *impulse : kNone;
+}
+
+bool MidSide::GetImpulses(const ImpulseMatrix &matrix,
+                          std::vector<float> *mid, std::vector<float> *side) {
+  if (matrix.inputs() != 2 || matrix.outputs() != 2) return false;
+  const std::vector<float> &direct = Get(matrix, 0, 0);
+  const std::vector<float> &cross = Get(matrix, 0, 1);
+  const float tolerance = kSymmetryTolerance
+    * std::max(Peak(direct), Peak(cross));
+  // Without cross-feed, there is nothing to save.
+  if (Peak(cross) <= tolerance) return false;
+  if (!Equal(direct, Get(matrix, 1, 1), tolerance)
+      || !Equal(cross, Get(matrix, 1, 0), tolerance)) {
+    return false;
+  }
+  const size_t length = std::max(direct.size(), cross.size());
+  mid->assign(length, 0.0f);
+  side->assign(length, 0.0f);
+  for (size_t i = 0; i < length; ++i) {
+    const float d = i < direct.size() ? direct[i] : 0.0f;
+    const float c = i < cross.size() ? cross[i] : 0.0f;
+    (*mid)[i] = d + c;
+    (*side)[i] = d - c;
+  }
+  return true;
+}
+
+void MidSide::ToMidSide(float *left, float *right, int frames) {
+  for (int n = 0; n < frames; ++n) {
+    const float l = left[n];
+    const float r = right[n];
+    left[n] = 0.5f * (l + r);
+    right[n] = 0.5f * (l - r);
+  }
+}
+
+void MidSide::FromMidSide(float *mid, float *side, int frames) {
+  for (int n = 0; n < frames; ++n) {
+    const float m = mid[n];
+    const float s = side[n];
+    mid[n] = m + s;
+    side[n] = m - s;
+  }
+}
@@ -0,0 +1,46 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_MID_SIDE_H
+#define FOLVE_MID_SIDE_H
+
+#include <vector>
+
+class ImpulseMatrix;
+
+// Stereo filters often use mirrored impulses: left -> left is the same as
+// right -> right, left -> right the same as right -> left. With
+//   mid = (left + right) / 2 and side = (left - right) / 2
+// such a matrix needs two convolutions instead of four:
+//   left  = (LL + LR) * mid + (LL - LR) * side
+//   right = (LL + LR) * mid - (LL - LR) * side
+class MidSide {
+public:
+  // If the 2x2 "matrix" is symmetric and has cross-feed, returns true and
+  // the impulses to use for mid and side.
+  static bool GetImpulses(const ImpulseMatrix &matrix,
+                          std::vector<float> *mid, std::vector<float> *side);
+
+  // Transform "frames" samples of left and right to mid and side in place.
+  static void ToMidSide(float *left, float *right, int frames);
+
+  // Transform back, in place.
+  static void FromMidSide(float *mid, float *side, int frames);
+};
+
+#endif  // FOLVE_MID_SIDE_H
@@ -46,6 +46,7 @@ int PassThroughHandler::Read(char *buf, size_t size, off_t offset) {
   if (result < 0)
     return -errno;
   max_accessed_ = std::max<off_t>(max_accessed_, offset + result);
+  PublishStats();
   return result;
 }
 
@@ -56,8 +57,8 @@ int PassThroughHandler::Stat(struct stat *st) {
 void PassThroughHandler::GetHandlerStatus(HandlerStats *stats) {
   *stats = info_stats_;
   if (file_size_ > 0) {
-    max_accessed_ = std::min(max_accessed_, file_size_);
-    stats->access_progress = 1.0 * max_accessed_ / file_size_;
+    const off_t accessed = std::min(max_accessed_, file_size_);
+    stats->access_progress = 1.0 * accessed / file_size_;
     stats->buffer_progress = stats->access_progress;
   }
 }
@@ -32,6 +32,8 @@ public:
   virtual int Read(char *buf, size_t size, off_t offset);
   virtual int Stat(struct stat *st);
   virtual void GetHandlerStatus(HandlerStats *stats);
+  virtual bool IsContentStable() { return true; }
+  virtual int BackingFileDescriptor() { return filedes_; }
 
 private:
   const int filedes_;
@@ -0,0 +1,86 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "pcm-quantizer.h"
+
+#include <stddef.h>
+
+PcmQuantizer *PcmQuantizer::Create(int sf_format, bool dither) {
+  switch (sf_format & SF_FORMAT_SUBMASK) {
+  case SF_FORMAT_PCM_16: return new PcmQuantizer(16, dither);
+  case SF_FORMAT_PCM_24: return new PcmQuantizer(24, dither);
+  default: return NULL;
+  }
+}
+
+PcmQuantizer::PcmQuantizer(int bits, bool dither)
+  : bits_(bits), dither_(dither), buffer_(NULL), buffer_size_(0) {
+  for (int i = 0; i < kRandomLanes; ++i) {
+    random_state_[0][i] = 0x9E3779B9U * (i + 1);
+    random_state_[1][i] = 0x7F4A7C15U * (i + 1);
+  }
+}
+
+PcmQuantizer::~PcmQuantizer() {
+  delete [] buffer_;
+}
+
+void PcmQuantizer::WriteFrames(SNDFILE *out, const float *samples, int frames,
+                               int channels) {
+  const int count = frames * channels;
+  if (count > buffer_size_) {
+    delete [] buffer_;
+    buffer_ = new int32_t[count];
+    buffer_size_ = count;
+  }
+  Quantize(samples, buffer_, count);
+  sf_writef_int(out, buffer_, frames);
+}
+
+// Written in blocks of kRandomLanes with independent linear congruential
+// generators for dither, so that -O3 vectorizes the inner loops.
+void PcmQuantizer::Quantize(const float *in, int32_t *out, int count) {
+  // Same scale as libsndfile uses reading integers as float, so that
+  // unprocessed samples come out as they went in.
+  const float scale = 1 << (bits_ - 1);
+  const float max_value = scale - 1;
+  const int shift = 32 - bits_;
+  const float lsb_per_random = 1.0f / 4294967296.0f;  // 2^32 -> 1 LSB.
+  float dither[kRandomLanes];
+  for (int i = 0; i < count; i += kRandomLanes) {
+    const int n = (count - i < kRandomLanes) ? count - i : kRandomLanes;
+    if (dither_) {
+      // Triangular distribution: difference of two uniform random values.
+      for (int j = 0; j < kRandomLanes; ++j) {
+        random_state_[0][j] = random_state_[0][j] * 1664525U + 1013904223U;
+        random_state_[1][j] = random_state_[1][j] * 22695477U + 1U;
+        dither[j] = ((float) random_state_[0][j]
+                     - (float) random_state_[1][j]) * lsb_per_random;
+      }
+    } else {
+      for (int j = 0; j < kRandomLanes; ++j) dither[j] = 0.0f;
+    }
+    for (int j = 0; j < n; ++j) {
+      float v = in[i + j] * scale + dither[j];
+      v = v > max_value ? max_value : v;
+      v = v < -scale ? -scale : v;
+      v += (v < 0) ? -0.5f : 0.5f;   // Round; conversion truncates.
+      out[i + j] = (int32_t) ((uint32_t) (int32_t) v << shift);
+    }
+  }
+}
@@ -0,0 +1,60 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_PCM_QUANTIZER_H
+#define FOLVE_PCM_QUANTIZER_H
+
+#include <sndfile.h>
+#include <stdint.h>
+
+// Converts float samples to 16 or 24 bit integers for writing, optionally
+// with TPDF dither. Out of range values are clipped instead of wrapped
+// around.
+//
+// The integers are written with sf_writef_int(), aligned to the most
+// significant bits, so that libsndfile only needs to shift them into the
+// target format.
+class PcmQuantizer {
+public:
+  // Returns a quantizer for the given output format or NULL if the format
+  // is not 16 or 24 bit PCM; these are better written as float.
+  static PcmQuantizer *Create(int sf_format, bool dither);
+  ~PcmQuantizer();
+
+  // Quantize "frames" frames of interleaved float samples and write them
+  // to "out".
+  void WriteFrames(SNDFILE *out, const float *samples, int frames,
+                   int channels);
+
+private:
+  // Number of independent random number generators. Each sample in a
+  // group uses its own, so that the compiler can vectorize.
+  enum { kRandomLanes = 8 };
+
+  PcmQuantizer(int bits, bool dither);
+
+  void Quantize(const float *in, int32_t *out, int count);
+
+  const int bits_;
+  const bool dither_;
+  int32_t *buffer_;
+  int buffer_size_;
+  uint32_t random_state_[2][kRandomLanes];
+};
+
+#endif  // FOLVE_PCM_QUANTIZER_H
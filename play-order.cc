@@ -0,0 +1,161 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "play-order.h"
+
+#include <algorithm>
+
+// Opening another file sooner than this after the previous one is browsing
+// or indexing, not playing.
+static const double kMinPlaySeconds = 10.0;
+
+// Once transitions from a file add up to this, they are all halved.
+static const int kMaxTransitions = 16;
+
+// Number of clients we keep track of.
+static const size_t kMaxClients = 64;
+
+PlayOrderModel::PlayOrderModel(int max_files) : max_files_(max_files) {}
+
+void PlayOrderModel::NoteOpen(int client, const std::string &fs_path,
+                              double now) {
+  folve::MutexLock l(&mutex_);
+  ClientMap::iterator found = clients_.find(client);
+  if (found == clients_.end()) {
+    if (clients_.size() >= kMaxClients) {
+      ClientMap::iterator oldest = clients_.begin();
+      for (ClientMap::iterator it = clients_.begin(); it != clients_.end();
+           ++it) {
+        if (it->second.opened < oldest->second.opened) oldest = it;
+      }
+      ForgetClient_Locked(oldest->first);
+      clients_.erase(oldest);
+    }
+    found = clients_.insert(std::make_pair(client, Client())).first;
+  } else if (found->second.last_file == fs_path) {
+    return;  // Re-opened; still the same.
+  } else if (now - found->second.opened >= kMinPlaySeconds) {
+    AddTransition_Locked(client, found->second.last_file, fs_path, now);
+  }
+  found->second.last_file = fs_path;
+  found->second.opened = now;
+}
+
+void PlayOrderModel::AddTransition_Locked(int client, const std::string &from,
+                                          const std::string &to, double now) {
+  if (files_.find(from) == files_.end() && files_.size() >= max_files_) {
+    EvictLeastRecentlyUsed_Locked();
+  }
+  FileEntry &entry = files_[from];
+  entry.last_use = now;
+  ++entry.per_client[client][to];
+  int total = 0;
+  for (ClientCounts::const_iterator c = entry.per_client.begin();
+       c != entry.per_client.end(); ++c) {
+    for (Counts::const_iterator it = c->second.begin(); it != c->second.end();
+         ++it) {
+      total += it->second;
+    }
+  }
+  if (total <= kMaxTransitions)
+    return;
+  for (ClientCounts::iterator c = entry.per_client.begin();
+       c != entry.per_client.end(); /**/) {
+    Counts &counts = c->second;
+    for (Counts::iterator it = counts.begin(); it != counts.end(); /**/) {
+      it->second /= 2;
+      if (it->second == 0) {
+        counts.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    if (counts.empty()) {
+      entry.per_client.erase(c++);
+    } else {
+      ++c;
+    }
+  }
+}
+
+void PlayOrderModel::ForgetClient_Locked(int client) {
+  for (FileMap::iterator it = files_.begin(); it != files_.end(); /**/) {
+    it->second.per_client.erase(client);
+    if (it->second.per_client.empty()) {
+      files_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void PlayOrderModel::EvictLeastRecentlyUsed_Locked() {
+  if (files_.empty()) return;
+  FileMap::iterator oldest = files_.begin();
+  for (FileMap::iterator it = files_.begin(); it != files_.end(); ++it) {
+    if (it->second.last_use < oldest->second.last_use) oldest = it;
+  }
+  files_.erase(oldest);
+}
+
+void PlayOrderModel::PredictNext(const std::string &fs_path, size_t max_count,
+                                 float min_likelihood,
+                                 std::vector<std::string> *successors) {
+  Counts playing, others;
+  {
+    folve::MutexLock l(&mutex_);
+    FileMap::const_iterator found = files_.find(fs_path);
+    if (found == files_.end())
+      return;
+    const ClientCounts &per_client = found->second.per_client;
+    for (ClientCounts::const_iterator it = per_client.begin();
+         it != per_client.end(); ++it) {
+      ClientMap::const_iterator client = clients_.find(it->first);
+      Counts *merged = (client != clients_.end()
+                        && client->second.last_file == fs_path)
+        ? &playing : &others;
+      for (Counts::const_iterator c = it->second.begin();
+           c != it->second.end(); ++c) {
+        (*merged)[c->first] += c->second;
+      }
+    }
+  }
+  const size_t limit = successors->size() + max_count;
+  AppendLikely(playing, limit, min_likelihood, successors);
+  AppendLikely(others, limit, min_likelihood, successors);
+}
+
+void PlayOrderModel::AppendLikely(const Counts &counts, size_t limit,
+                                  float min_likelihood,
+                                  std::vector<std::string> *successors) {
+  int total = 0;
+  std::vector<std::pair<int, std::string> > ranked;
+  for (Counts::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+    ranked.push_back(std::make_pair(-it->second, it->first));
+    total += it->second;
+  }
+  std::sort(ranked.begin(), ranked.end());  // Most frequent first.
+  for (size_t i = 0; i < ranked.size() && successors->size() < limit; ++i) {
+    if (-ranked[i].first < min_likelihood * total)
+      break;
+    if (std::find(successors->begin(), successors->end(), ranked[i].second)
+        == successors->end()) {
+      successors->push_back(ranked[i].second);
+    }
+  }
+}
@@ -0,0 +1,82 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_PLAY_ORDER_H
+#define FOLVE_PLAY_ORDER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+// Learns in which order clients play files, to predict which file is opened
+// after another one. For every client (process) we remember the file it
+// opened last; opening another one a while later counts as a transition
+// from the one to the other. Transitions are counted per file and client;
+// old ones of a file fade out, so that new habits take over, and those of
+// clients we stop tracking are forgotten.
+// This class is thread-safe.
+class PlayOrderModel {
+public:
+  // Remember transitions from at most "max_files" files.
+  explicit PlayOrderModel(int max_files);
+
+  // Note that "client" opened "fs_path" at time "now".
+  void NoteOpen(int client, const std::string &fs_path, double now);
+
+  // Append files likely to be opened after "fs_path" to "successors", most
+  // likely first: at most "max_count" files that followed "fs_path" at
+  // least with the given likelihood. Transitions seen from clients that
+  // currently play "fs_path" come first.
+  void PredictNext(const std::string &fs_path, size_t max_count,
+                   float min_likelihood,
+                   std::vector<std::string> *successors);
+
+private:
+  typedef std::map<std::string, int> Counts;  // Next file -> times seen.
+  typedef std::map<int, Counts> ClientCounts;
+  struct FileEntry {
+    ClientCounts per_client;
+    double last_use;
+  };
+  struct Client {
+    std::string last_file;
+    double opened;
+  };
+  typedef std::map<std::string, FileEntry> FileMap;
+  typedef std::map<int, Client> ClientMap;
+
+  // Append the most frequent of "counts" to "successors" until it has
+  // "limit" elements.
+  static void AppendLikely(const Counts &counts, size_t limit,
+                           float min_likelihood,
+                           std::vector<std::string> *successors);
+
+  void AddTransition_Locked(int client, const std::string &from,
+                            const std::string &to, double now);
+  void ForgetClient_Locked(int client);
+  void EvictLeastRecentlyUsed_Locked();
+
+  const size_t max_files_;
+  folve::Mutex mutex_;
+  FileMap files_;
+  ClientMap clients_;
+};
+
+#endif  // FOLVE_PLAY_ORDER_H
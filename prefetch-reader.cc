@@ -0,0 +1,250 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "prefetch-reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+// Size of each read from the underlying file and how much we keep around
+// in total. A couple of seconds of even high-resolution audio.
+static const size_t kFetchChunk = 256 << 10;
+static const size_t kBufferSize = 4 << 20;
+
+// We start reading ahead this much; doubled each time the reader has to
+// wait for us, up to kBufferSize.
+static const size_t kInitialWindow = 2 * kFetchChunk;
+
+// If nobody read for that long, the fetcher thread and its buffer go away.
+static const double kIdleSeconds = 10.0;
+
+class PrefetchReader::Fetcher : public folve::Thread {
+public:
+  // The convolver waits for our data; so not a background thread.
+  explicit Fetcher(PrefetchReader *reader) : Thread(false), reader_(reader) {}
+  virtual void Run() { reader_->FetchLoop(); }
+
+private:
+  PrefetchReader *const reader_;
+};
+
+PrefetchReader::PrefetchReader(int filedes)
+  : filedes_(filedes), file_size_(0), snd_position_(0),
+    prefetching_(false), buffer_(NULL), buffer_start_(0), buffer_fill_(0),
+    window_(kInitialWindow), consumed_(0), generation_(0), fetch_done_(false),
+    quit_(false), fetcher_(NULL) {
+  pthread_cond_init(&data_event_, NULL);
+  pthread_cond_init(&space_event_, NULL);
+  struct stat st;
+  if (fstat(filedes_, &st) == 0) file_size_ = st.st_size;
+}
+
+PrefetchReader::~PrefetchReader() {
+  {
+    folve::MutexLock l(&mutex_);
+    quit_ = true;
+    pthread_cond_signal(&space_event_);
+  }
+  delete fetcher_;  // Joins the thread, which frees the buffer.
+  pthread_cond_destroy(&data_event_);
+  pthread_cond_destroy(&space_event_);
+}
+
+void PrefetchReader::StartPrefetch() {
+  folve::MutexLock l(&mutex_);
+  if (prefetching_ || quit_) return;
+  delete fetcher_;  // Finished when it went idle; joins right away.
+  // Let the kernel know as well; helps local and network filesystems.
+  posix_fadvise(filedes_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  buffer_ = new char[kBufferSize];
+  window_ = kInitialWindow;
+  Restart_Locked(consumed_);
+  prefetching_ = true;
+  fetcher_ = new Fetcher(this);
+  fetcher_->Start();
+}
+
+void PrefetchReader::Restart_Locked(off_t offset) {
+  buffer_start_ = offset;
+  buffer_fill_ = 0;
+  consumed_ = offset;
+  fetch_done_ = false;
+  ++generation_;
+  pthread_cond_signal(&space_event_);
+}
+
+size_t PrefetchReader::Consumed_Locked() const {
+  if (consumed_ <= buffer_start_) return 0;
+  return std::min((size_t) (consumed_ - buffer_start_), buffer_fill_);
+}
+
+void PrefetchReader::FetchLoop() {
+  folve::MutexLock l(&mutex_);
+  for (;;) {
+    bool idle = false;
+    while (!quit_ && !idle
+           && (fetch_done_ || (buffer_fill_ - Consumed_Locked()
+                               + kFetchChunk > window_))) {
+      idle = !mutex_.WaitOn(&space_event_, kIdleSeconds);
+    }
+    if (quit_ || idle) {
+      // Readers only look at the buffer while we're prefetching.
+      prefetching_ = false;
+      delete [] buffer_;
+      buffer_ = NULL;
+      buffer_fill_ = 0;
+      return;
+    }
+
+    if (buffer_fill_ + kFetchChunk > kBufferSize) {
+      // Make room by dropping what has been consumed already.
+      const size_t drop = Consumed_Locked();
+      memmove(buffer_, buffer_ + drop, buffer_fill_ - drop);
+      buffer_start_ += drop;
+      buffer_fill_ -= drop;
+    }
+
+    // Readers only look at the valid part of the buffer, so we can fill the
+    // rest without holding the lock.
+    const int generation = generation_;
+    char *const dest = buffer_ + buffer_fill_;
+    const off_t position = buffer_start_ + buffer_fill_;
+    mutex_.Unlock();
+    ssize_t got;
+    do {
+      got = pread(filedes_, dest, kFetchChunk, position);
+    } while (got < 0 && errno == EINTR);
+    mutex_.Lock();
+
+    if (generation != generation_)
+      continue;  // Restarted meanwhile; this data is useless.
+    if (got > 0) {
+      buffer_fill_ += got;
+    } else {
+      fetch_done_ = true;  // Reader will find out if EOF or error.
+    }
+    pthread_cond_broadcast(&data_event_);
+  }
+}
+
+ssize_t PrefetchReader::ReadFile(char *buf, size_t count, off_t offset) {
+  size_t done = 0;
+  while (done < count) {
+    const ssize_t r = pread(filedes_, buf + done, count - done, offset + done);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && done == 0) return -1;
+    if (r <= 0) break;
+    done += r;
+  }
+  return done;
+}
+
+ssize_t PrefetchReader::Read(char *buf, size_t count, off_t offset) {
+  folve::MutexLock l(&mutex_);
+  if (!prefetching_) {
+    mutex_.Unlock();
+    const ssize_t result = ReadFile(buf, count, offset);
+    mutex_.Lock();
+    if (result >= 0) consumed_ = offset + result;
+    return result;
+  }
+  if (offset < buffer_start_
+      || offset > (off_t) (buffer_start_ + buffer_fill_)) {
+    // Not where we were prefetching; continue from here.
+    Restart_Locked(offset);
+  }
+  size_t done = 0;
+  while (done < count) {
+    const off_t position = offset + done;
+    const off_t available = buffer_start_ + buffer_fill_ - position;
+    if (available > 0) {
+      const size_t len = std::min((size_t) available, count - done);
+      memcpy(buf + done, buffer_ + (position - buffer_start_), len);
+      done += len;
+      continue;
+    }
+    if (fetch_done_ || !prefetching_) {
+      // End of file or read error. Find out which with a direct read.
+      mutex_.Unlock();
+      const ssize_t r = ReadFile(buf + done, count - done, position);
+      mutex_.Lock();
+      if (r < 0 && done == 0) return -1;
+      if (r > 0) done += r;
+      break;
+    }
+    // We're waiting for the file: read further ahead from now on.
+    window_ = std::min(2 * window_, kBufferSize);
+    consumed_ = position;  // Let fetcher know it can reuse space.
+    pthread_cond_signal(&space_event_);
+    mutex_.WaitOn(&data_event_);
+  }
+  consumed_ = offset + done;
+  pthread_cond_signal(&space_event_);
+  return done;
+}
+
+SNDFILE *PrefetchReader::OpenSoundfile(SF_INFO *info) {
+  SF_VIRTUAL_IO virtual_io;
+  memset(&virtual_io, 0, sizeof(virtual_io));
+  virtual_io.get_filelen = &PrefetchReader::SndGetFileLen;
+  virtual_io.seek = &PrefetchReader::SndSeek;
+  virtual_io.read = &PrefetchReader::SndRead;
+  virtual_io.write = &PrefetchReader::SndWrite;
+  virtual_io.tell = &PrefetchReader::SndTell;
+  return sf_open_virtual(&virtual_io, SFM_READ, info, this);
+}
+
+sf_count_t PrefetchReader::SndGetFileLen(void *userdata) {
+  return reinterpret_cast<PrefetchReader*>(userdata)->file_size_;
+}
+
+sf_count_t PrefetchReader::SndSeek(sf_count_t offset, int whence,
+                                   void *userdata) {
+  PrefetchReader *reader = reinterpret_cast<PrefetchReader*>(userdata);
+  switch (whence) {
+  case SEEK_SET: reader->snd_position_ = offset; break;
+  case SEEK_CUR: reader->snd_position_ += offset; break;
+  case SEEK_END: reader->snd_position_ = reader->file_size_ + offset; break;
+  }
+  return reader->snd_position_;
+}
+
+sf_count_t PrefetchReader::SndRead(void *ptr, sf_count_t count,
+                                   void *userdata) {
+  PrefetchReader *reader = reinterpret_cast<PrefetchReader*>(userdata);
+  const ssize_t r = reader->Read((char*) ptr, count, reader->snd_position_);
+  if (r <= 0) return 0;
+  reader->snd_position_ += r;
+  return r;
+}
+
+sf_count_t PrefetchReader::SndWrite(const void *ptr, sf_count_t count,
+                                    void *userdata) {
+  return 0;  // Read only.
+}
+
+sf_count_t PrefetchReader::SndTell(void *userdata) {
+  return reinterpret_cast<PrefetchReader*>(userdata)->snd_position_;
+}
@@ -0,0 +1,100 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_PREFETCH_READER_H
+#define FOLVE_PREFETCH_READER_H
+
+#include <pthread.h>
+#include <sndfile.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+// Reads a file sequentially ahead of its consumer in a separate thread,
+// using large reads. Used to feed libsndfile: on a network filesystem,
+// every one of the small reads libsndfile does would otherwise stall the
+// convolver for a round-trip.
+//
+// Until StartPrefetch() is called, e.g. while only headers are looked at,
+// reads go straight to the file. Reads at other positions than where the
+// last read ended (e.g. libsndfile looking at headers) are served directly;
+// prefetching then continues from there. How far we read ahead grows
+// while the consumer has to wait for us. If nobody reads for a while, the
+// thread and buffer are given up until the next StartPrefetch().
+class PrefetchReader {
+public:
+  // Does not take ownership of "filedes"; it has to stay open for the
+  // lifetime of this object.
+  explicit PrefetchReader(int filedes);
+  ~PrefetchReader();
+
+  // Open a sound file reading through this prefetcher. NULL on error, see
+  // sf_strerror(NULL). The SNDFILE needs to be closed before this
+  // PrefetchReader is deleted.
+  SNDFILE *OpenSoundfile(SF_INFO *info);
+
+  // Read "count" bytes at "offset". Returns number of bytes read, which is
+  // only less than "count" at the end of the file, or -1 on error.
+  ssize_t Read(char *buf, size_t count, off_t offset);
+
+  // Start reading ahead in the background, if not already doing so.
+  // Call when the file is about to be read sequentially.
+  void StartPrefetch();
+
+private:
+  class Fetcher;
+
+  // Runs in the Fetcher thread.
+  void FetchLoop();
+
+  // Read from the file directly; returns like Read().
+  ssize_t ReadFile(char *buf, size_t count, off_t offset);
+
+  // Forget prefetched data and start over at the given position.
+  void Restart_Locked(off_t offset);
+
+  // Bytes at the beginning of buffer_ the reader is done with.
+  size_t Consumed_Locked() const;
+
+  static sf_count_t SndGetFileLen(void *userdata);
+  static sf_count_t SndSeek(sf_count_t offset, int whence, void *userdata);
+  static sf_count_t SndRead(void *ptr, sf_count_t count, void *userdata);
+  static sf_count_t SndWrite(const void *ptr, sf_count_t count, void *userdata);
+  static sf_count_t SndTell(void *userdata);
+
+  const int filedes_;
+  off_t file_size_;
+  off_t snd_position_;  // libsndfile's position; only used by its thread.
+
+  folve::Mutex mutex_;
+  pthread_cond_t data_event_;   // New data available or fetcher done.
+  pthread_cond_t space_event_;  // Data consumed, restart or quit.
+  bool prefetching_;      // Fetcher is running and buffer_ valid.
+  char *buffer_;
+  off_t buffer_start_;    // File position of the beginning of buffer_.
+  size_t buffer_fill_;    // Bytes of valid data in buffer_.
+  size_t window_;         // Max. bytes to read ahead of consumed_.
+  off_t consumed_;        // File position up to which data was read.
+  int generation_;        // Incremented with each restart.
+  bool fetch_done_;       // End of file or error reached.
+  bool quit_;
+
+  Fetcher *fetcher_;      // Might have finished already if idle.
+};
+
+#endif  // FOLVE_PREFETCH_READER_H
@@ -31,7 +31,8 @@ using folve::StringPrintf;
 using folve::DLogf;
 
 ProcessorPool::ProcessorPool(int max_available)
-  : max_per_config_(max_available) {
+  : max_per_config_(max_available),
+    convolver_threads_(sysconf(_SC_NPROCESSORS_ONLN)) {
 }
 
 static bool FindFirstAccessiblePath(const std::vector<std::string> &path,
@@ -67,6 +68,17 @@ SoundProcessor *ProcessorPool::GetOrCreate(const std::string &base_dir,
                            short_dir, sampling_rate / 1000.0, channels, bits);
     return NULL;
   }
+  SoundProcessor *result = GetOrCreateFromConfig(config_path, sampling_rate,
+                                                 channels);
+  if (result == NULL) {
+    *errmsg = "Problem parsing " + config_path;
+  }
+  return result;
+}
+
+SoundProcessor *ProcessorPool::GetOrCreateFromConfig(
+                       const std::string &config_path,
+                       int sampling_rate, int channels) {
   SoundProcessor *result;
   while ((result = CheckOutOfPool(config_path)) != NULL) {
     if (result->ConfigStillUpToDate())
@@ -80,9 +92,9 @@ SoundProcessor *ProcessorPool::GetOrCreate(const std::string &base_dir,
     return result;
   }
 
-  result = SoundProcessor::Create(config_path, sampling_rate, channels);
+  result = SoundProcessor::Create(config_path, sampling_rate, channels,
+                                  convolver_threads_);
   if (result == NULL) {
-    *errmsg = "Problem parsing " + config_path;
     syslog(LOG_ERR, "filter-config %s is broken.", config_path.c_str());
   } else {
     DLogf("Processor %p: Newly created [%s]", result, config_path.c_str());
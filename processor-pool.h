@@ -40,16 +40,28 @@ public:
                               int sampling_rate, int channels, int bits,
                               std::string *errmsg);
 
+  // Like GetOrCreate(), but for the given configuration file, e.g. to get
+  // another processor like one we have.
+  SoundProcessor *GetOrCreateFromConfig(const std::string &config_path,
+                                        int sampling_rate, int channels);
+
   // Return a processor pack to the pool.
   void Return(SoundProcessor *processor);
 
+  void set_max_per_config(int n) { max_per_config_ = n; }
+
+  // Maximum number of threads a new processor may convolve independent
+  // channels on. Default: number of CPUs.
+  void set_convolver_threads(int n) { convolver_threads_ = n; }
+
 private:
   typedef std::deque<SoundProcessor*> ProcessorList;
   typedef std::map<std::string, ProcessorList*> PoolMap;
 
   SoundProcessor *CheckOutOfPool(const std::string &config_path);
 
-  const size_t max_per_config_;
+  size_t max_per_config_;
+  int convolver_threads_;
   folve::Mutex pool_mutex_;
   PoolMap pool_;
 };
@@ -0,0 +1,178 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "segment-converter.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "gapless-lead-in.h"
+#include "input-decoder.h"
+#include "mapped-pcm-decoder.h"
+#include "sound-processor.h"
+#include "util.h"
+
+// Segments are this many times as long as the pre-roll, so that we don't
+// spend more than a fraction of the work on pre-roll.
+static const int kSegmentPerPreroll = 4;
+// ... but at least this many seconds (at 48kHz).
+static const int kMinSegmentFrames = 5 * 48000;
+
+namespace {
+// Decodes a range of frames of the mapped file, independent of any other
+// reader.
+class RangeDecoder : public InputDecoder {
+public:
+  RangeDecoder(const MappedPcmDecoder *source, int64_t start, int64_t end)
+    : source_(source), next_(start), end_(end) {}
+
+  virtual int Decode(float *const *channels, int offset, int frames) {
+    frames = std::min((int64_t) frames, end_ - next_);
+    if (frames <= 0) return 0;
+    const int r = source_->DecodeAt(next_, channels, offset, frames);
+    next_ += r;
+    return r;
+  }
+
+private:
+  const MappedPcmDecoder *const source_;
+  int64_t next_;
+  const int64_t end_;
+};
+}  // namespace
+
+class SegmentConverter::Worker : public folve::Thread {
+public:
+  Worker(SegmentConverter *converter, int segment)
+    : folve::Thread(false), converter_(converter), segment_(segment) {}
+
+  virtual void Run() { converter_->ConvertSegment(segment_); }
+
+private:
+  SegmentConverter *const converter_;
+  const int segment_;
+};
+
+SegmentConverter::SegmentConverter(
+                     MappedPcmDecoder *source,
+                     const std::vector<SoundProcessor*> &processors,
+                     const GaplessLeadIn *lead_in)
+  : source_(source), processors_(processors), lead_in_(lead_in),
+    start_(processors.size()), end_(processors.size()),
+    output_(processors.size()), output_frames_(processors.size()),
+    max_value_(processors.size()), workers_(processors.size()),
+    round_segments_(0), next_segment_(0) {
+  const SoundProcessor *processor = processors_[0];
+  const int fragment = processor->fragment_size();
+  assert(processor->history_frames() >= 0);
+  // Whole fragments, so that segments start at a fragment boundary.
+  preroll_frames_ = ((processor->history_frames() + fragment - 1) / fragment
+                     * fragment);
+  segment_frames_ = std::max(kSegmentPerPreroll * preroll_frames_,
+                             kMinSegmentFrames);
+  segment_frames_ = (segment_frames_ + fragment - 1) / fragment * fragment;
+  for (int i = 0; i < segments(); ++i) {
+    output_[i].resize(segment_frames_ * processor->output_channels());
+  }
+}
+
+SegmentConverter::~SegmentConverter() {
+  for (int i = 0; i < segments(); ++i) {
+    delete workers_[i];  // Joins the thread.
+  }
+}
+
+void SegmentConverter::StartRound(int64_t start, int64_t end) {
+  assert(!round_pending());
+  round_segments_ = 0;
+  for (int i = 0; i < segments(); ++i) {
+    start_[i] = std::min(start + i * segment_frames_, end);
+    end_[i] = std::min(start_[i] + segment_frames_, end);
+    output_frames_[i] = 0;
+    max_value_[i] = 0;
+    if (start_[i] < end_[i]) round_segments_ = i + 1;
+  }
+  for (int i = 1; i < round_segments_; ++i) {
+    workers_[i] = new Worker(this, i);
+    workers_[i]->Start();
+  }
+  next_segment_ = 0;
+}
+
+int SegmentConverter::FinishSegment() {
+  assert(round_pending());
+  const int segment = next_segment_++;
+  if (workers_[segment] != NULL) {
+    delete workers_[segment];  // Joins the thread.
+    workers_[segment] = NULL;
+  } else {
+    ConvertSegment(segment);
+  }
+  return segment;
+}
+
+void SegmentConverter::ConvertSegment(int segment) {
+  SoundProcessor *processor = processors_[segment];
+  output_frames_[segment] = ConvertRange(processor,
+                                         start_[segment], end_[segment],
+                                         &output_[segment][0]);
+  max_value_[segment] = processor->max_output_value();
+  processor->ResetMaxValues();
+}
+
+void SegmentConverter::ResetTo(SoundProcessor *processor,
+                               int64_t preroll_start) {
+  if (preroll_start == 0 && lead_in_ != NULL) {
+    lead_in_->Prime(processor);
+  } else {
+    processor->Reset();
+  }
+}
+
+int SegmentConverter::ConvertRange(SoundProcessor *processor,
+                                   int64_t start, int64_t end,
+                                   float *output) {
+  if (start >= end) return 0;
+  const int64_t preroll_start = std::max((int64_t) 0, start - preroll_frames_);
+  const int channels = processor->output_channels();
+  RangeDecoder decoder(source_, preroll_start, end);
+  ResetTo(processor, preroll_start);
+  int64_t pos = preroll_start;
+  int r;
+  while ((r = processor->FillBuffer(&decoder)) > 0) {
+    const float *samples = processor->ReadProcessed(r);
+    if (pos >= start) {  // Pre-roll is whole fragments, so never partial.
+      memcpy(output + (pos - start) * channels, samples,
+             r * channels * sizeof(float));
+    }
+    pos += r;
+  }
+  return pos - start;
+}
+
+void SegmentConverter::Prime(SoundProcessor *processor, int64_t frame) {
+  const int64_t preroll_start = std::max((int64_t) 0, frame - preroll_frames_);
+  RangeDecoder decoder(source_, preroll_start, frame);
+  ResetTo(processor, preroll_start);
+  int r;
+  while ((r = processor->FillBuffer(&decoder)) > 0) {
+    processor->ReadProcessed(r);
+  }
+}
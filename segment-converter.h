@@ -0,0 +1,115 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_SEGMENT_CONVERTER_H
+#define FOLVE_SEGMENT_CONVERTER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+class GaplessLeadIn;
+class MappedPcmDecoder;
+class SoundProcessor;
+
+// Converts consecutive segments of a file in parallel, each with its own
+// SoundProcessor. Convolution is linear, so converting a segment on its own
+// gives exactly the same output as converting the whole file, as long as
+// the processor first sees the input before the segment that the filter
+// still remembers. The output of that pre-roll is dropped.
+//
+// Segments of a round are handed out one by one as they are done, so that
+// the caller can publish each as soon as possible while the others are
+// still being converted.
+class SegmentConverter {
+public:
+  // All "processors" need the same, finite impulse response configuration.
+  // If given, "lead_in" is what precedes the beginning of the file.
+  // Does not take ownership.
+  SegmentConverter(MappedPcmDecoder *source,
+                   const std::vector<SoundProcessor*> &processors,
+                   const GaplessLeadIn *lead_in);
+  ~SegmentConverter();  // Waits for running segments.
+
+  // Input frames converted by one round.
+  int64_t round_frames() const { return segment_frames_ * segments(); }
+  int segments() const { return processors_.size(); }
+
+  // Start converting input frames "start" to "end", "start" being a
+  // multiple of the fragment size. This is split into segments of at most
+  // round_frames() / segments(), one per processor. All but the first are
+  // converted in the background right away; the first is converted by the
+  // FinishSegment() call that asks for it. The previous round needs to be
+  // finished.
+  void StartRound(int64_t start, int64_t end);
+
+  // Returns true if the current round has segments not finished yet;
+  // empty segments at the end of the input are not part of it.
+  bool round_pending() const { return next_segment_ < round_segments_; }
+
+  // Finish the next segment of the current round, waiting for it if needed.
+  // Returns the segment number to look up the result with the following
+  // accessors; it is valid until the next StartRound().
+  int FinishSegment();
+
+  // Result of a finished segment: input frames, interleaved output and
+  // maximum absolute output value.
+  int64_t input_frames(int segment) const {
+    return end_[segment] - start_[segment];
+  }
+  const float *output(int segment) const { return &output_[segment][0]; }
+  int output_frames(int segment) const { return output_frames_[segment]; }
+  float max_output_value(int segment) const { return max_value_[segment]; }
+
+  // Let "processor" see the input before "frame", so that it can continue
+  // converting from there. "frame" needs to be a multiple of the fragment
+  // size.
+  void Prime(SoundProcessor *processor, int64_t frame);
+
+private:
+  class Worker;
+
+  // Reset "processor" to see input from "preroll_start" on.
+  void ResetTo(SoundProcessor *processor, int64_t preroll_start);
+
+  // Convert segment "segment" of the current round with its processor.
+  void ConvertSegment(int segment);
+
+  // Convert frames "start" to "end" with "processor" into "output".
+  // Returns number of frames converted.
+  int ConvertRange(SoundProcessor *processor, int64_t start, int64_t end,
+                   float *output);
+
+  MappedPcmDecoder *const source_;
+  const std::vector<SoundProcessor*> processors_;
+  const GaplessLeadIn *const lead_in_;
+  int preroll_frames_;
+  int segment_frames_;
+
+  // Per segment of the current round.
+  std::vector<int64_t> start_;
+  std::vector<int64_t> end_;
+  std::vector<std::vector<float> > output_;
+  std::vector<int> output_frames_;
+  std::vector<float> max_value_;
+  std::vector<Worker*> workers_;  // NULL if not converted in background.
+  int round_segments_;            // Non-empty segments in this round.
+  int next_segment_;              // Next one FinishSegment() hands out.
+};
+
+#endif  // FOLVE_SEGMENT_CONVERTER_H
@@ -0,0 +1,161 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "size-index.h"
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "util.h"
+
+using folve::StringPrintf;
+
+static const char kIndexMagic[8] = { 'F', 'o', 'l', 'v', 'S', 'z', '0', '2' };
+
+SizeIndex::SizeIndex() : out_(NULL) {}
+
+SizeIndex::~SizeIndex() {
+  if (out_) fclose(out_);
+}
+
+// FNV-1a. The key only needs to distinguish entries, which are verified
+// by modification time and size anyway.
+uint64_t SizeIndex::Key(const std::string &source_file,
+                        const std::string &filter) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const std::string key = filter + '\0' + source_file;
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+    hash ^= (unsigned char) *it;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool SizeIndex::Open(const std::string &filename, std::string *error) {
+  folve::MutexLock l(&mutex_);
+  int records_read = 0;
+  bool clean_file = false;  // Valid header and no incomplete record.
+  FILE *in = fopen(filename.c_str(), "rb");
+  if (in != NULL) {
+    char magic[sizeof(kIndexMagic)];
+    if (fread(magic, sizeof(magic), 1, in) == 1
+        && memcmp(magic, kIndexMagic, sizeof(magic)) == 0) {
+      IndexRecord record;
+      while (fread(&record, sizeof(record), 1, in) == 1) {
+        index_[record.key] = record;   // Later records win.
+        ++records_read;
+      }
+      clean_file = (ftell(in) == (long) (sizeof(kIndexMagic)
+                                         + records_read * sizeof(record)));
+    } else {
+      syslog(LOG_INFO, "Size index %s has unknown format; starting fresh.",
+             filename.c_str());
+    }
+    fclose(in);
+  }
+
+  // Rewriting leaves out outdated records and a possibly incomplete last
+  // record. We only need to do that once in a while.
+  const bool needs_compaction = (!clean_file
+                                 || records_read > 2 * (int)index_.size() + 64);
+  if (needs_compaction && !Compact_Locked(filename)) {
+    *error = StringPrintf("Can't write size index %s: %s",
+                          filename.c_str(), strerror(errno));
+    return false;
+  }
+  out_ = fopen(filename.c_str(), "ab");
+  if (out_ == NULL) {
+    *error = StringPrintf("Can't append to size index %s: %s",
+                          filename.c_str(), strerror(errno));
+    return false;
+  }
+  folve::DLogf("Size index %s: %d entries", filename.c_str(),
+               (int) index_.size());
+  return true;
+}
+
+bool SizeIndex::Compact_Locked(const std::string &filename) {
+  const std::string tmp_name = filename + ".tmp";
+  FILE *out = fopen(tmp_name.c_str(), "wb");
+  if (out == NULL) return false;
+  bool success = fwrite(kIndexMagic, sizeof(kIndexMagic), 1, out) == 1;
+  for (IndexMap::const_iterator it = index_.begin();
+       success && it != index_.end(); ++it) {
+    success = fwrite(&it->second, sizeof(it->second), 1, out) == 1;
+  }
+  success = (fclose(out) == 0) && success;
+  if (!success || rename(tmp_name.c_str(), filename.c_str()) != 0) {
+    unlink(tmp_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+void SizeIndex::Record(const std::string &source_file,
+                       const std::string &filter, uint64_t filter_stamp,
+                       const struct stat &source_stat, off_t output_size,
+                       int flags) {
+  IndexRecord record;
+  memset(&record, 0, sizeof(record));
+  record.key = Key(source_file, filter);
+  record.mtime_sec = source_stat.st_mtim.tv_sec;
+  record.mtime_nsec = source_stat.st_mtim.tv_nsec;
+  record.flags = flags;
+  record.source_size = source_stat.st_size;
+  record.output_size = output_size;
+  record.filter_stamp = filter_stamp;
+
+  folve::MutexLock l(&mutex_);
+  IndexMap::iterator found = index_.find(record.key);
+  if (found != index_.end()
+      && memcmp(&found->second, &record, sizeof(record)) == 0) {
+    return;  // Nothing new.
+  }
+  index_[record.key] = record;
+  if (out_ != NULL) {
+    if (fwrite(&record, sizeof(record), 1, out_) != 1 || fflush(out_) != 0) {
+      syslog(LOG_ERR, "Writing size index: %s; not persisting anymore.",
+             strerror(errno));
+      fclose(out_);
+      out_ = NULL;
+    }
+  }
+}
+
+bool SizeIndex::Lookup(const std::string &source_file,
+                       const std::string &filter,
+                       const struct stat &source_stat,
+                       off_t *output_size, int *flags,
+                       uint64_t *filter_stamp) {
+  const uint64_t key = Key(source_file, filter);
+  folve::MutexLock l(&mutex_);
+  IndexMap::const_iterator found = index_.find(key);
+  if (found == index_.end()) return false;
+  const IndexRecord &record = found->second;
+  if (record.mtime_sec != source_stat.st_mtim.tv_sec
+      || record.mtime_nsec != source_stat.st_mtim.tv_nsec
+      || record.source_size != source_stat.st_size) {
+    return false;  // Underlying file changed.
+  }
+  *output_size = record.output_size;
+  *flags = record.flags;
+  *filter_stamp = record.filter_stamp;
+  return true;
+}
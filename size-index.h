@@ -0,0 +1,92 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_SIZE_INDEX_H
+#define FOLVE_SIZE_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+#include "util.h"
+
+// Index of output sizes of files we have completely converted before, so
+// that we can report the exact size of a file without converting it.
+//
+// Entries are keyed by the underlying file and the filter; they are only
+// valid as long as modification time and size of the underlying file and
+// the filter stamp (see FolveFilesystem::FilterStamp()) are unchanged.
+//
+// The index is kept in memory and, if a file is given, persisted in a
+// compact append-only format (in host byte order). This class is thread-safe.
+class SizeIndex {
+public:
+  // Flags stored with each entry.
+  enum {
+    GAPLESS  = 0x01,  // Converted joined with the previous file.
+    VERBATIM = 0x02,  // Not converted, but passed through as is.
+  };
+
+  SizeIndex();
+  ~SizeIndex();
+
+  // Load existing index from the given file and append new entries to it.
+  // Returns false and sets "error" if the file can't be used.
+  bool Open(const std::string &filename, std::string *error);
+
+  // Remember the output size for "source_file" served with "filter".
+  void Record(const std::string &source_file, const std::string &filter,
+              uint64_t filter_stamp, const struct stat &source_stat,
+              off_t output_size, int flags);
+
+  // Lookup output size, flags and the filter stamp it was recorded with.
+  // Returns false if not known or the source file changed; a differing
+  // filter stamp needs to be treated as outdated as well.
+  bool Lookup(const std::string &source_file, const std::string &filter,
+              const struct stat &source_stat,
+              off_t *output_size, int *flags, uint64_t *filter_stamp);
+
+private:
+  // On-disk record; 48 bytes.
+  struct IndexRecord {
+    uint64_t key;
+    int64_t mtime_sec;
+    int32_t mtime_nsec;
+    uint32_t flags;
+    int64_t source_size;
+    int64_t output_size;
+    uint64_t filter_stamp;
+  };
+  typedef std::map<uint64_t, IndexRecord> IndexMap;
+
+  static uint64_t Key(const std::string &source_file,
+                      const std::string &filter);
+
+  // Write out only live records to a new file and replace the old one.
+  bool Compact_Locked(const std::string &filename);
+
+  folve::Mutex mutex_;
+  IndexMap index_;
+  FILE *out_;
+};
+
+#endif  // FOLVE_SIZE_INDEX_H
@@ -24,6 +24,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+#include "convolver-shards.h"
+#include "direct-fir.h"
+#include "gain-delay.h"
+#include "iir-filter.h"
+#include "input-decoder.h"
+#include "mid-side.h"
+#include "pcm-quantizer.h"
 #include "util.h"
 
 // There seems to be a bug somewhere inside the fftwf library or the use
@@ -32,24 +41,39 @@
 static folve::Mutex fftw_mutex;
 
 SoundProcessor *SoundProcessor::Create(const std::string &config_file,
-                                       int samplerate, int channels) {
+                                       int samplerate, int channels,
+                                       int max_threads) {
   ZitaConfig zita;
   memset(&zita, 0, sizeof(zita));
   zita.fsamp = samplerate;
   zita.ninp = channels;
   zita.nout = channels;
+  zita.max_shards = max_threads;
   zita.convproc = new Convproc();
   { // fftw threading bug workaround, see above.
     folve::MutexLock l(&fftw_mutex);
     if ((config(&zita, config_file.c_str()) != 0)
         || zita.convproc->inpdata(zita.ninp - 1) == NULL
         || zita.convproc->outdata(zita.nout - 1) == NULL) {
+      delete zita.iir;
+      delete zita.fir;
+      delete zita.routes;
+      delete zita.shards;
       return NULL;
     }
   }
   return new SoundProcessor(zita, config_file);
 }
 
+static bool IsSilent(float *const *data, int channels, int frames) {
+  for (int ch = 0; ch < channels; ++ch) {
+    for (int i = 0; i < frames; ++i) {
+      if (data[ch][i] != 0.0f) return false;
+    }
+  }
+  return true;
+}
+
 static time_t GetModificationTime(const std::string &filename) {
   struct stat st;
   stat(filename.c_str(), &st);
@@ -59,62 +83,159 @@ static time_t GetModificationTime(const std::string &filename) {
 SoundProcessor::SoundProcessor(const ZitaConfig &config, const std::string &cfg)
   : zita_config_(config), config_file_(cfg),
     config_file_timestamp_(GetModificationTime(cfg)),
-    buffer_(new float[config.fragm
-                      * std::max(input_channels(), output_channels())]),
+    buffer_(new float[config.fragm * output_channels()]),
+    input_data_(new float*[input_channels()]),
+    output_data_(new float*[output_channels()]),
     input_pos_(0), output_pos_(0),
-    max_out_value_observed_(0.0) {
+    max_out_value_observed_(0.0),
+    // All partitions, plus some slack for the overlap of the last one.
+    silence_settled_(((config.size + config.fragm - 1) / config.fragm + 2)
+                     * config.fragm) {
+  if (config.fir) {
+    folve::Appendf(&filter_info_, "direct FIR %d taps", config.fir->length());
+  } else if (config.impulses) {
+    folve::Appendf(&filter_info_, "FIR %d taps", config.impulse_length);
+    if (config.mid_side) filter_info_.append(" mid/side");
+    if (config.shards) {
+      folve::Appendf(&filter_info_, " on %d threads", config.shards->size());
+    }
+  }
+  if (config.untrimmed_length > config.impulse_length) {
+    folve::Appendf(&filter_info_, " (trimmed from %d)",
+                   config.untrimmed_length);
+  }
+  if (config.iir) {
+    folve::Appendf(&filter_info_, "%s%d biquads",
+                   filter_info_.empty() ? "" : ", ", config.iir->sections());
+  }
+  if (is_identity()) {
+    filter_info_ = "identity";
+  } else if (config.routes) {
+    folve::Appendf(&filter_info_, "%s%d gain/delay routes",
+                   filter_info_.empty() ? "" : ", ", config.routes->size());
+  }
   Reset();
 }
 
 SoundProcessor::~SoundProcessor() {
+  delete zita_config_.shards;
   zita_config_.convproc->stop_process();
   zita_config_.convproc->cleanup();
   delete zita_config_.convproc;
+  delete zita_config_.iir;
+  delete zita_config_.fir;
+  delete zita_config_.routes;
   delete [] buffer_;
+  delete [] input_data_;
+  delete [] output_data_;
 }
 
-int SoundProcessor::FillBuffer(SNDFILE *in) {
+int SoundProcessor::FillBuffer(InputDecoder *in) {
   const int samples_needed = zita_config_.fragm - input_pos_;
   assert(samples_needed);  // Otherwise, call WriteProcessed() first.
   output_pos_ = -1;
-  int r = sf_readf_float(in, buffer_ + input_pos_ * input_channels(),
-                         samples_needed);
+  // The convolver moves its input buffers with every process() call.
+  for (int ch = 0; ch < input_channels(); ++ch) {
+    input_data_[ch] = zita_config_.convproc->inpdata(ch);
+  }
+  int r = in->Decode(input_data_, input_pos_, samples_needed);
   input_pos_ += r;
   return r;
 }
 
-void SoundProcessor::WriteProcessed(SNDFILE *out, int sample_count) {
+void SoundProcessor::WriteProcessed(SNDFILE *out, int sample_count,
+                                    PcmQuantizer *quantizer) {
+  const float *samples = ReadProcessed(sample_count);
+  if (quantizer) {
+    quantizer->WriteFrames(out, samples, sample_count, output_channels());
+  } else {
+    sf_writef_float(out, samples, sample_count);
+  }
+}
+
+const float *SoundProcessor::ReadProcessed(int sample_count) {
   if (output_pos_ < 0) {
     Process();
   }
   assert(sample_count <= zita_config_.fragm - output_pos_);
-  sf_writef_float(out, buffer_ + output_pos_ * output_channels(), sample_count);
+  const float *samples = buffer_ + output_pos_ * output_channels();
   output_pos_ += sample_count;
   if (output_pos_ == zita_config_.fragm) {
     input_pos_ = 0;
   }
+  return samples;
 }
 
 void SoundProcessor::Process() {
   const int samples_missing = zita_config_.fragm - input_pos_;
-  if (samples_missing) {
-    memset(buffer_ + input_pos_ * input_channels(), 0x00,
-           samples_missing * input_channels() * sizeof(float));
-  }
-
-  // Flatten channels: LRLRLRLRLR -> LLLLL and RRRRR
   for (int ch = 0; ch < input_channels(); ++ch) {
-    float *dest = zita_config_.convproc->inpdata(ch);
-    for (int j = 0; j < input_pos_; ++j) {
-      dest[j] = buffer_[j * input_channels() + ch];
+    input_data_[ch] = zita_config_.convproc->inpdata(ch);
+    if (samples_missing) {
+      memset(input_data_[ch] + input_pos_, 0x00,
+             samples_missing * sizeof(float));
     }
   }
 
-  zita_config_.convproc->process();
+  // Short impulses are convolved directly; configurations with only
+  // biquads or diracs don't need to convolve at all.
+  bool convolve = (zita_config_.impulses > 0 && !zita_config_.fir);
+  if (convolve) {
+    // Once the convolver has seen enough digital silence to contain
+    // nothing but zeros, its output is exactly zero until there is signal
+    // again. Its state is all zero then, so we can just skip it.
+    if (IsSilent(input_data_, input_channels(), zita_config_.fragm)) {
+      if (silent_frames_ < silence_settled_) {
+        silent_frames_ += zita_config_.fragm;
+      } else {
+        convolve = false;
+      }
+    } else {
+      silent_frames_ = 0;
+    }
+  }
+  const bool mid_side = convolve && zita_config_.mid_side;
+  if (mid_side) {
+    MidSide::ToMidSide(input_data_[0], input_data_[1], zita_config_.fragm);
+  }
+  if (convolve) {
+    if (zita_config_.shards) {
+      zita_config_.shards->Process(input_data_, zita_config_.fragm);
+    } else {
+      zita_config_.convproc->process();
+    }
+  }
+  for (int ch = 0; ch < output_channels(); ++ch) {
+    float *out = NULL;
+    if (convolve) {
+      out = (zita_config_.shards
+             ? zita_config_.shards->outdata(ch)
+             : zita_config_.convproc->outdata(ch));
+    }
+    if (out == NULL) {  // Nothing convolved to this output.
+      out = zita_config_.convproc->outdata(ch);
+      memset(out, 0x00, zita_config_.fragm * sizeof(float));
+    }
+    output_data_[ch] = out;
+  }
+  if (mid_side) {
+    // Back to left and right; the input as well for the other filters.
+    MidSide::FromMidSide(input_data_[0], input_data_[1], zita_config_.fragm);
+    MidSide::FromMidSide(output_data_[0], output_data_[1], zita_config_.fragm);
+  }
+  if (zita_config_.fir) {
+    zita_config_.fir->Process(input_data_, output_data_, zita_config_.fragm);
+  }
+  if (zita_config_.iir) {
+    zita_config_.iir->Process(input_data_, output_data_, zita_config_.fragm);
+  }
+  if (zita_config_.routes) {
+    zita_config_.routes->Process(input_data_, output_data_,
+                                 zita_config_.fragm);
+  }
 
   // Join channels again.
   for (int ch = 0; ch < output_channels(); ++ch) {
-    float *source = zita_config_.convproc->outdata(ch);
+    const float *source = output_data_[ch];
     for (int j = 0; j < input_pos_; ++j) {
       buffer_[j * output_channels() + ch] = source[j];
       const float out_abs = source[j];
@@ -126,6 +247,24 @@ void SoundProcessor::Process() {
   output_pos_ = 0;
 }
 
+int SoundProcessor::history_frames() const {
+  if (zita_config_.iir) return -1;
+  int history = 0;
+  if (zita_config_.impulses > 0) history = zita_config_.impulse_length;
+  if (zita_config_.fir) history = std::max(history, zita_config_.fir->length());
+  if (zita_config_.routes) {
+    history = std::max(history, zita_config_.routes->max_delay() + 1);
+  }
+  return history;
+}
+
+bool SoundProcessor::is_identity() const {
+  return (zita_config_.impulses == 0 && zita_config_.iir == NULL
+          && zita_config_.routes != NULL
+          && input_channels() == output_channels()
+          && zita_config_.routes->IsIdentity(input_channels()));
+}
+
 bool SoundProcessor::ConfigStillUpToDate() const {
   // TODO(hzeller): this should as well check if any *.wav file mentioned in
   // config is still the same timestamp.
@@ -138,6 +277,11 @@ void SoundProcessor::ResetMaxValues() {
 
 void SoundProcessor::Reset() {
   zita_config_.convproc->reset();
+  if (zita_config_.fir) zita_config_.fir->Reset();
+  if (zita_config_.iir) zita_config_.iir->Reset();
+  if (zita_config_.routes) zita_config_.routes->Reset();
+  if (zita_config_.shards) zita_config_.shards->Reset();
+  silent_frames_ = silence_settled_;  // Freshly reset convolver is silent.
   input_pos_ = 0;
   output_pos_ = -1;
   ResetMaxValues();
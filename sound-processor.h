@@ -24,35 +24,42 @@
 
 #include "zita-config.h"
 
+class InputDecoder;
+class PcmQuantizer;
+
 // The workhorse of processing data from soundfiles.
 class SoundProcessor {
 public:
+  // Independent channels are convolved on up to "max_threads" threads.
   static SoundProcessor *Create(const std::string &config_file,
-                                int samplerate, int channels);
+                                int samplerate, int channels,
+                                int max_threads);
   ~SoundProcessor();
 
-  // Fill Buffer from given sound file. Returns number of samples read.
-  int FillBuffer(SNDFILE *in);
+  // Fill Buffer from given decoder. Returns number of samples read.
+  int FillBuffer(InputDecoder *in);
 
   inline int input_channels() const { return zita_config_.ninp; }
   inline int output_channels() const { return zita_config_.nout;}
 
-  // Returns if the input buffer has enought samples for the FIR-filter
-  // to process. If not, another call to FillBuffer() is needed.
-  bool is_input_buffer_complete() const {
-    return zita_config_.fragm == input_pos_;
-  }
-
-  // Number of samples that are pending. Typically once we have this passed
-  // over to a new file.
-  int pending_writes() const {
-    return output_pos_ >= 0 ? zita_config_.fragm - output_pos_ : 0;
-  }
-
   // Write number of processed samples out to given soundfile. Processes
   // the data first if necessary. assert(), that there is at least 1 sample
   // to process.
-  void WriteProcessed(SNDFILE *out, int sample_count);
+  // If "quantizer" is given, it converts the samples to integers; otherwise
+  // they're written as float.
+  void WriteProcessed(SNDFILE *out, int sample_count,
+                      PcmQuantizer *quantizer);
+
+  // Like WriteProcessed(), but returns the interleaved samples instead.
+  // Valid until the next FillBuffer().
+  const float *ReadProcessed(int sample_count);
+
+  // Number of frames processed at once.
+  int fragment_size() const { return zita_config_.fragm; }
+
+  // Number of past input frames that influence the output; -1 if the
+  // filter has an infinite impulse response.
+  int history_frames() const;
 
   // Reset procesor for re-use
   void Reset();
@@ -63,25 +70,40 @@ public:
 
   // Config file used to create this processor.
   const std::string &config_file() const { return config_file_; }
+
+  // Short description of the filter as loaded, e.g. impulse length.
+  const std::string &filter_info() const { return filter_info_; }
   time_t config_file_timestamp() const { return config_file_timestamp_; }
 
   // Verifies if configuration is still up-to-date.
   bool ConfigStillUpToDate() const;
 
+  // Returns true if this filter does not change the signal at all, e.g.
+  // just a dirac from each input to the same output.
+  bool is_identity() const;
+
 private:
   SoundProcessor(const ZitaConfig &config, const std::string &cfg_file);
   void Process();
 
   const ZitaConfig zita_config_;
   const std::string config_file_;
+  std::string filter_info_;
   const time_t config_file_timestamp_;
 
-  float *const buffer_;
+  float *const buffer_;       // Interleaved output.
+  float **const input_data_;  // Convolver input buffers, one per channel.
+  float **const output_data_; // Convolver output buffers.
   // TODO: instead of two positions, better have one position and two states
   // READ, WRITE
   int input_pos_;
   int output_pos_;  // written position. -1, if not processed yet.
   float max_out_value_observed_;
+
+  // Frames of digital silence in a row we gave to the convolver; after
+  // silence_settled_ of them, everything in it is zero.
+  int silent_frames_;
+  const int silence_settled_;
 };
 
 #endif  // FOLVE_SOUND_PROCESSOR_H
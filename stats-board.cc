@@ -0,0 +1,164 @@
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "stats-board.h"
+
+#include <sched.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Number of slots we allocate at once. We typically have less than
+// a handful of handlers around.
+static const int kSlotsPerChunk = 16;
+
+template <size_t N>
+static void CopyTruncated(const std::string &from, char (&to)[N]) {
+  const size_t len = std::min(from.length(), N - 1);
+  memcpy(to, from.data(), len);
+  to[len] = '\0';
+}
+
+HandlerStatsSlot::HandlerStatsSlot() : sequence_(0), allocated_(false) {
+  Clear();
+}
+
+void HandlerStatsSlot::BeginWrite() {
+  write_mutex_.Lock();
+  __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void HandlerStatsSlot::EndWrite() {
+  __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELEASE);
+  write_mutex_.Unlock();
+}
+
+void HandlerStatsSlot::Clear() {
+  memset(&data_, 0, sizeof(data_));
+  data_.in_use = false;
+  data_.duration_seconds = -1;
+  data_.access_progress = -1;
+  data_.buffer_progress = -1;
+  data_.status = HandlerStats::OPEN;
+}
+
+void HandlerStatsSlot::Publish(const HandlerStats &stats) {
+  BeginWrite();
+  data_.in_use = true;
+  CopyTruncated(stats.filename, data_.filename);
+  CopyTruncated(stats.format, data_.format);
+  CopyTruncated(stats.message, data_.message);
+  CopyTruncated(stats.filter_dir, data_.filter_dir);
+  CopyTruncated(stats.config_file, data_.config_file);
+  CopyTruncated(stats.filter_info, data_.filter_info);
+  data_.duration_seconds = stats.duration_seconds;
+  data_.access_progress = stats.access_progress;
+  data_.buffer_progress = stats.buffer_progress;
+  data_.max_output_value = stats.max_output_value;
+  data_.in_gapless = stats.in_gapless;
+  data_.out_gapless = stats.out_gapless;
+  EndWrite();
+}
+
+void HandlerStatsSlot::SetCacheStatus(HandlerStats::Status status,
+                                      double last_access) {
+  BeginWrite();
+  data_.status = status;
+  data_.last_access = last_access;
+  EndWrite();
+}
+
+bool HandlerStatsSlot::Read(HandlerStats *stats) const {
+  Data copy;
+  unsigned int before, after = 0;
+  do {
+    before = __atomic_load_n(&sequence_, __ATOMIC_ACQUIRE);
+    if (before & 1) {  // Writer in progress.
+      sched_yield();
+      continue;
+    }
+    memcpy(&copy, &data_, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&sequence_, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+
+  if (!copy.in_use)
+    return false;
+  stats->filename = copy.filename;
+  stats->format = copy.format;
+  stats->message = copy.message;
+  stats->filter_dir = copy.filter_dir;
+  stats->config_file = copy.config_file;
+  stats->filter_info = copy.filter_info;
+  stats->duration_seconds = copy.duration_seconds;
+  stats->access_progress = copy.access_progress;
+  stats->buffer_progress = copy.buffer_progress;
+  stats->status = copy.status;
+  stats->last_access = copy.last_access;
+  stats->max_output_value = copy.max_output_value;
+  stats->in_gapless = copy.in_gapless;
+  stats->out_gapless = copy.out_gapless;
+  return true;
+}
+
+struct HandlerStatsBoard::Chunk {
+  Chunk() : next(NULL) {}
+  HandlerStatsSlot slots[kSlotsPerChunk];
+  Chunk *next;
+};
+
+HandlerStatsBoard::HandlerStatsBoard() : head_(NULL) {}
+
+HandlerStatsSlot *HandlerStatsBoard::Acquire() {
+  folve::MutexLock l(&alloc_mutex_);
+  for (Chunk *c = head_; c != NULL; c = c->next) {
+    for (int i = 0; i < kSlotsPerChunk; ++i) {
+      if (!c->slots[i].allocated_) {
+        c->slots[i].allocated_ = true;
+        return &c->slots[i];
+      }
+    }
+  }
+  Chunk *chunk = new Chunk();
+  chunk->next = head_;
+  chunk->slots[0].allocated_ = true;
+  // Readers might traverse concurrently; only publish fully set up chunk.
+  __atomic_store_n(&head_, chunk, __ATOMIC_RELEASE);
+  return &chunk->slots[0];
+}
+
+void HandlerStatsBoard::Release(HandlerStatsSlot *slot) {
+  if (slot == NULL) return;
+  slot->BeginWrite();
+  slot->Clear();
+  slot->EndWrite();
+  folve::MutexLock l(&alloc_mutex_);
+  slot->allocated_ = false;
+}
+
+void HandlerStatsBoard::GetStats(std::vector<HandlerStats> *stats) const {
+  HandlerStats s;
+  for (const Chunk *c = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+       c != NULL; c = c->next) {
+    for (int i = 0; i < kSlotsPerChunk; ++i) {
+      if (c->slots[i].Read(&s)) {
+        stats->push_back(s);
+      }
+    }
+  }
+}
@@ -0,0 +1,98 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_STATS_BOARD_H
+#define FOLVE_STATS_BOARD_H
+
+#include <vector>
+
+#include "file-handler.h"
+#include "util.h"
+
+// A slot a FileHandler publishes its HandlerStats into. Readers copy the
+// content without taking any lock (seqlock), so rendering the status page
+// never blocks file handling. Strings are stored in fixed size buffers
+// (truncated if needed), so that the content is plain old data that can be
+// copied in one go.
+class HandlerStatsSlot {
+public:
+  HandlerStatsSlot();
+
+  // -- Writers. These are serialized with a writer-only mutex.
+
+  // Publish the values the FileHandler knows about.
+  void Publish(const HandlerStats &stats);
+
+  // Publish the values the FileHandlerCache knows about.
+  void SetCacheStatus(HandlerStats::Status status, double last_access);
+
+  // -- Reader. Never blocks writers. Returns false if slot is not in use.
+  bool Read(HandlerStats *stats) const;
+
+private:
+  friend class HandlerStatsBoard;
+
+  struct Data {
+    bool in_use;
+    char filename[512];
+    char format[64];
+    char message[256];
+    char filter_dir[128];
+    char config_file[512];
+    char filter_info[256];
+    int duration_seconds;
+    float access_progress;
+    float buffer_progress;
+    HandlerStats::Status status;
+    double last_access;
+    float max_output_value;
+    bool in_gapless;
+    bool out_gapless;
+  };
+
+  void BeginWrite();
+  void EndWrite();
+  void Clear();
+
+  folve::Mutex write_mutex_;
+  unsigned int sequence_;    // odd while a write is in progress.
+  Data data_;
+  bool allocated_;           // Protected by HandlerStatsBoard mutex.
+};
+
+// A collection of HandlerStatsSlots. Slots are handed out to FileHandlers
+// and returned when the handler is gone; the memory of a slot is never
+// freed, so readers can always safely look at all of them.
+class HandlerStatsBoard {
+public:
+  HandlerStatsBoard();
+
+  HandlerStatsSlot *Acquire();
+  void Release(HandlerStatsSlot *slot);
+
+  // Append a copy of all slots in use to "stats". Lock-free.
+  void GetStats(std::vector<HandlerStats> *stats) const;
+
+private:
+  struct Chunk;
+
+  folve::Mutex alloc_mutex_;
+  Chunk *head_;  // Chunks are only ever prepended.
+};
+
+#endif  // FOLVE_STATS_BOARD_H
@@ -37,6 +37,7 @@
 #include "util.h"
 
 using folve::Appendf;
+using folve::StringPrintf;
 
 // To be used in CSS constant.
 #define PROGRESS_WIDTH "300"
@@ -281,6 +282,15 @@ void StatusServer::AppendFileInfo(const char *progress_access_color,
   }
   if (!stats.message.empty()) {
     Appendf(out, sMessageRowHtml, status, stats.message.c_str());
+  } else if (stats.max_output_value > 1.0) {
+    std::string clip_message
+      = StringPrintf("Output clipping! "
+                     "(max=%.3f; Multiply gain with <= %.5f<br/>in ",
+                     stats.max_output_value, 1.0 / stats.max_output_value);
+    AppendSanitizedHTML(stats.config_file.empty()
+                        ? "filter" : stats.config_file, &clip_message);
+    clip_message.append(")");
+    Appendf(out, sMessageRowHtml, status, clip_message.c_str());
   } else if (stats.access_progress == 0 && stats.buffer_progress <= 0) {
     // TODO(hzeller): we really need a way to display message and progress
     // bar in parallel.
@@ -317,6 +327,10 @@ void StatusServer::AppendFileInfo(const char *progress_access_color,
     ? "Pass Through" : stats.filter_dir.c_str();
   Appendf(out, "<td class='fb'>&nbsp;%s (", stats.format.c_str());
   AppendSanitizedHTML(filter_dir, out);
+  if (show_details() && !stats.filter_info.empty()) {
+    out->append("; ");
+    AppendSanitizedHTML(stats.filter_info, out);
+  }
   out->append(")&nbsp;</td><td class='fn'>");
   AppendSanitizedHTML(stats.filename, out);
   out->append("</td></tr>\n");
@@ -458,18 +472,24 @@ void StatusServer::CreatePage(bool for_http, std::string *content) {
   }
   content->append("</table><hr/>\n");
 
-  if (retired_.size() > 0) {
+  // Copy, so that we don't hold the lock while rendering.
+  RetiredList retired;
+  int expunged_retired;
+  retired_mutex_.Lock();
+  retired = retired_;
+  expunged_retired = expunged_retired_;
+  retired_mutex_.Unlock();
+  if (retired.size() > 0) {
     content->append("<h3>Retired</h3>\n");
     content->append("<table>\n");
-    folve::MutexLock l(&retired_mutex_);
-    for (RetiredList::const_iterator it = retired_.begin();
-         it != retired_.end(); ++it) {
+    for (RetiredList::const_iterator it = retired.begin();
+         it != retired.end(); ++it) {
       AppendFileInfo(kRetiredAccessProgress, kRetiredBufferProgress, *it,
                      content);
     }
     content->append("</table>\n");
-    if (expunged_retired_ > 0) {
-      Appendf(content, "... (%d more)<p></p>", expunged_retired_);
+    if (expunged_retired > 0) {
+      Appendf(content, "... (%d more)<p></p>", expunged_retired);
     }
     content->append("<hr/>");
   }
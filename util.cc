@@ -35,6 +35,14 @@ double folve::CurrentTime() {
   return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
+bool folve::Mutex::WaitOn(pthread_cond_t *cond, double timeout_seconds) {
+  const double deadline = CurrentTime() + timeout_seconds;
+  struct timespec ts;
+  ts.tv_sec = (time_t) deadline;
+  ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1e9);
+  return pthread_cond_timedwait(cond, &mutex_, &ts) == 0;
+}
+
 static void vAppendf(std::string *str, const char *format, va_list ap) {
   const size_t orig_len = str->length();
   const size_t space = 1024;   // there should be better ways to do this...
@@ -86,15 +94,19 @@ bool folve::HasSuffix(const std::string &str, const std::string &suffix) {
 }
 
 void *folve::Thread::PthreadCallRun(void *tobject) {
-  // Some hardcoded nicification of the thread. We use it for the pre-buffering
-  // which is nice-to-have and shouldn't interfere too much with other stuff.
-  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 2);
-
-  reinterpret_cast<folve::Thread*>(tobject)->Run();
+  folve::Thread *thread = reinterpret_cast<folve::Thread*>(tobject);
+  if (thread->background_) {
+    // Some hardcoded nicification of the thread. We use it for the
+    // pre-buffering which is nice-to-have and shouldn't interfere too much
+    // with other stuff.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 2);
+  }
+  thread->Run();
   return NULL;
 }
 
-folve::Thread::Thread() : started_(false) {}
+folve::Thread::Thread(bool background)
+  : background_(background), started_(false) {}
 folve::Thread::~Thread() {
   int result = pthread_join(thread_, NULL);
   if (result != 0) {
@@ -107,10 +119,11 @@ void folve::Thread::Start() {
   pthread_create(&thread_, NULL, &PthreadCallRun, this);
 
 #ifdef SCHED_IDLE
-  // Background thread:
-  struct sched_param p;
-  p.sched_priority = 0;
-  pthread_setschedparam(thread_, SCHED_IDLE, &p);
+  if (background_) {
+    struct sched_param p;
+    p.sched_priority = 0;
+    pthread_setschedparam(thread_, SCHED_IDLE, &p);
+  }
 #endif
 
   started_ = true;
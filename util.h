@@ -59,6 +59,9 @@ namespace folve {
     void Lock() { pthread_mutex_lock(&mutex_); }
     void Unlock() { pthread_mutex_unlock(&mutex_); }
     void WaitOn(pthread_cond_t *cond) { pthread_cond_wait(cond, &mutex_); }
+    // Like WaitOn(), but gives up after "timeout_seconds". Returns false
+    // on timeout.
+    bool WaitOn(pthread_cond_t *cond, double timeout_seconds);
 
   private:
     pthread_mutex_t mutex_;
@@ -73,10 +76,11 @@ namespace folve {
     Mutex *const mutex_;
   };
 
-  // Thread.
+  // Thread. A "background" thread runs with low priority, so that it only
+  // uses CPU nobody else needs.
   class Thread {
   public:
-    Thread();
+    explicit Thread(bool background = true);
     virtual ~Thread();
 
     void Start();
@@ -86,6 +90,7 @@ namespace folve {
 
   private:
     static void *PthreadCallRun(void *tobject);
+    const bool background_;
     bool started_;
     pthread_t thread_;
   };
@@ -36,11 +36,26 @@
 #include <libgen.h>
 #include <syslog.h>
 
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "convolver-shards.h"
+#include "direct-fir.h"
+#include "gain-delay.h"
+#include "iir-filter.h"
+#include "impulse-matrix.h"
+#include "mid-side.h"
 #include "zita-audiofile.h"
 #include "zita-config.h"
 
 // zita-config
 #define BSIZE  0x4000
+#define TRIMFADE 64     // Samples to fade out at the end of a trimmed impulse.
+#define MINSHARDGROUPS 3  // Fewer independent groups are not worth a thread each.
+
+typedef std::vector<std::pair<int, int> > PairList;   // input, output
 
 
 static int check_inout (ZitaConfig *cfg, int ip, int op)
@@ -52,6 +67,69 @@ static int check_inout (ZitaConfig *cfg, int ip, int op)
 }
 
 
+// Give impulse data to the convolver. Short impulses are also kept for
+// the direct FIR, in case they all turn out to be short enough.
+static int impcreate (ZitaConfig *cfg, unsigned int ip, unsigned int op,
+                      unsigned int step, float *data, int i0, int i1)
+{
+    if (cfg->convproc->impdata_create (ip, op, step, data, i0, i1)) return ERR_ALLOC;
+    cfg->routes->MarkConvolved (ip, op);
+    cfg->impulses++;
+    if (i1 > cfg->impulse_length) cfg->impulse_length = i1;
+    if (i1 > cfg->untrimmed_length) cfg->untrimmed_length = i1;
+    if (((cfg->ninp == 2) && (cfg->nout == 2)) || (cfg->max_shards > 1))
+    {
+        if (! cfg->matrix) cfg->matrix = new ImpulseMatrix (cfg->ninp, cfg->nout);
+        cfg->matrix->AddImpulse (ip, op, step, data, i0, i1);
+    }
+    if (i1 > MAXDIRECT)
+    {
+        delete cfg->fir;
+        cfg->fir = 0;
+        cfg->long_impulse = true;
+    }
+    else if (! cfg->long_impulse)
+    {
+        if (! cfg->fir) cfg->fir = new DirectFir ();
+        cfg->fir->AddImpulse (ip, op, step, data, i0, i1);
+    }
+    return 0;
+}
+
+
+// Find where the impulse finally decays below the trim threshold relative
+// to its peak and fade out from there. Returns the number of samples to use.
+static unsigned int trimtail (ZitaConfig *cfg, float *imp, unsigned int length,
+                              int lnum, const char *file)
+{
+    unsigned int  i, end, saved;
+    float         peak, limit;
+
+    peak = 0;
+    for (i = 0; i < length; i++)
+    {
+        if (fabsf (imp [i]) > peak) peak = fabsf (imp [i]);
+    }
+    limit = peak * cfg->trim_threshold;
+    end = length;
+    while ((end > 0) && (fabsf (imp [end - 1]) <= limit)) end--;
+    end = (end + TRIMFADE < length) ? end + TRIMFADE : length;
+    if (end == length) return length;
+
+    // The samples we fade are below the threshold anyway; this just avoids
+    // ending with a step.
+    for (i = 0; i < TRIMFADE; i++)
+    {
+        imp [end - TRIMFADE + i] *= 0.5f * (1 + cosf ((i + 1) * M_PI / TRIMFADE));
+    }
+    saved = (length + cfg->fragm - 1) / cfg->fragm - (end + cfg->fragm - 1) / cfg->fragm;
+    syslog(LOG_INFO, "%s:%d: Trimmed '%s' from %u to %u samples; "
+           "%u partitions of %d less.\n",
+           cfg->config_file, lnum, file, length, end, saved, cfg->fragm);
+    return end;
+}
+
+
 static int readfile (ZitaConfig *cfg,
                      const char *line, int lnum, const char *cdir)
 {
@@ -61,11 +139,12 @@ static int readfile (ZitaConfig *cfg,
     unsigned int  offset;
     unsigned int  length;
     unsigned int  ichan, nchan;
+    unsigned int  total, used;
     int           n, ifram, nfram, err;
     char          file [1024];
     char          path [1024];
     Audiofile     audio;
-    float         *buff, *p;
+    float         *buff, *imp, *p;
 
     if (sscanf (line, "%u %u %f %u %u %u %u %n",
                 &ip1, &op1, &gain, &delay, &offset, &length, &ichan, &n) != 7) return ERR_PARAM;
@@ -134,19 +213,25 @@ static int readfile (ZitaConfig *cfg,
    	syslog(LOG_ERR, "%s:%d: Data truncated.\n", cfg->config_file, lnum);
     }
 
+    buff = 0;
+    imp = 0;
     try
     {
         buff = new float [BSIZE * nchan];
+        imp = new float [length];
     }
     catch (...)
     {
+	delete[] buff;
 	audio.close ();
         return ERR_ALLOC;
     }
 
-    while (length)
+    // Collect the whole impulse first, so that we can trim its tail.
+    total = 0;
+    while (total < length)
     {
-	nfram = (length > BSIZE) ? BSIZE : length;
+	nfram = (length - total > BSIZE) ? BSIZE : length - total;
 	nfram = audio.read (buff, nfram);
 	if (nfram < 0)
 	{
@@ -154,26 +239,25 @@ static int readfile (ZitaConfig *cfg,
                    cfg->config_file, lnum);
 	    audio.close ();
 	    delete[] buff;
+	    delete[] imp;
 	    return ERR_OTHER;
 	}
-	if (nfram)
-	{
-	    p = buff + ichan - 1;
-	    for (ifram = 0; ifram < nfram; ifram++) p [ifram * nchan] *= gain;
-            if (cfg->convproc->impdata_create (ip1 - 1, op1 - 1, nchan, p, delay, delay + nfram))
-            {
-	        audio.close ();
-                delete[] buff;
-	        return ERR_ALLOC;
-            }
-	    delay  += nfram;
-	    length -= nfram;
-	}
+	if (nfram == 0) break;
+	p = buff + ichan - 1;
+	for (ifram = 0; ifram < nfram; ifram++) imp [total + ifram] = p [ifram * nchan] * gain;
+	total += nfram;
     }
-
     audio.close ();
     delete[] buff;
-    return 0;
+
+    used = total;
+    if (cfg->trim_threshold > 0) used = trimtail (cfg, imp, total, lnum, file);
+    if (delay + total > (unsigned int) cfg->untrimmed_length) cfg->untrimmed_length = delay + total;
+
+    err = 0;
+    if (used && impcreate (cfg, ip1 - 1, op1 - 1, 1, imp, delay, delay + used)) err = ERR_ALLOC;
+    delete[] imp;
+    return err;
 }
 
 
@@ -198,13 +282,8 @@ static int impdirac (ZitaConfig *cfg, const char *line, int lnum)
     }
     delay -= k;
 
-    if (delay < cfg->size)
-    {
-	if (cfg->convproc->impdata_create (ip1 - 1, op1 - 1, 1, &gain, delay, delay + 1))
-	{
-	    return ERR_ALLOC;
-	}
-    }
+    // Just a gain and delay; no need to convolve.
+    if (delay < cfg->size) cfg->routes->AddTap (ip1 - 1, op1 - 1, gain, delay);
     return 0;
 }
 
@@ -249,7 +328,7 @@ static int imphilbert (ZitaConfig *cfg, const char *line, int lnum)
 	hdata [h - i] =  v;
     }
 
-    if (cfg->convproc->impdata_create (ip1 - 1, op1 - 1, 1, hdata, delay, delay + length))
+    if (impcreate (cfg, ip1 - 1, op1 - 1, 1, hdata, delay, delay + length))
     {
         return ERR_ALLOC;
     }
@@ -271,7 +350,16 @@ static int impcopy (ZitaConfig *cfg, const char *line, int lnum)
 
     if ((ip1 != ip2) || (op1 != op2))
     {
-        if (cfg->convproc->impdata_copy (ip2 - 1, op2 - 1, ip1 - 1, op1 - 1)) return ERR_ALLOC;
+        // Diracs are copied as they are now; the convolution symbolically.
+        cfg->routes->Copy (ip1 - 1, op1 - 1, ip2 - 1, op2 - 1);
+        if (cfg->routes->IsConvolved (ip2 - 1, op2 - 1))
+        {
+            if (cfg->convproc->impdata_copy (ip2 - 1, op2 - 1, ip1 - 1, op1 - 1)) return ERR_ALLOC;
+            if (cfg->fir) cfg->fir->CopyImpulse (ip1 - 1, op1 - 1, ip2 - 1, op2 - 1);
+            if (cfg->matrix) cfg->matrix->CopyImpulse (ip1 - 1, op1 - 1, ip2 - 1, op2 - 1);
+            cfg->routes->MarkConvolved (ip1 - 1, op1 - 1);
+            cfg->impulses++;
+        }
     }
     else return ERR_PARAM;
 
@@ -279,6 +367,225 @@ static int impcopy (ZitaConfig *cfg, const char *line, int lnum)
 }
 
 
+static int imptrim (ZitaConfig *cfg, const char *line)
+{
+    float db;
+
+    if (sscanf (line, "%f", &db) != 1) return ERR_PARAM;
+    if (db >= 0) return ERR_PARAM;
+    cfg->trim_threshold = powf (10, db / 20);
+    return 0;
+}
+
+
+static int convdirect (ZitaConfig *cfg, const char *line)
+{
+    int length;
+
+    if (sscanf (line, "%d", &length) != 1) return ERR_PARAM;
+    if ((length < 0) || (length > MAXDIRECT)) return ERR_PARAM;
+    cfg->direct_max = length;
+    return 0;
+}
+
+
+static int iirbiquad (ZitaConfig *cfg, const char *line, int lnum)
+{
+    unsigned int    ip1, op1;
+    char            name [64];
+    double          freq, q, gain;
+    IirFilter::Type type;
+    int             r, stat;
+
+    r = sscanf (line, "%u %u %63s %lf %lf %lf", &ip1, &op1, name, &freq, &q, &gain);
+    if (r < 5) return ERR_PARAM;
+    if (r < 6) gain = 0;
+
+    stat = check_inout (cfg, ip1, op1);
+    if (stat) return stat;
+
+    if (! IirFilter::ParseType (name, &type))
+    {
+        syslog(LOG_ERR, "%s:%d: Unknown biquad type '%s'.\n",
+               cfg->config_file, lnum, name);
+        return ERR_PARAM;
+    }
+    if (! cfg->iir) cfg->iir = new IirFilter ();
+    if (! cfg->iir->AddBiquad (ip1 - 1, op1 - 1, type, cfg->fsamp, freq, q, gain))
+    {
+        syslog(LOG_ERR, "%s:%d: Biquad frequency or Q out of range.\n",
+               cfg->config_file, lnum);
+        return ERR_PARAM;
+    }
+    return 0;
+}
+
+
+// A symmetric stereo matrix only needs two convolutions on mid and side
+// instead of four.
+static bool midside (ZitaConfig *cfg)
+{
+    std::vector<float>  mid, side;
+
+    if (! MidSide::GetImpulses (*cfg->matrix, &mid, &side)) return false;
+    delete cfg->matrix;
+    cfg->matrix = new ImpulseMatrix (2, 2);
+    cfg->matrix->AddImpulse (0, 0, 1, &mid [0], 0, mid.size ());
+    cfg->matrix->AddImpulse (1, 1, 1, &side [0], 0, side.size ());
+    cfg->mid_side = true;
+    syslog(LOG_INFO, "%s: symmetric stereo filter; convolving mid and side.",
+           cfg->config_file);
+    return true;
+}
+
+
+static int findgroup (std::vector<int> &group, int i)
+{
+    while (group [i] != i) i = group [i] = group [group [i]];
+    return i;
+}
+
+
+static bool biggergroup (const PairList *a, const PairList *b)
+{
+    return a->size () > b->size ();
+}
+
+
+// Split the impulses into groups of inputs and outputs that are
+// independent of each other, and these into at most max_shards shards.
+// Plain stereo (L->L, R->R) stays in one shard.
+static void convgroups (ZitaConfig *cfg, std::vector<PairList> *shards)
+{
+    const ImpulseMatrix        *matrix = cfg->matrix;
+    const int                  ninp = matrix->inputs ();
+    std::vector<int>           group (ninp + matrix->outputs ());
+    std::map<int, PairList>    groups;
+    std::vector<PairList *>    bysize;
+    int                        ip, op, a, b;
+    size_t                     i, s, best;
+
+    for (i = 0; i < group.size (); i++) group [i] = i;
+    for (ip = 0; ip < ninp; ip++)
+    {
+        for (op = 0; op < matrix->outputs (); op++)
+        {
+            if (! matrix->Impulse (ip, op)) continue;
+            a = findgroup (group, ip);
+            b = findgroup (group, ninp + op);
+            group [a] = b;
+        }
+    }
+    for (ip = 0; ip < ninp; ip++)
+    {
+        for (op = 0; op < matrix->outputs (); op++)
+        {
+            if (! matrix->Impulse (ip, op)) continue;
+            groups [findgroup (group, ip)].push_back (std::make_pair (ip, op));
+        }
+    }
+
+    // Biggest groups first, each to the shard with the least work so far.
+    for (std::map<int, PairList>::iterator it = groups.begin (); it != groups.end (); ++it)
+    {
+        bysize.push_back (&it->second);
+    }
+    std::sort (bysize.begin (), bysize.end (), biggergroup);
+    if ((int) bysize.size () < MINSHARDGROUPS) shards->resize (1);
+    else shards->resize (std::min ((int) bysize.size (), std::max (cfg->max_shards, 1)));
+    for (i = 0; i < bysize.size (); i++)
+    {
+        best = 0;
+        for (s = 1; s < shards->size (); s++)
+        {
+            if ((*shards) [s].size () < (*shards) [best].size ()) best = s;
+        }
+        (*shards) [best].insert ((*shards) [best].end (), bysize [i]->begin (), bysize [i]->end ());
+    }
+}
+
+
+// Configure the convolver and give it the impulses for the given pairs,
+// keeping copies as copies where we can.
+static int convload (ZitaConfig *cfg, Convproc *convproc, const PairList &pairs)
+{
+    std::set<std::pair<int, int> >  loaded;
+    const std::vector<float>        *imp;
+    int                             ip, op, fi, fo;
+
+    if (convconfigure (cfg, convproc)) return ERR_OTHER;
+    for (size_t i = 0; i < pairs.size (); i++)
+    {
+        ip = pairs [i].first;
+        op = pairs [i].second;
+        if (! cfg->matrix->IsOriginal (ip, op, &fi, &fo) && loaded.count (std::make_pair (fi, fo)))
+        {
+            if (convproc->impdata_copy (fi, fo, ip, op)) return ERR_ALLOC;
+            continue;
+        }
+        imp = cfg->matrix->Impulse (ip, op);
+        if (convproc->impdata_create (ip, op, 1, (float *) &(*imp) [0], 0, imp->size ())) return ERR_ALLOC;
+        loaded.insert (pairs [i]);
+    }
+    return 0;
+}
+
+
+// All impulses are known now; set up the convolution the best way for them.
+static int convrebuild (ZitaConfig *cfg)
+{
+    std::vector<PairList>  shards;
+    ConvolverShards        *convshards;
+    Convproc               *convproc;
+    std::set<int>          inputs, outputs;
+    int                    stat;
+
+    if ((cfg->ninp == 2) && (cfg->nout == 2)) midside (cfg);
+    convgroups (cfg, &shards);
+    if (shards.size () < 2)
+    {
+        // Unless we changed the impulses, convproc has them already.
+        if (! cfg->mid_side) return 0;
+        cfg->convproc->cleanup ();
+        return convload (cfg, cfg->convproc, shards [0]);
+    }
+
+    convshards = new ConvolverShards ();
+    for (size_t s = 0; s < shards.size (); s++)
+    {
+        convproc = new Convproc ();
+        if ((stat = convload (cfg, convproc, shards [s])))
+        {
+            convproc->cleanup ();
+            delete convproc;
+            delete convshards;
+            return stat;
+        }
+        inputs.clear ();
+        outputs.clear ();
+        for (size_t i = 0; i < shards [s].size (); i++)
+        {
+            inputs.insert (shards [s][i].first);
+            outputs.insert (shards [s][i].second);
+        }
+        convshards->Add (convproc, std::vector<int> (inputs.begin (), inputs.end ()),
+                         std::vector<int> (outputs.begin (), outputs.end ()));
+    }
+    // The main convolver only provides the input buffers now.
+    cfg->convproc->cleanup ();
+    if ((stat = convload (cfg, cfg->convproc, PairList ())))
+    {
+        delete convshards;
+        return stat;
+    }
+    convshards->Start ();
+    cfg->shards = convshards;
+    syslog(LOG_INFO, "%s: convolving independent channels on %d threads.",
+           cfg->config_file, convshards->size ());
+    return 0;
+}
+
+
 int config (ZitaConfig *cfg, const char *config_file)
 {
     FILE          *F;
@@ -300,6 +607,8 @@ int config (ZitaConfig *cfg, const char *config_file)
 
     // Remember this for error output.
     cfg->config_file = config_file;
+    cfg->direct_max = DEFDIRECT;
+    cfg->routes = new GainDelayRoutes ();
     stat = 0;
     lnum = 0;
 
@@ -332,16 +641,35 @@ int config (ZitaConfig *cfg, const char *config_file)
             }
         }
         else if (! strcmp (p, "/convolver/new"))   stat = convnew (cfg, q, lnum);
+        else if (! strcmp (p, "/convolver/direct")) stat = convdirect (cfg, q);
         else if (! strcmp (p, "/impulse/read"))    stat = readfile (cfg, q, lnum, cdir);
         else if (! strcmp (p, "/impulse/dirac"))   stat = impdirac (cfg, q, lnum);
         else if (! strcmp (p, "/impulse/hilbert")) stat = imphilbert (cfg, q, lnum);
         else if (! strcmp (p, "/impulse/copy"))    stat = impcopy (cfg, q, lnum);
+        else if (! strcmp (p, "/impulse/trim"))    stat = imptrim (cfg, q);
+        else if (! strcmp (p, "/iir/biquad"))      stat = iirbiquad (cfg, q, lnum);
         else if (! strcmp (p, "/input/name"))      stat = inpname (cfg, q);
         else if (! strcmp (p, "/output/name"))     stat = outname (cfg, q);
         else stat = ERR_COMMAND;
     }
 
     fclose (F);
+    if (cfg->fir && (cfg->fir->length () > cfg->direct_max))
+    {
+        delete cfg->fir;
+        cfg->fir = 0;
+    }
+    if (cfg->routes->empty ())
+    {
+        delete cfg->routes;
+        cfg->routes = 0;
+    }
+    if (cfg->matrix)
+    {
+        if (! stat && ! cfg->fir) stat = convrebuild (cfg);
+        delete cfg->matrix;
+        cfg->matrix = 0;
+    }
     if (stat == ERR_OTHER) stat = 0;
     if (stat)
     {
@@ -34,9 +34,28 @@
 #include <zita-convolver.h>
 #include "zita-sstring.h"
 
+class DirectFir;
+class GainDelayRoutes;
+class IirFilter;
+class ImpulseMatrix;
+class ConvolverShards;
+
 struct ZitaConfig {
   const char *config_file;   // Configuration file we're reading from.
   Convproc *convproc;        // Resulting filter object.
+  IirFilter *iir;            // Biquads, if configured. NULL otherwise.
+  int impulses;              // Number of impulses given to convproc.
+  DirectFir *fir;            // Impulses, if short enough for direct FIR.
+  GainDelayRoutes *routes;   // Diracs, if any. Not given to convproc.
+  ImpulseMatrix *matrix;     // Impulses while reading, to rearrange them.
+  bool mid_side;             // convproc works on mid and side.
+  int max_shards;            // Convolvers to split independent channels on.
+  ConvolverShards *shards;   // These convolvers, NULL if not split.
+  int direct_max;            // Longest impulse to do with direct FIR.
+  bool long_impulse;         // Seen impulse longer than MAXDIRECT.
+  float trim_threshold;      // Relative to peak; trim impulse tails below.
+  int impulse_length;        // Longest impulse given to convproc.
+  int untrimmed_length;      // ... and how long it would be without trimming.
 
   // Parameters.
   int latency;
@@ -46,6 +65,7 @@ struct ZitaConfig {
   int ninp;
   int nout;
   int size;
+  float density;
 };
 
 enum { NOERR, ERR_OTHER, ERR_SYNTAX, ERR_PARAM, ERR_ALLOC, ERR_CANTCD, ERR_COMMAND, ERR_NOCONV, ERR_IONUM };
@@ -53,12 +73,15 @@ enum { NOERR, ERR_OTHER, ERR_SYNTAX, ERR_PARAM, ERR_ALLOC, ERR_CANTCD, ERR_COMMA
 
 extern int  config (ZitaConfig *cfg, const char *config_file);
 extern int  convnew (ZitaConfig *cfg, const char *line, int lnum);
+extern int  convconfigure (ZitaConfig *cfg, Convproc *convproc);
 extern int  inpname (ZitaConfig *cfg, const char *line);
 extern int  outname (ZitaConfig *cfg, const char *line);
 extern void makeports (void);
 
 
 #define MAXSIZE 0x00100000
+#define MAXDIRECT 4096    // Upper limit for /convolver/direct
+#define DEFDIRECT 128     // Default for /convolver/direct
 
 
 #endif
@@ -45,6 +45,7 @@ int convnew (ZitaConfig *cfg, const char *line, int lnum)
                 &part, &cfg->size, &dens);
     if (r < 4) return ERR_PARAM;
     if (r < 5) dens = 0;
+    cfg->density = dens;
 
     if ((cfg->ninp == 0) || (cfg->ninp > Convproc::MAXINP))
     {
@@ -75,17 +76,25 @@ int convnew (ZitaConfig *cfg, const char *line, int lnum)
     while ((cfg->fragm > Convproc::MINPART) && (cfg->fragm >= 2 * cfg->size)) {
       cfg->fragm /= 2;
     }
-    cfg->convproc->set_options (cfg->options);
+    return convconfigure (cfg, cfg->convproc);
+}
+
+
+// (Re-)configure a convolver with the parameters in cfg.
+int convconfigure (ZitaConfig *cfg, Convproc *convproc)
+{
+    convproc->set_options (cfg->options);
 #if ZITA_CONVOLVER_MAJOR_VERSION >= 4
-    if (cfg->convproc->configure (cfg->ninp, cfg->nout, cfg->size,
-                                  cfg->fragm, cfg->fragm, cfg->fragm, dens))
+    if (convproc->configure (cfg->ninp, cfg->nout, cfg->size,
+                                  cfg->fragm, cfg->fragm, cfg->fragm,
+                                  cfg->density))
     {
         syslog(LOG_ERR, "Can't initialise convolution engine\n");
         return ERR_OTHER;
     }
 #else
-    cfg->convproc->set_density (dens);
-    if (cfg->convproc->configure (cfg->ninp, cfg->nout, cfg->size,
+    convproc->set_density (cfg->density);
+    if (convproc->configure (cfg->ninp, cfg->nout, cfg->size,
                                   cfg->fragm, cfg->fragm, cfg->fragm))
     {
         syslog(LOG_ERR, "Can't initialise convolution engine\n");